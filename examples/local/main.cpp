@@ -23,6 +23,10 @@ int main(int argc, char** argv) {
 
     /* Synchronized directory (local processing and remote saving) */
     fnifi::utils::SyncDirectory storingLocal(&storingServer, argv[1]);
+    /* push the changes in the background, at most once per second */
+    storingLocal.setWriteBehind(1000);
+    /* check the remote changes at most once per second */
+    storingLocal.setLease(1000);
 
     /* File indexing */
     fnifi::FNIFI fi(storingLocal);
@@ -46,9 +50,6 @@ int main(int argc, char** argv) {
             &coll, fnifi::expression::Kind::LATITUDE, "");
         const auto lon = fnifi::file::Info<T>::Build(
             &coll, fnifi::expression::Kind::LONGITUDE, "");
-        ctime->disableSync();
-        lat->disableSync();
-        lon->disableSync();
         std::cout << "Randomly loop over all the files:" << std::endl;
         for (const auto file : fi) {
             T ct, la, lo;
@@ -57,9 +58,6 @@ int main(int argc, char** argv) {
             lon->get(file, lo);
             std::cout << file->getPath() << " " << ct << " " << " " << la << " " << lo << std::endl;
         }
-        ctime->enableSync();
-        lat->enableSync();
-        lon->enableSync();
     }
 
     /* sort the files by ctime */
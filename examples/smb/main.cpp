@@ -39,6 +39,10 @@ int main(int argc, char** argv) {
 
     /* Synchronized directory (local processing and remote saving) */
     fnifi::utils::SyncDirectory storingLoc(&storingSer, storingLocal);
+    /* push the changes in the background, at most once per second */
+    storingLoc.setWriteBehind(1000);
+    /* check the remote changes at most once per second */
+    storingLoc.setLease(1000);
 
     /* File indexing */
     fnifi::FNIFI fi(storingLoc);
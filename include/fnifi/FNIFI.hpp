@@ -3,15 +3,36 @@
 
 #include "fnifi/file/Collection.hpp"
 #include "fnifi/file/File.hpp"
+#include "fnifi/file/InfoIndex.hpp"
+#include "fnifi/file/GeoIndex.hpp"
 #include "fnifi/expression/Expression.hpp"
+#include "fnifi/expression/Persisted.hpp"
 #include "fnifi/utils/SyncDirectory.hpp"
+#include "fnifi/utils/Task.hpp"
 #include <sxeval/SXEval.hpp>
 #include <vector>
 #include <set>
+#include <map>
 #include <unordered_set>
+#include <unordered_map>
 #include <iterator>
 #include <cstddef>
 #include <memory>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <ctime>
+
+#define DEFAULT_MAX_EXPRESSIONS 8
+/* per Collection, in bytes */
+#define DEFAULT_CACHE_MAX_SIZE 104857600L
+/* in seconds */
+#define DEFAULT_CACHE_MAX_AGE 2592000L
+/* time without calls before the warm-up resumes */
+#define WARMUP_IDLE_DELAY_MS 500
 
 
 namespace fnifi {
@@ -19,6 +40,29 @@ namespace fnifi {
 class FNIFI {
 public:
     typedef std::multiset<const file::File*, file::File::pCompare> fileset_t;
+    struct Range {
+        expression::Kind kind;
+        std::string key;
+        expr_t min;
+        expr_t max;
+    };
+    struct Box {
+        expr_t minLat;
+        expr_t maxLat;
+        expr_t minLon;
+        expr_t maxLon;
+    };
+    /* min and max are EMPTY_EXPR_T without any value, and sum saturates
+     * at the bounds of expr_t */
+    struct Facet {
+        size_t count;
+        /* files of the bucket without any value, left out of the others */
+        size_t missing;
+        expr_t min;
+        expr_t max;
+        expr_t sum;
+    };
+    typedef std::map<expr_t, Facet> facets_t;
     class Iterator {
     public:
         using iterator_category = std::forward_iterator_tag;
@@ -27,9 +71,7 @@ public:
         using pointer = const file::File*;
         using reference = const file::File*;
 
-        Iterator(fileset_t::const_iterator p,
-                 std::unordered_set<const file::File*>& toRemove,
-                 FNIFI::fileset_t& files);
+        Iterator(size_t i, FNIFI& fnifi);
         reference operator*() const;
         pointer operator->() const;
         Iterator& operator++();
@@ -38,19 +80,85 @@ public:
         bool operator!=(const Iterator& other) const;
 
     private:
-        fileset_t::const_iterator _p;
-        std::unordered_set<const file::File*>& _toRemove;
-        fileset_t& _files;
+        bool isEnd() const;
+
+        size_t _i;
+        FNIFI& _fnifi;
     };
 
-    FNIFI(utils::SyncDirectory& storing);
+    FNIFI(utils::SyncDirectory& storing,
+          size_t maxExpressions = DEFAULT_MAX_EXPRESSIONS);
+    ~FNIFI();
     void addCollection(file::Collection& coll, bool index = false);
     void index();
     void defragment();
     void sort(const std::string& expr);
-    void filter(const std::string& expr);
+    /**
+     * A lazy filter is only evaluated on the files reached while iterating
+     */
+    void filter(const std::string& expr, bool lazy = false);
+    void search(const std::string& pattern, bool prefix = false);
+    /**
+     * Keep only the files whose value of the kind lies in [min, max],
+     * answered by the sorted index of the column instead of evaluating each
+     * file. The ranges are combined with each other, the filter and the
+     * search
+     */
+    void range(expression::Kind kind, expr_t min, expr_t max,
+               const std::string& key = "");
+    /**
+     * Keep only the geotagged files in the box (in milliarcseconds, minLon
+     * greater than maxLon crossing the antimeridian), answered by the
+     * GeoIndex. Replaces the previous box
+     */
+    void within(expr_t minLat, expr_t maxLat, expr_t minLon, expr_t maxLon);
+    /**
+     * Asynchronous variants: a new call cancels the running one, and the
+     * instance should not be used otherwise until the returned Task is done
+     */
+    std::shared_ptr<utils::Task> indexAsync();
+    std::shared_ptr<utils::Task> sortAsync(const std::string& expr);
+    std::shared_ptr<utils::Task> filterAsync(const std::string& expr);
+    /**
+     * Remove the expressions' caches not used for maxAge seconds, then the
+     * least recently used ones until they fit in maxSize bytes per Collection.
+     * The expressions in use are kept
+     */
+    void collectGarbage(size_t maxSize = DEFAULT_CACHE_MAX_SIZE,
+                        time_t maxAge = DEFAULT_CACHE_MAX_AGE);
+    /**
+     * Garbage collection in the background, alongside the other calls
+     */
+    std::shared_ptr<utils::Task> collectGarbageAsync(
+        size_t maxSize = DEFAULT_CACHE_MAX_SIZE,
+        time_t maxAge = DEFAULT_CACHE_MAX_AGE);
+    /**
+     * Precompute the listed kinds, and the registered expressions if
+     * expressions is true, for the files found by the next indexations. It
+     * runs in the background at a low priority, while the instance is idle.
+     * Disabled by default
+     */
+    void setWarmUp(const std::vector<expression::Kind>& kinds,
+                   bool expressions = true);
     void clearSort();
     void clearFilter();
+    void clearSearch();
+    void clearRanges();
+    void clearWithin();
+    /**
+     * Group the files that are not filtered out by buckets of bucketSz over
+     * groupBy, and aggregate value (groupBy if empty) over each bucket
+     */
+    facets_t aggregate(const std::string& groupBy, expr_t bucketSz = 1,
+                       const std::string& value = "");
+    /**
+     * Random access to the visible files in the sorted order. With a lazy
+     * filter, the files are evaluated up to the requested position only,
+     * and count() evaluates them all
+     */
+    const file::File* at(size_t i);
+    size_t count();
+    std::vector<const file::File*> slice(size_t first, size_t n);
     Iterator begin();
     Iterator end();
     fileset_t getFiles() const;
@@ -59,12 +167,60 @@ private:
     void indexColl(file::Collection& coll);
     void sortColl(file::Collection& coll);
     void filterColl(file::Collection& coll);
+    /**
+     * Ids of the Collection kept by the search, the ranges and the box,
+     * meaningful only if isRestricted()
+     */
+    std::unordered_set<fileId_t> matchColl(file::Collection& coll) const;
+    bool isRestricted() const;
+    bool isFilteredOut(const file::File* file,
+                       const std::unordered_set<fileId_t>& matches);
+    bool isVisible(const file::File* file);
+    std::shared_ptr<expression::Expression> getExpression(
+        const std::string& expr);
+    bool materialize(size_t n);
+    void resetView();
+    void eraseFromFiles(const file::File* file);
+    void eraseFromView(const file::File* file);
+    void insertInView(const file::File* file);
+    std::shared_ptr<utils::Task> run(const std::function<void()>& job);
+    void collectColl(const std::filesystem::path& collHash, size_t maxSize,
+                     time_t maxAge);
+    std::unique_lock<std::recursive_mutex> busy();
+    void startWarmUp();
+    void warmUp();
 
     std::vector<file::Collection*> _colls;
-    std::unique_ptr<expression::Expression> _sortExpr;
-    std::unique_ptr<expression::Expression> _filtExpr;
+    /* most recently used expressions first */
+    std::list<std::pair<std::string,
+                        std::shared_ptr<expression::Expression>>> _exprs;
+    const size_t _maxExprs;
+    std::shared_ptr<expression::Expression> _sortExpr;
+    std::shared_ptr<expression::Expression> _filtExpr;
+    bool _lazyFilter;
+    std::unordered_map<const file::File*, bool> _lazyResults;
+    std::string _search;
+    bool _searchPrefix;
+    bool _searching;
+    std::vector<Range> _ranges;
+    Box _box;
+    bool _boxing;
     fileset_t _files;
-    std::unordered_set<const file::File*> _toRemove;
+    std::vector<const file::File*> _view;
+    fileset_t::const_iterator _viewEnd;
+    std::shared_ptr<utils::Task> _task;
+    std::shared_ptr<utils::Task> _gcTask;
+    /* guards _exprs and the expressions' caches against the garbage
+     * collection */
+    std::mutex _cacheMtx;
+    std::vector<expression::Kind> _warmKinds;
+    bool _warmExprs;
+    std::deque<std::pair<file::Collection*, fileId_t>> _warmQueue;
+    bool _warming;
+    std::shared_ptr<utils::Task> _warmTask;
+    /* held by the calls and, between two files, by the warm-up */
+    std::recursive_mutex _workMtx;
+    std::atomic<std::chrono::steady_clock::rep> _lastActivity;
     const utils::SyncDirectory& _storing;
 };
 
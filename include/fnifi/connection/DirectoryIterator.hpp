@@ -5,6 +5,7 @@
 #include <unordered_set>
 #include <filesystem>
 #include <ctime>
+#include <sys/types.h>
 #include <functional>
 #ifdef ENABLE_SAMBA
 #include <libsmbclient.h>
@@ -23,6 +24,7 @@ public:
     struct Entry {
         const std::string path;
         const struct timespec mtime;
+        const off_t size;
         bool operator==(const Entry& other) const;
     };
 
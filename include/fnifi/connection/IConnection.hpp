@@ -4,11 +4,19 @@
 #include "fnifi/utils/utils.hpp"
 #include "fnifi/connection/DirectoryIterator.hpp"
 #include <sys/stat.h>
+#include <vector>
+#include <cstddef>
 
 
 namespace fnifi {
 namespace connection {
 
+/* bytes [offset, offset + size) of a file */
+struct Range {
+    size_t offset;
+    size_t size;
+};
+
 class IConnection {
 public:
     virtual ~IConnection();
@@ -22,6 +30,38 @@ public:
     virtual fileBuf_t read(const std::filesystem::path& filepath) = 0;
     virtual void write(const std::filesystem::path& filepath,
                        const fileBuf_t& buffer) = 0;
+    /**
+     * Write the ranges of the buffer at the same positions in the existing
+     * file, without truncating it. Returns false if not supported or failed,
+     * in which case the whole file has to be written
+     */
+    virtual bool writeRanges(const std::filesystem::path& filepath,
+                             const fileBuf_t& buffer,
+                             const std::vector<Range>& ranges);
+    /**
+     * Read the file from the offset to its end. Returns false if not supported
+     * or failed, in which case the whole file has to be read
+     */
+    virtual bool readFrom(const std::filesystem::path& filepath, size_t offset,
+                          fileBuf_t& buffer);
+    /**
+     * Append the buffer to the file, created if missing. Returns false if not
+     * supported or failed, in which case the whole file has to be written
+     */
+    virtual bool append(const std::filesystem::path& filepath,
+                        const fileBuf_t& buffer);
+    /**
+     * Write the buffer, or only its ranges if any, provided that the file
+     * still has the mtime, a null one meaning that it is missing or empty.
+     * The check and the write are atomic among the conditional writes, and
+     * written tells whether the file had the mtime, then set to the new one.
+     * Returns false if not supported or failed, in which case the file has to
+     * be checked and written separately
+     */
+    virtual bool writeIf(const std::filesystem::path& filepath,
+                         const fileBuf_t& buffer,
+                         const std::vector<Range>& ranges,
+                         struct timespec& mtime, bool& written);
     virtual bool download(const std::filesystem::path& from,
                           const std::filesystem::path& to) = 0;
     virtual bool upload(const std::filesystem::path& from,
@@ -23,6 +23,16 @@ public:
     fileBuf_t read(const std::filesystem::path& filepath) override;
     void write(const std::filesystem::path& filepath, const fileBuf_t& buffer)
         override;
+    bool writeRanges(const std::filesystem::path& filepath,
+                     const fileBuf_t& buffer, const std::vector<Range>& ranges)
+        override;
+    bool readFrom(const std::filesystem::path& filepath, size_t offset,
+                  fileBuf_t& buffer) override;
+    bool append(const std::filesystem::path& filepath, const fileBuf_t& buffer)
+        override;
+    bool writeIf(const std::filesystem::path& filepath,
+                 const fileBuf_t& buffer, const std::vector<Range>& ranges,
+                 struct timespec& mtime, bool& written) override;
     bool download(const std::filesystem::path& from,
                   const std::filesystem::path& to) override;
     bool upload(const std::filesystem::path& from,
@@ -2,12 +2,21 @@
 #define FNIFI_EXPRESSION_DISKBACKED_HPP
 
 #include "fnifi/file/Collection.hpp"
+#include "fnifi/file/Change.hpp"
 #include "fnifi/utils/SyncDirectory.hpp"
 #include "fnifi/utils/utils.hpp"
 #include <string>
 #include <filesystem>
 #include <unordered_map>
 #include <memory>
+#include <functional>
+#include <vector>
+#include <ctime>
+
+#define META_EXTENSION ".meta"
+/* in seconds, precision of the last access times to avoid a push on each
+ * instanciation */
+#define ACCESS_RESOLUTION 3600
 
 
 namespace fnifi {
@@ -15,8 +24,34 @@ namespace expression {
 
 class DiskBacked {
 public:
+    /**
+     * Uncache the ids for the results in the directory depending on their
+     * changes, through the files of the live instances when they own them
+     */
     static void Uncache(const utils::SyncDirectory& storing,
-                        const std::filesystem::path& path, fileId_t id);
+                        const std::filesystem::path& path,
+                        const std::unordered_map<fileId_t, file::changes_t>&
+                        ids, const std::vector<DiskBacked*>& live = {});
+    /**
+     * Facets the results of the key hash in the directory depend on, every
+     * facets if unknown
+     */
+    static file::changes_t LoadDependencies(
+        const utils::SyncDirectory& storing, const std::filesystem::path& path,
+        const std::string& keyHash);
+    /**
+     * Evict the results in the directory not accessed for maxAge seconds, then
+     * the least recently accessed ones until they fit in maxSize bytes. evict
+     * is called to remove a key hash and returns false to keep it. Returns the
+     * evicted key hashes
+     */
+    static std::vector<std::string> Collect(
+        const utils::SyncDirectory& storing, const std::filesystem::path& path,
+        size_t maxSize, time_t maxAge,
+        const std::function<bool(const std::string&)>& evict);
+    static void Remove(const utils::SyncDirectory& storing,
+                       const std::filesystem::path& path,
+                       const std::string& keyHash);
 
     DiskBacked(const std::string& key,
                const utils::SyncDirectory& storing,
@@ -25,21 +60,48 @@ public:
     virtual ~DiskBacked();
     expr_t get(const file::File* file);
     void addCollection(const file::Collection& coll);
-    virtual void disableSync(const std::string& collName, bool pull = true);
-    virtual void enableSync(const std::string& collName, bool push = true);
+    const std::string& getKeyHash() const;
+    file::changes_t getDependencies() const;
+    virtual void disableSync(collId_t collId, bool pull = true);
+    virtual void enableSync(collId_t collId, bool push = true);
+
+protected:
+    void setDependencies(file::changes_t deps);
 
 private:
     struct StoredColl {
-        std::unique_ptr<utils::SyncDirectory::FileStream> file;
+        /* nullptr if unknown */
+        std::unique_ptr<utils::SyncDirectory::LoggedFile> file;
         fileId_t NIds;
+        std::filesystem::path dirname;
     };
+    /* sidecar of the results */
+    struct Meta {
+        file::changes_t deps = file::ANY_CHANGE;
+        time_t lastAccess = 0;  /* unknown */
+    };
+
+    /* a plain remote read, the sidecars of the other instances not being
+     * synchronized */
+    static Meta LoadMeta(const utils::SyncDirectory& storing,
+                         const std::filesystem::path& path,
+                         const std::string& keyHash);
+    static Meta ReadMeta(std::istream& is);
 
     virtual expr_t getValue(const file::File* file) = 0;
+    /** false if the instance has no file in the directory */
+    bool uncache(const std::filesystem::path& path,
+                 const std::unordered_map<fileId_t, file::changes_t>& ids);
+    void saveMeta(const std::filesystem::path& dirname) const;
+    StoredColl* getStoredColl(collId_t collId);
 
-    std::unordered_map<std::string, StoredColl> _storedColls;
+    /* indexed by Collection id */
+    std::vector<StoredColl> _storedColls;
     const std::string _keyHash;
     const utils::SyncDirectory& _storing;
-    const std::filesystem::path& _parentDirName;
+    const std::filesystem::path _parentDirName;
+    file::changes_t _deps;
+    bool _depsKnown;
 };
 
 }  /* namespace expression */
@@ -10,6 +10,9 @@
 #include <sxeval/SXEval.hpp>
 #include <string>
 #include <memory>
+#include <vector>
+
+#define EXPRESSIONS_DIRNAME "expressions"
 
 
 namespace fnifi {
@@ -18,20 +21,46 @@ namespace expression {
 class Expression : public DiskBacked {
 public:
     static void Uncache(const utils::SyncDirectory& sync,
-                        const std::filesystem::path& collPath, fileId_t id);
+                        const std::filesystem::path& collPath,
+                        const std::unordered_map<fileId_t, file::changes_t>&
+                        ids, const std::vector<DiskBacked*>& live = {});
+    static file::changes_t LoadDependencies(
+        const utils::SyncDirectory& sync,
+        const std::filesystem::path& collPath, const std::string& keyHash);
+    static std::vector<std::string> Collect(
+        const utils::SyncDirectory& sync,
+        const std::filesystem::path& collPath, size_t maxSize, time_t maxAge,
+        const std::function<bool(const std::string&)>& evict);
+    static void Remove(const utils::SyncDirectory& sync,
+                       const std::filesystem::path& collPath,
+                       const std::string& keyHash);
+    /**
+     * Normalized text of an expression: single spaces, sorted operands of the
+     * commutative operators and no identity operands. Semantically equal
+     * expressions share the same cache
+     */
+    static std::string Canonicalize(const std::string& expr);
 
     Expression(const std::string& expr,
                const utils::SyncDirectory& storing,
                const std::vector<file::Collection*>& colls);
     void addCollection(const file::Collection& coll);
-    void disableSync(const std::string& collName, bool pull = true) override;
-    void enableSync(const std::string& collName, bool push = true) override;
+    void disableSync(collId_t collId, bool pull = true) override;
+    void enableSync(collId_t collId, bool push = true) override;
 
 private:
     struct RefVar {
         std::unique_ptr<Variable> var;
         expr_t ref;
     };
+    struct Node {
+        std::string atom;  /* empty for a list */
+        std::vector<Node> children;
+    };
+
+    static bool Parse(const std::string& expr, size_t& pos, Node& node);
+    static void Simplify(Node& node);
+    static std::string Print(const Node& node);
 
     expr_t getValue(const file::File* file) override;
 
@@ -0,0 +1,92 @@
+#ifndef FNIFI_EXPRESSION_PERSISTED_HPP
+#define FNIFI_EXPRESSION_PERSISTED_HPP
+
+#include "fnifi/utils/SyncDirectory.hpp"
+#include "fnifi/file/Change.hpp"
+#include "fnifi/utils/utils.hpp"
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+#define ORDERS_DIRNAME "orders"
+#define FILTERS_DIRNAME "filters"
+
+
+namespace fnifi {
+namespace expression {
+
+/**
+ * Sorting permutations and filter memberships of the expressions, stored per
+ * Collection under orders/ and filters/, and keyed by the expression hash.
+ * Invalidated entries are dropped from the orders and reset to UNKNOWN in the
+ * memberships, so that only them are evaluated again.
+ */
+class Persisted {
+public:
+    enum State : uint8_t {
+        UNKNOWN = 0,
+        KEPT = 1,
+        FILTERED_OUT = 2,
+    };
+    struct Entry {
+        expr_t score;
+        fileId_t id;
+        bool operator<(const Entry& other) const;
+    };
+    typedef std::vector<Entry> order_t;
+    typedef std::vector<State> membership_t;
+
+    static bool LoadOrder(const utils::SyncDirectory& storing,
+                          const std::filesystem::path& collPath,
+                          const std::string& keyHash, order_t& order);
+    static void SaveOrder(const utils::SyncDirectory& storing,
+                          const std::filesystem::path& collPath,
+                          const std::string& keyHash, const order_t& order);
+    static bool LoadMembership(const utils::SyncDirectory& storing,
+                               const std::filesystem::path& collPath,
+                               const std::string& keyHash,
+                               membership_t& membership);
+    static void SaveMembership(const utils::SyncDirectory& storing,
+                               const std::filesystem::path& collPath,
+                               const std::string& keyHash,
+                               const membership_t& membership);
+    /**
+     * Invalidate the ids for the expressions depending on their changes
+     */
+    static void Invalidate(const utils::SyncDirectory& storing,
+                           const std::filesystem::path& collPath,
+                           const std::unordered_map<fileId_t, file::changes_t>&
+                           ids);
+    static void Remove(const utils::SyncDirectory& storing,
+                       const std::filesystem::path& collPath,
+                       const std::string& keyHash);
+
+private:
+    static void InvalidateOrder(const utils::SyncDirectory& storing,
+                                const std::filesystem::path& path,
+                                const std::unordered_set<fileId_t>& ids);
+    static void InvalidateMembership(const utils::SyncDirectory& storing,
+                                     const std::filesystem::path& path,
+                                     const std::unordered_set<fileId_t>& ids);
+    static std::unordered_set<fileId_t> Affected(
+        const utils::SyncDirectory& storing,
+        const std::filesystem::path& collPath, const std::string& keyHash,
+        const std::unordered_map<fileId_t, file::changes_t>& ids);
+    static bool ReadOrder(utils::SyncDirectory::FileStream& file,
+                          order_t& order);
+
+    /* dependencies of the expressions, keyed by their absolute path */
+    static std::unordered_map<std::string, file::changes_t> _deps;
+    static std::mutex _depsMtx;
+
+    Persisted() = delete;
+};
+
+}  /* namespace expression */
+}  /* namespace fnifi */
+
+#endif  /* FNIFI_EXPRESSION_PERSISTED_HPP */
@@ -8,6 +8,7 @@
 #include "fnifi/expression/Kind.hpp"
 #include "fnifi/utils/utils.hpp"
 #include <string>
+#include <vector>
 
 
 namespace fnifi {
@@ -21,12 +22,16 @@ public:
              const std::vector<file::Collection*>& colls);
 
     expr_t get(const file::File* file);
+    Kind getKind() const;
     void addCollection(const file::Collection& coll);
-    void disableSync(const std::string& collName, bool pull = true);
-    void enableSync(const std::string& collName, bool push = true);
+    void disableSync(collId_t collId, bool pull = true);
+    void enableSync(collId_t collId, bool push = true);
 
 private:
-    std::unordered_map<std::string, file::Info<expr_t>*> _infos;
+    file::Info<expr_t>* getInfo(collId_t collId) const;
+
+    /* indexed by Collection id, nullptr for the unknown ones */
+    std::vector<file::Info<expr_t>*> _infos;
     Kind _kind;
     std::string _name;
 };
@@ -5,6 +5,9 @@
 #include "fnifi/utils/utils.hpp"
 #include "fnifi/utils/SyncDirectory.hpp"
 #include <sys/stat.h>
+#include <unordered_map>
+#include <string>
+#include <mutex>
 
 
 namespace fnifi {
@@ -12,11 +15,19 @@ namespace file {
 
 template<InfoType T>
 class Info;
+template<InfoType T>
+class InfoIndex;
 
 class AFileHelper {
 public:
+    /**
+     * Small integer handle of the name, the same for the whole process, to
+     * index the per-Collection tables instead of hashing the name
+     */
+    static collId_t Intern(const std::string& name);
+
     AFileHelper(const utils::SyncDirectory& storing,
-                const std::filesystem::path& storingPath);
+                const std::filesystem::path& storingPath, collId_t id);
 
     virtual ~AFileHelper();
     virtual std::string getFilePath(fileId_t id) = 0;
@@ -25,13 +36,21 @@ public:
     virtual struct stat getStats(fileId_t id) = 0;
     virtual fileBuf_t read(fileId_t id, bool nocache = false) = 0;
     virtual std::string getName() const = 0;
+    collId_t getId() const;
 
 protected:
     const utils::SyncDirectory& _storing;
     const std::filesystem::path _storingPath;
+    const collId_t _id;
 
     template<InfoType T>
     friend class fnifi::file::Info;
+    template<InfoType T>
+    friend class fnifi::file::InfoIndex;
+
+private:
+    static std::unordered_map<std::string, collId_t> _interned;
+    static std::mutex _internMtx;
 };
 
 }  /* namespace file */
@@ -0,0 +1,50 @@
+#ifndef FNIFI_FILE_CHANGE_HPP
+#define FNIFI_FILE_CHANGE_HPP
+
+#include "fnifi/expression/Kind.hpp"
+#include <cstdint>
+
+
+namespace fnifi {
+namespace file {
+
+/* facets of a file whose changes are detected by the indexation */
+enum Change : uint8_t {
+    NO_CHANGE = 0,
+    SIZE_CHANGE = 1 << 0,
+    MTIME_CHANGE = 1 << 1,
+    CONTENT_CHANGE = 1 << 2,
+    ANY_CHANGE = SIZE_CHANGE | MTIME_CHANGE | CONTENT_CHANGE,
+};
+
+typedef uint8_t changes_t;
+
+/**
+ * Facets a kind of information is extracted from: it has to be processed again
+ * when one of them changed
+ */
+changes_t GetDependencies(expression::Kind kind);
+
+}  /* namespace file */
+}  /* namespace fnifi */
+
+/* IMPLEMENTATIONS */
+
+inline fnifi::file::changes_t fnifi::file::GetDependencies(
+    expression::Kind kind)
+{
+    switch (kind) {
+        case expression::SIZE:
+            return SIZE_CHANGE;
+        case expression::CTIME:
+        case expression::MTIME:
+            /* fallback to the system's times */
+            return MTIME_CHANGE | CONTENT_CHANGE;
+        case expression::UNKNOWN:
+            return ANY_CHANGE;
+        default:
+            return CONTENT_CHANGE;
+    }
+}
+
+#endif  /* FNIFI_FILE_CHANGE_HPP */
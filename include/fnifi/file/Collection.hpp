@@ -5,6 +5,8 @@
 #include "fnifi/utils/SyncDirectory.hpp"
 #include "fnifi/file/AFileHelper.hpp"
 #include "fnifi/file/File.hpp"
+#include "fnifi/file/PathIndex.hpp"
+#include "fnifi/file/Change.hpp"
 #include "fnifi/utils/utils.hpp"
 #include <unordered_set>
 #include <unordered_map>
@@ -44,7 +46,16 @@ public:
     std::unordered_map<fileId_t, File>::const_iterator end() const;
     std::unordered_map<fileId_t, File>::iterator begin();
     std::unordered_map<fileId_t, File>::iterator end();
+    /**
+     * When only the modification time of a file changed, download it to
+     * compare its content with its previous hash. Disabled by default, the
+     * change is then reported as a time change only
+     */
+    void setContentHashing(bool enabled);
     size_t size() const;
+    struct timespec getLastIndexing() const;
+    std::vector<fileId_t> search(const std::string& pattern,
+                                 bool prefix = false);
 
 private:
     using offset_t = size_t;
@@ -56,6 +67,13 @@ private:
     struct __attribute__((packed)) Info {
         struct timespec lastIndexing = {0, 0};
     };
+    /* facets of a file at its last indexation, a null size meaning unknown */
+    struct __attribute__((packed)) Stats {
+        off_t size = 0;
+        struct timespec mtime = {0, 0};
+        uint32_t hash = 0;
+        bool hashed = false;
+    };
     struct FileTimed {
         std::filesystem::path path;
         std::filesystem::file_time_type time;
@@ -67,23 +85,58 @@ private:
 
     void index(
         std::unordered_set<std::pair<const file::File*, fileId_t>>& removed,
-        std::unordered_set<const file::File*>& added,
-        std::unordered_set<file::File*>& modified);
+        std::unordered_set<file::File*>& added,
+        std::unordered_map<file::File*, changes_t>& modified);
+    /**
+     * Returns false if not committed, another client having committed
+     * meanwhile
+     */
+    bool indexOnce(
+        std::unordered_set<std::pair<const file::File*, fileId_t>>& removed,
+        std::unordered_set<file::File*>& added,
+        std::unordered_map<file::File*, changes_t>& modified);
+    /**
+     * Take the files of the mapping just updated, the changes to report
+     * being adjusted
+     */
+    void reload(
+        std::unordered_set<std::pair<const file::File*, fileId_t>>& removed,
+        std::unordered_set<file::File*>& added,
+        std::unordered_map<file::File*, changes_t>& modified);
+    /**
+     * Returns false if not committed, as indexOnce
+     */
+    bool defragmentOnce();
 #ifdef ENABLE_OPENCV
     static fileBuf_t makePreview(const cv::Mat& img);
 #endif  /* ENABLE_OPENCV */
+    void unindex(fileId_t id);
+    changes_t detectChanges(fileId_t id, const struct stat& fileStat,
+                            const struct timespec& lastIndexing);
+    bool readStats(fileId_t id, Stats& stats) const;
+    void writeStats(fileId_t id, const Stats& stats);
     void removePreviewFile(fileId_t id) const;
     void removeCopyFile(fileId_t id) const;
     void updateCopiesSz();
+    void buildPathIndex();
+    void loadPathIndex();
+    void savePathIndex();
+    uint32_t hashMapping() const;
 
     std::unordered_map<fileId_t, File> _files;
     connection::IConnection* _indexingConn;
     std::unique_ptr<utils::SyncDirectory::FileStream> _mapping;
     std::unique_ptr<utils::SyncDirectory::FileStream> _filepaths;
     std::unique_ptr<utils::SyncDirectory::FileStream> _info;
+    std::unique_ptr<utils::SyncDirectory::FileStream> _stats;
     std::unordered_set<fileId_t> _availableIds;
+    std::unique_ptr<PathIndex> _pathIndex;
+    std::unique_ptr<utils::SyncDirectory::FileStream> _pathIndexFile;
     const size_t _maxCopiesSz;
     size_t _copiesSz;
+    bool _hashContents;
+    /* updated by a defragmentation since the files were loaded */
+    bool _reloadPending;
 
     friend class fnifi::FNIFI;
 };
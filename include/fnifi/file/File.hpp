@@ -38,6 +38,7 @@ public:
     void setIsFilteredOut(bool isFilteredOut);
     bool isFilteredOut() const;
     std::string getCollectionName() const;
+    collId_t getCollectionId() const;
     void setHelper(AFileHelper* helper);
 
 private:
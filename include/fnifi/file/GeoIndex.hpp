@@ -0,0 +1,82 @@
+#ifndef FNIFI_FILE_GEOINDEX_HPP
+#define FNIFI_FILE_GEOINDEX_HPP
+
+#include "fnifi/file/Info.hpp"
+#include "fnifi/file/Collection.hpp"
+#include "fnifi/file/File.hpp"
+#include "fnifi/utils/utils.hpp"
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#define DEFAULT_GEO_CELL_SZ 36000  /* 0.01 degree, in milliarcseconds */
+
+
+namespace fnifi {
+namespace file {
+
+/**
+ * Uniform grid over the LATITUDE and LONGITUDE Info columns of a Collection.
+ * Coordinates are in milliarcseconds and distances in meters.
+ */
+class GeoIndex {
+public:
+    static void Update(const Collection* coll,
+                       const std::vector<fileId_t>& removed,
+                       const std::vector<const File*>& updated);
+    static void Free();
+    static GeoIndex* Build(const Collection* coll,
+                           expr_t cellSz = DEFAULT_GEO_CELL_SZ);
+
+    std::vector<fileId_t> findInBox(expr_t minLat, expr_t maxLat,
+                                    expr_t minLon, expr_t maxLon) const;
+    std::vector<fileId_t> findInRadius(expr_t lat, expr_t lon,
+                                       double radius) const;
+    std::vector<fileId_t> findNearest(expr_t lat, expr_t lon, size_t k) const;
+    size_t size() const;
+
+private:
+    struct Point {
+        expr_t lat;
+        expr_t lon;
+        fileId_t id;
+    };
+    using cellKey_t = uint64_t;
+
+    static double Distance(expr_t lat1, expr_t lon1, expr_t lat2,
+                           expr_t lon2);
+    /**
+     * Number of cells over [-extent, extent], throwing if the cell size is
+     * invalid
+     */
+    static uint32_t GetCells(expr_t extent, expr_t cellSz);
+
+    GeoIndex(const Collection* coll, expr_t cellSz);
+    void update(const std::vector<fileId_t>& removed,
+                const std::vector<const File*>& updated);
+    void insert(const File* file);
+    void remove(fileId_t id);
+    void collect(expr_t minLat, expr_t maxLat, expr_t minLon, expr_t maxLon,
+                 std::vector<const Point*>& res) const;
+    std::vector<const Point*> collectInRadius(expr_t lat, expr_t lon,
+                                              double radius) const;
+    cellKey_t getKey(expr_t lat, expr_t lon) const;
+    uint32_t getRow(expr_t lat) const;
+    uint32_t getCol(expr_t lon) const;
+
+    static std::unordered_map<std::string, GeoIndex> _built;
+
+    const Collection* _coll;
+    Info<expr_t>* _lat;
+    Info<expr_t>* _lon;
+    const expr_t _cellSz;
+    const uint32_t _nRows;
+    const uint32_t _nCols;
+    std::unordered_map<cellKey_t, std::vector<Point>> _cells;
+    std::unordered_map<fileId_t, cellKey_t> _positions;
+};
+
+}  /* namespace file */
+}  /* namespace fnifi */
+
+#endif  /* FNIFI_FILE_GEOINDEX_HPP */
@@ -4,6 +4,7 @@
 #include "fnifi/file/AFileHelper.hpp"
 #include "fnifi/file/File.hpp"
 #include "fnifi/file/InfoType.hpp"
+#include "fnifi/file/Change.hpp"
 #include "fnifi/expression/Kind.hpp"
 #include "fnifi/utils/SyncDirectory.hpp"
 #include "fnifi/utils/utils.hpp"
@@ -13,10 +14,12 @@
 #include <string>
 #include <filesystem>
 #include <unordered_map>
+#include <vector>
 #include <memory>
 #include <sstream>
 #include <type_traits>
 #include <string>
+#include <cstring>
 
 #define SEP std::string("\xFF")
 #define INFO_DIRNAME "info"
@@ -30,7 +33,12 @@ namespace file {
 template<fnifi::file::InfoType T>
 class Info {
 public:
-    static void Uncache(fileId_t id);
+    /**
+     * Uncache the ids of the Collection for the built Info depending on their
+     * changes
+     */
+    static void Uncache(const AFileHelper* helper,
+                        const std::unordered_map<fileId_t, changes_t>& ids);
     static void Free();
     static Info<T>* Build(const AFileHelper* helper,
                           expression::Kind kind, const std::string& key = "");
@@ -38,6 +46,7 @@ public:
     bool get(const File* file, T& result);
     void disableSync(bool pull = true);
     void enableSync(bool push = true);
+    std::filesystem::path getPath(bool relative = false) const;
 
 private:
     static std::string GetTypeName();
@@ -63,11 +72,13 @@ private:
     static bool ProcessExiv2FindRes(Iterator it, U& res, size_t i = 0);
 #endif  /* ENABLE_EXIV2 */
 
-    static std::unordered_map<std::string, Info> _built;
+    /* indexed by Collection id then by kind, and keyed by the key */
+    typedef std::vector<std::unordered_map<std::string, Info>> kinds_t;
+    static std::vector<kinds_t> _built;
 
     const expression::Kind _kind;
     const std::string _key;
-    std::unique_ptr<utils::SyncDirectory::FileStream> _file;
+    std::unique_ptr<utils::SyncDirectory::LoggedFile> _file;
     fileId_t _nIds;
     const size_t _typeSz;
 };
@@ -87,18 +98,50 @@ bool fnifi::file::File::get(T& result, expression::Kind kind,
 }
 
 template<fnifi::file::InfoType T>
-std::unordered_map<std::string, fnifi::file::Info<T>>
+std::vector<typename fnifi::file::Info<T>::kinds_t>
 fnifi::file::Info<T>::_built;
 
 template<fnifi::file::InfoType T>
-void fnifi::file::Info<T>::Uncache(fileId_t id) {
-    DLOG("Info", "(static)", "Uncaching file id " << id)
-
-    for (auto& info: _built) {
-        /* write an empty results on the id position */
-        info.second._file->seekp(std::streamoff(id * info.second._typeSz));
-        utils::Serialize(*info.second._file, EMPTY_INFO_VALUE);
-        info.second._file->push();
+void fnifi::file::Info<T>::Uncache(
+    const AFileHelper* helper,
+    const std::unordered_map<fileId_t, changes_t>& ids)
+{
+    DLOG("Info", "(static)", "Uncaching " << ids.size() << " file ids for "
+         "helper " << helper)
+
+    const auto collId = helper->getId();
+    if (collId >= _built.size()) {
+        /* nothing built for this Collection */
+        return;
+    }
+
+    for (auto& infos : _built[collId]) {
+        for (auto& info : infos) {
+            if (info.second._file->pull()) {
+                /* update maxId */
+                info.second._nIds = static_cast<fileId_t>(
+                    info.second._file->size() / info.second._typeSz);
+            }
+
+            const auto deps = GetDependencies(info.second._kind);
+            bool hasChanged = false;
+            for (const auto& id : ids) {
+                if (!(id.second & deps) || id.first >= info.second._nIds) {
+                    /* unaffected or not cached */
+                    continue;
+                }
+
+                /* log an empty results on the id position */
+                const T empty = EMPTY_INFO_VALUE;
+                info.second._file->set(
+                    id.first * info.second._typeSz,
+                    reinterpret_cast<const unsigned char*>(&empty));
+                hasChanged = true;
+            }
+            if (hasChanged) {
+                info.second._file->push();
+            }
+        }
     }
 }
 
@@ -106,9 +149,6 @@ template<fnifi::file::InfoType T>
 void fnifi::file::Info<T>::Free() {
     DLOG("Info", "(static)", "Cleaning")
 
-    for (auto& info: _built) {
-        info.second._file->close();
-    }
     _built.clear();
 }
 
@@ -117,18 +157,25 @@ fnifi::file::Info<T>* fnifi::file::Info<T>::Build(
     const AFileHelper* helper, expression::Kind kind,
     const std::string& key)
 {
-    std::ostringstream kindStr;
-    kindStr << kind;
-    const auto hsh = helper->getName() + SEP + kindStr.str() + SEP + key + SEP
-        + GetTypeName();
+    /* the maps are node-based, so the built objects never move */
+    const auto collId = helper->getId();
+    if (collId >= _built.size()) {
+        _built.resize(collId + 1);
+    }
+    auto& kinds = _built[collId];
+    const auto kindId = static_cast<size_t>(kind);
+    if (kindId >= kinds.size()) {
+        kinds.resize(kindId + 1);
+    }
+    auto& infos = kinds[kindId];
 
-    const auto pos = _built.find(hsh);
-    if (pos != _built.end()) {
+    const auto pos = infos.find(key);
+    if (pos != infos.end()) {
         /* the object already exists */
         return &pos->second;
     }
 
-    auto info = _built.insert(std::make_pair(hsh, Info<T>(helper, kind, key)));
+    auto info = infos.insert(std::make_pair(key, Info<T>(helper, kind, key)));
     return &info.first->second;
 }
 
@@ -141,32 +188,23 @@ bool fnifi::file::Info<T>::get(const File* file, T& result) {
 
     if (_file->pull()) {
         /* update maxId */
-        _file->seekg(0, std::ios::end);
-        _nIds = static_cast<fileId_t>(static_cast<size_t>(
-            _file->tellg()) / _typeSz);
+        _nIds = static_cast<fileId_t>(_file->size() / _typeSz);
     }
 
     if (id < _nIds) {
         /* the value may be saved */
         T res;
-        _file->seekg(std::streamoff(pos));
-        utils::Deserialize(*_file, res);
+        std::memcpy(&res, _file->data() + pos, sizeof(T));
 
         if (res != EMPTY_INFO_VALUE) {
             /* the value was saved */
             result = res;
             return res != NOTFOUND_INFO_VALUE;
         }
-
-        _file->seekg(std::streamoff(pos));
     } else {
         /* filling the file up to the position of the value */
-        _file->seekp(0, std::ios::end);
-        for (auto i = _nIds; i < id; ++i) {
-            /* TODO avoid multiples std::ofstream::write calls */
-            utils::Serialize(*_file, EMPTY_INFO_VALUE);
-        }
-        _nIds = id + 1;
+        _file->grow(pos + _typeSz);
+        _nIds = static_cast<fileId_t>(_file->size() / _typeSz);
     }
 
     DLOG("Info", this, "Results for File " << file << " was not cached")
@@ -181,8 +219,7 @@ bool fnifi::file::Info<T>::get(const File* file, T& result) {
     DLOG("Info", this, "Retrieved value " << res << " (valid=" << valid
          << ") for File " << file)
 
-    _file->seekp(std::streamoff(pos));
-    utils::Serialize(*_file, res);
+    _file->set(pos, reinterpret_cast<const unsigned char*>(&res));
 
     _file->push();
 
@@ -199,6 +236,11 @@ void fnifi::file::Info<T>::enableSync(bool pull) {
     _file->enableSync(pull);
 }
 
+template<fnifi::file::InfoType T>
+std::filesystem::path fnifi::file::Info<T>::getPath(bool relative) const {
+    return _file->getPath(relative);
+}
+
 template<fnifi::file::InfoType T>
 std::string fnifi::file::Info<T>::GetTypeName() {
     std::ostringstream oss;
@@ -235,19 +277,14 @@ fnifi::file::Info<T>::Info(const fnifi::file::AFileHelper* helper,
 
     const auto filepath = helper->_storingPath / INFO_DIRNAME /
         utils::Hash(GetTypeName()) / utils::Hash(kindName.str());
-    bool ate = false;
-    if (helper->_storing.exists(filepath)) {
-        ate = true;
-    }
 
-    _file = std::make_unique<utils::SyncDirectory::FileStream>(
-        helper->_storing, filepath, true);
-
-    if (ate) {
-        /* the file already existed */
-        _nIds = static_cast<fileId_t>(static_cast<size_t>(_file->tellg())
-            / _typeSz);
-    }
+    /* the values of the files are independent from each other */
+    const T empty = EMPTY_INFO_VALUE;
+    const auto emptyBytes = reinterpret_cast<const unsigned char*>(&empty);
+    _file = std::make_unique<utils::SyncDirectory::LoggedFile>(
+        helper->_storing, filepath,
+        fileBuf_t(emptyBytes, emptyBytes + sizeof(T)));
+    _nIds = static_cast<fileId_t>(_file->size() / _typeSz);
 }
 
 template<fnifi::file::InfoType T>
@@ -0,0 +1,478 @@
+#ifndef FNIFI_FILE_INFOINDEX_HPP
+#define FNIFI_FILE_INFOINDEX_HPP
+
+#include "fnifi/file/Info.hpp"
+#include "fnifi/file/Collection.hpp"
+#include "fnifi/file/File.hpp"
+#include "fnifi/file/InfoType.hpp"
+#include "fnifi/expression/Kind.hpp"
+#include "fnifi/utils/SyncDirectory.hpp"
+#include "fnifi/utils/TempFile.hpp"
+#include "fnifi/utils/utils.hpp"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <ctime>
+#include <random>
+#include <cstdint>
+
+#define INDEX_EXTENSION ".index"
+/* updates of an index since it was last written */
+#define INDEX_JOURNAL_EXTENSION ".journal"
+
+
+namespace fnifi {
+namespace file {
+
+/**
+ * Specializations of InfoIndex built so far, so that the indexation updates
+ * all of them whatever their type
+ */
+class AInfoIndex {
+public:
+    static void UpdateAll(const Collection* coll,
+                          const std::vector<fileId_t>& removed,
+                          const std::vector<const File*>& updated);
+    static void FreeAll();
+
+protected:
+    typedef void (*update_t)(const Collection*, const std::vector<fileId_t>&,
+                             const std::vector<const File*>&);
+    typedef void (*free_t)();
+
+    static void Register(update_t update, free_t free);
+
+private:
+    static std::vector<std::pair<update_t, free_t>> _specializations;
+};
+
+/**
+ * Sorted (value, id) permutation of an Info<T> column, stored next to the
+ * column, to answer range queries in O(log N + k). The updates are appended
+ * to a journal, the index being written again once the journal is bigger.
+ * @warning only kept up to date by the indexation of a FNIFI instance: a
+ * Collection indexed while the index is not built will have it rebuilt on
+ * the next Build
+ */
+template<fnifi::file::InfoType T>
+class InfoIndex : public AInfoIndex {
+public:
+    static void Update(const Collection* coll,
+                       const std::vector<fileId_t>& removed,
+                       const std::vector<const File*>& updated);
+    static void Free();
+    static InfoIndex<T>* Build(const Collection* coll, expression::Kind kind,
+                               const std::string& key = "");
+
+    std::vector<fileId_t> find(T min, T max) const;
+    size_t count(T min, T max) const;
+
+private:
+    struct Entry {
+        T value;
+        fileId_t id;
+        bool operator<(const Entry& other) const;
+    };
+    using entries_t = std::vector<Entry>;
+
+    InfoIndex(const Collection* coll, expression::Kind kind,
+              const std::string& key);
+    void update(const std::vector<fileId_t>& removed,
+                const std::vector<const File*>& updated);
+    void rebuild();
+    bool load();
+    /**
+     * Apply the journal of the loaded generation, and returns the indexing
+     * time of its last complete update
+     */
+    struct timespec replay(struct timespec lastIndexing);
+    void save();
+    void journal(const std::unordered_set<fileId_t>& removed,
+                 const entries_t& added);
+    std::pair<typename entries_t::const_iterator,
+              typename entries_t::const_iterator> range(T min, T max) const;
+
+    static std::unordered_map<std::string, InfoIndex> _built;
+
+    const Collection* _coll;
+    Info<T>* _info;
+    std::unique_ptr<utils::SyncDirectory::FileStream> _file;
+    std::unique_ptr<utils::SyncDirectory::FileStream> _journal;
+    /* of the written index, its journal starting with it */
+    uint64_t _generation;
+    size_t _fileSz;
+    entries_t _entries;
+};
+
+}  /* namespace file */
+}  /* namespace fnifi */
+
+
+/* IMPLEMENTATIONS */
+
+template<fnifi::file::InfoType T>
+std::unordered_map<std::string, fnifi::file::InfoIndex<T>>
+fnifi::file::InfoIndex<T>::_built;
+
+template<fnifi::file::InfoType T>
+void fnifi::file::InfoIndex<T>::Update(const Collection* coll,
+                                       const std::vector<fileId_t>& removed,
+                                       const std::vector<const File*>& updated)
+{
+    DLOG("InfoIndex", "(static)", "Updating indexes of Collection " << coll
+         << " with " << removed.size() << " removed and " << updated.size()
+         << " updated files")
+
+    for (auto& index : _built) {
+        if (index.second._coll == coll) {
+            index.second.update(removed, updated);
+        }
+    }
+}
+
+template<fnifi::file::InfoType T>
+void fnifi::file::InfoIndex<T>::Free() {
+    DLOG("InfoIndex", "(static)", "Cleaning")
+
+    for (auto& index : _built) {
+        index.second._file->close();
+        index.second._journal->close();
+    }
+    _built.clear();
+}
+
+template<fnifi::file::InfoType T>
+fnifi::file::InfoIndex<T>* fnifi::file::InfoIndex<T>::Build(
+    const Collection* coll, expression::Kind kind, const std::string& key)
+{
+    std::ostringstream kindStr;
+    kindStr << kind;
+    const auto hsh = coll->getName() + SEP + kindStr.str() + SEP + key;
+
+    const auto pos = _built.find(hsh);
+    if (pos != _built.end()) {
+        /* the object already exists */
+        return &pos->second;
+    }
+
+    /* the specialization is updated by the indexation from now on */
+    Register(&InfoIndex<T>::Update, &InfoIndex<T>::Free);
+
+    auto index = _built.insert(std::make_pair(hsh,
+        InfoIndex<T>(coll, kind, key)));
+    return &index.first->second;
+}
+
+template<fnifi::file::InfoType T>
+std::vector<fnifi::fileId_t> fnifi::file::InfoIndex<T>::find(T min, T max)
+    const
+{
+    DLOG("InfoIndex", this, "Looking for values in [" << min << ", " << max
+         << "]")
+
+    const auto bounds = range(min, max);
+    std::vector<fileId_t> res;
+    res.reserve(static_cast<size_t>(bounds.second - bounds.first));
+    for (auto it = bounds.first; it != bounds.second; ++it) {
+        res.push_back(it->id);
+    }
+    return res;
+}
+
+template<fnifi::file::InfoType T>
+size_t fnifi::file::InfoIndex<T>::count(T min, T max) const {
+    const auto bounds = range(min, max);
+    return static_cast<size_t>(bounds.second - bounds.first);
+}
+
+template<fnifi::file::InfoType T>
+bool fnifi::file::InfoIndex<T>::Entry::operator<(const Entry& other) const {
+    if (value < other.value) {
+        return true;
+    }
+    if (other.value < value) {
+        return false;
+    }
+    return id < other.id;
+}
+
+template<fnifi::file::InfoType T>
+fnifi::file::InfoIndex<T>::InfoIndex(const Collection* coll,
+                                     expression::Kind kind,
+                                     const std::string& key)
+: _coll(coll), _info(Info<T>::Build(coll, kind, key)), _generation(0),
+    _fileSz(0)
+{
+    DLOG("InfoIndex", this, "Instanciation for coll " << coll << ", type "
+         << typeid(T).name() << ", kind " << kind << " and key \"" << key
+         << "\"")
+
+    auto filepath = _info->getPath(true);
+    filepath += INDEX_EXTENSION;
+    _file = std::make_unique<utils::SyncDirectory::FileStream>(
+        coll->_storing, filepath);
+    filepath += INDEX_JOURNAL_EXTENSION;
+    _journal = std::make_unique<utils::SyncDirectory::FileStream>(
+        coll->_storing, filepath);
+
+    if (!load()) {
+        /* the index does not exist or is outdated */
+        rebuild();
+    }
+}
+
+template<fnifi::file::InfoType T>
+void fnifi::file::InfoIndex<T>::update(
+    const std::vector<fileId_t>& removed,
+    const std::vector<const File*>& updated)
+{
+    if (removed.empty() && updated.empty()) {
+        return;
+    }
+
+    /* remove the outdated entries */
+    std::unordered_set<fileId_t> ids(removed.begin(), removed.end());
+    for (const auto& file : updated) {
+        ids.insert(file->getId());
+    }
+    std::erase_if(_entries, [&ids](const Entry& entry) {
+        return ids.contains(entry.id);
+    });
+
+    /* retrieve the new values */
+    entries_t entries;
+    entries.reserve(updated.size());
+    _info->disableSync();
+    for (const auto& file : updated) {
+        T value;
+        if (_info->get(file, value)) {
+            entries.push_back({value, file->getId()});
+        }
+    }
+    _info->enableSync();
+
+    /* merge them into the sorted entries */
+    std::sort(entries.begin(), entries.end());
+    const auto mid = static_cast<typename entries_t::difference_type>(
+        _entries.size());
+    _entries.insert(_entries.end(), entries.begin(), entries.end());
+    std::inplace_merge(_entries.begin(), _entries.begin() + mid,
+                       _entries.end());
+
+    journal(ids, entries);
+}
+
+template<fnifi::file::InfoType T>
+void fnifi::file::InfoIndex<T>::rebuild() {
+    DLOG("InfoIndex", this, "Rebuilding")
+
+    _entries.clear();
+    _entries.reserve(_coll->size());
+
+    _info->disableSync();
+    for (const auto& file : *_coll) {
+        T value;
+        if (_info->get(&file.second, value)) {
+            _entries.push_back({value, file.first});
+        }
+    }
+    _info->enableSync();
+
+    std::sort(_entries.begin(), _entries.end());
+
+    save();
+}
+
+template<fnifi::file::InfoType T>
+bool fnifi::file::InfoIndex<T>::load() {
+    _file->seekg(0, std::ios::end);
+    if (_file->tellg() <= 0) {
+        /* empty file */
+        return false;
+    }
+    _file->seekg(0);
+
+    struct timespec lastIndexing;
+    utils::Deserialize(*_file, lastIndexing);
+    utils::Deserialize(*_file, _generation);
+
+    _entries.clear();
+    Entry entry;
+    while (utils::Deserialize(*_file, entry.value) &&
+           utils::Deserialize(*_file, entry.id))
+    {
+        _entries.push_back(entry);
+    }
+    if (!_file->eof() && _file->fail()) {
+        std::ostringstream msg;
+        msg << "Error while reading " << _file->getPath();
+        ELOG("InfoIndex", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    _file->clear();
+    _file->seekg(0, std::ios::end);
+    _fileSz = static_cast<size_t>(_file->tellg());
+
+    lastIndexing = replay(lastIndexing);
+    const auto current = _coll->getLastIndexing();
+    if (lastIndexing > current || current > lastIndexing) {
+        ILOG("InfoIndex", this, "Outdated index " << _file->getPath())
+        return false;
+    }
+
+    DLOG("InfoIndex", this, "Loaded " << _entries.size() << " entries")
+
+    return true;
+}
+
+template<fnifi::file::InfoType T>
+struct timespec fnifi::file::InfoIndex<T>::replay(
+    struct timespec lastIndexing)
+{
+    _journal->seekg(0, std::ios::end);
+    if (_journal->tellg() <= 0) {
+        return lastIndexing;
+    }
+    _journal->seekg(0);
+
+    uint64_t generation;
+    if (!utils::Deserialize(*_journal, generation) ||
+        generation != _generation)
+    {
+        /* left by an older index */
+        _journal->clear();
+        return lastIndexing;
+    }
+
+    /* an update is only applied once completely read */
+    size_t nUpdates = 0;
+    struct timespec indexing;
+    while (utils::Deserialize(*_journal, indexing)) {
+        size_t n;
+        if (!utils::Deserialize(*_journal, n)) {
+            break;
+        }
+        std::unordered_set<fileId_t> removed;
+        fileId_t id;
+        for (size_t i = 0; i < n && utils::Deserialize(*_journal, id); ++i) {
+            removed.insert(id);
+        }
+        entries_t added;
+        if (!utils::Deserialize(*_journal, n)) {
+            break;
+        }
+        Entry entry;
+        for (size_t i = 0; i < n &&
+             utils::Deserialize(*_journal, entry.value) &&
+             utils::Deserialize(*_journal, entry.id); ++i)
+        {
+            added.push_back(entry);
+        }
+        if (!*_journal) {
+            break;
+        }
+
+        std::erase_if(_entries, [&removed](const Entry& e) {
+            return removed.contains(e.id);
+        });
+        _entries.insert(_entries.end(), added.begin(), added.end());
+        lastIndexing = indexing;
+        ++nUpdates;
+    }
+    _journal->clear();
+
+    if (nUpdates > 0) {
+        DLOG("InfoIndex", this, "Replayed " << nUpdates << " updates")
+        std::sort(_entries.begin(), _entries.end());
+    }
+    return lastIndexing;
+}
+
+template<fnifi::file::InfoType T>
+void fnifi::file::InfoIndex<T>::save() {
+    /* a new generation, so that the journal of the previous one is ignored
+     * until it is emptied */
+    std::random_device rd;
+    _generation = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+    utils::TempFile tmp;
+    utils::Serialize(tmp, _coll->getLastIndexing());
+    utils::Serialize(tmp, _generation);
+    for (const auto& entry : _entries) {
+        utils::Serialize(tmp, entry.value);
+        utils::Serialize(tmp, entry.id);
+    }
+    tmp.flush();
+    _fileSz = static_cast<size_t>(tmp.tellp());
+
+    _file->take(tmp);
+    if (!_file->push()) {
+        /* saved by another client meanwhile, its index being only loaded if
+         * current with the Collection, this one being kept in memory */
+        DLOG("InfoIndex", this, "Index saved concurrently")
+        _file->pull();
+        _journal->pull();
+        return;
+    }
+
+    utils::TempFile journalTmp;
+    utils::Serialize(journalTmp, _generation);
+    journalTmp.flush();
+    _journal->take(journalTmp);
+    if (!_journal->push()) {
+        /* of another generation, hence ignored when loaded */
+        DLOG("InfoIndex", this, "Journal appended to concurrently")
+        _journal->pull();
+    }
+}
+
+template<fnifi::file::InfoType T>
+void fnifi::file::InfoIndex<T>::journal(
+    const std::unordered_set<fileId_t>& removed, const entries_t& added)
+{
+    /* appended, so that only the last blocks are pushed */
+    _journal->seekp(0, std::ios::end);
+    utils::Serialize(*_journal, _coll->getLastIndexing());
+    utils::Serialize(*_journal, removed.size());
+    for (const auto& id : removed) {
+        utils::Serialize(*_journal, id);
+    }
+    utils::Serialize(*_journal, added.size());
+    for (const auto& entry : added) {
+        utils::Serialize(*_journal, entry.value);
+        utils::Serialize(*_journal, entry.id);
+    }
+    const auto journalSz = static_cast<size_t>(_journal->tellp());
+
+    if (journalSz > _fileSz) {
+        /* replaying the journal costs more than reading the index again */
+        DLOG("InfoIndex", this, "Compacting the journal")
+        save();
+    } else if (!_journal->push()) {
+        /* appended to by another client meanwhile, the index being saved
+         * again as a whole */
+        DLOG("InfoIndex", this, "Journal appended to concurrently")
+        _journal->pull();
+        save();
+    }
+}
+
+template<fnifi::file::InfoType T>
+std::pair<typename fnifi::file::InfoIndex<T>::entries_t::const_iterator,
+          typename fnifi::file::InfoIndex<T>::entries_t::const_iterator>
+fnifi::file::InfoIndex<T>::range(T min, T max) const {
+    if (max < min) {
+        return {_entries.end(), _entries.end()};
+    }
+    const auto first = std::lower_bound(_entries.begin(), _entries.end(), min,
+        [](const Entry& entry, T value) { return entry.value < value; });
+    const auto last = std::upper_bound(first, _entries.end(), max,
+        [](T value, const Entry& entry) { return value < entry.value; });
+    return {first, last};
+}
+
+#endif  /* FNIFI_FILE_INFOINDEX_HPP */
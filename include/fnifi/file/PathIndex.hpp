@@ -0,0 +1,52 @@
+#ifndef FNIFI_FILE_PATHINDEX_HPP
+#define FNIFI_FILE_PATHINDEX_HPP
+
+#include "fnifi/utils/utils.hpp"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+#include <cstdint>
+
+
+namespace fnifi {
+namespace file {
+
+/**
+ * Trigram index over file paths, answering case-insensitive substring and
+ * prefix queries with a posting-list intersection.
+ */
+class PathIndex {
+public:
+    PathIndex();
+    void insert(fileId_t id, const std::string& path);
+    void remove(fileId_t id);
+    void clear();
+    std::vector<fileId_t> find(const std::string& pattern,
+                               bool prefix = false) const;
+    bool matches(fileId_t id, const std::string& pattern,
+                 bool prefix = false) const;
+    size_t size() const;
+    void save(std::ostream& os) const;
+    /**
+     * @return false if the content is incomplete, the index being then empty
+     */
+    bool load(std::istream& is);
+
+private:
+    using trigram_t = uint32_t;
+    using posting_t = std::vector<fileId_t>;
+
+    static std::string Normalize(const std::string& str);
+    static std::vector<trigram_t> GetTrigrams(const std::string& str);
+    static bool Match(const std::string& path, const std::string& pattern,
+                      bool prefix);
+
+    std::unordered_map<trigram_t, posting_t> _postings;
+    std::unordered_map<fileId_t, std::string> _paths;
+};
+
+}  /* namespace file */
+}  /* namespace fnifi */
+
+#endif  /* FNIFI_FILE_PATHINDEX_HPP */
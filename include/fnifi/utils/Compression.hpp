@@ -0,0 +1,58 @@
+#ifndef FNIFI_UTILS_COMPRESSION_HPP
+#define FNIFI_UTILS_COMPRESSION_HPP
+
+#include "fnifi/utils/utils.hpp"
+#include <cstdint>
+#include <cstddef>
+
+/* first bytes of a zstd frame, only a hint as raw contents may start so */
+#define ZSTD_FRAME_MAGIC "\x28\xB5\x2F\xFD"
+#define ZSTD_FRAME_MAGIC_SIZE 4
+/* remote directory of the markers of the compressed files */
+#define COMPRESSION_DIRNAME ".compression"
+#define COMPRESSION_LEVEL 3
+
+
+namespace fnifi {
+namespace utils {
+
+/**
+ * zstd compression of the remote copies of the synchronized files. Whether a
+ * remote copy is compressed is recorded out of band, by a marker matching its
+ * content, so that compressed and raw files can be mixed in a storing
+ * directory.
+ */
+class Compression {
+public:
+    struct __attribute__((packed)) Marker {
+        uint64_t rawSz;
+        uint64_t size;
+        uint32_t hash;
+    };
+
+    static bool IsAvailable();
+    /**
+     * Whether the content may be compressed, to be confirmed by its marker
+     */
+    static bool MayBeCompressed(const fileBuf_t& buf);
+    static Marker Mark(const fileBuf_t& raw, const fileBuf_t& compressed);
+    static bool IsMarked(const fileBuf_t& buf, const Marker& marker);
+    /**
+     * Returns false if the compression is not available or does not reduce
+     * the size
+     */
+    static bool Compress(const fileBuf_t& buf, fileBuf_t& res);
+    /**
+     * @throw std::runtime_error if zstd is disabled or the content does not
+     * decompress into rawSz bytes
+     */
+    static fileBuf_t Decompress(const fileBuf_t& buf, size_t rawSz);
+
+private:
+    Compression() = delete;
+};
+
+}  /* namespace utils */
+}  /* namespace fnifi */
+
+#endif  /* FNIFI_UTILS_COMPRESSION_HPP */
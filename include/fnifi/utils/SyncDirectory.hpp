@@ -6,6 +6,45 @@
 #include "fnifi/utils/TempFile.hpp"
 #include <fstream>
 #include <ctime>
+#include <vector>
+#include <cstdint>
+#include <unordered_set>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+/* granularity of the changes pushed by a synchronized file */
+#define SYNC_BLOCK_SIZE 4096
+/* number of deferred pushes waking the flusher before its interval */
+#define WRITE_BEHIND_MAX_PENDING 256
+/* number of manifests read by an update racing with newer commits */
+#define COMMIT_MAX_TRY 3
+/* directory of the contents referenced by the commit manifests, next to
+ * them */
+#define COMMIT_DIRNAME ".commits"
+/* number of merges of a push racing with the other clients */
+#define PUSH_MAX_TRY 3
+/* bytes mapped at least by a MappedFile, doubled on each growth */
+#define MAPPED_MIN_CAPACITY 65536
+/* number of downloads run at the same time by a prefetch */
+#define PREFETCH_THREADS 8
+/* milliseconds after which a prefetched file not opened yet is checked again
+ * on its opening */
+#define PREFETCH_EXPIRY_MS 30000
+/* suffix of the update log of a LoggedFile */
+#define UPDATE_LOG_EXTENSION ".log"
+/* bytes of an update log below which it is never compacted */
+#define UPDATE_LOG_MIN_COMPACTION 65536
+/* extension of the files being downloaded next to their local copy */
+#define DOWNLOAD_EXTENSION ".part"
+/* manifest of the versions of the synced files of a storing directory */
+#define VERSIONS_FILENAME "versions.fnifi"
+/* number of reads of a versions manifest racing with the other clients */
+#define VERSIONS_MAX_TRY 3
 
 
 namespace fnifi {
@@ -13,54 +52,506 @@ namespace utils {
 
 class SyncDirectory {
 public:
-    class FileStream : public std::fstream {
+    /**
+     * Local copy of a remote file, the accesses to the local copy being left
+     * to the subclasses
+     */
+    class ASyncedFile {
     public:
-        FileStream(const SyncDirectory& sync,
-                   const std::filesystem::path& filepath, bool ate = false);
-        virtual ~FileStream() override;
+        virtual ~ASyncedFile();
         bool pull();
-        void push();
+        /**
+         * Returns false if the remote file has been changed by another client
+         * meanwhile and the changes cannot be merged: the local ones are kept
+         * until the next pull, whatever the lease, to be redone on the remote
+         * content
+         */
+        bool push();
         void disableSync(bool pull = true);
         void enableSync(bool push = true);
-        void take(TempFile& file);
+        /**
+         * Merge the concurrent pushes of the other clients slot by slot
+         * instead of overwriting them, the file being made of independent
+         * slots of the size of emptySlot. The empty slots never override the
+         * others. To call right after the instanciation
+         */
+        void setMergeable(const fileBuf_t& emptySlot);
         std::filesystem::path getPath(bool relative = false) const;
 
-    private:
-        FileStream(const std::filesystem::path& abspath,
-                   const std::filesystem::path& relapath, bool ate,
-                   const SyncDirectory& sync, struct timespec lastMTime);
-        void setup(bool ate);
+    protected:
+        ASyncedFile(const SyncDirectory& sync,
+                    const std::filesystem::path& filepath);
+        ASyncedFile(const std::filesystem::path& abspath,
+                    const std::filesystem::path& relapath,
+                    const SyncDirectory& sync, struct timespec lastMTime);
+        /**
+         * Push the deferred changes, to call by the destructors of the
+         * subclasses while the local copy is still open
+         */
+        void release();
+        /**
+         * Returns whether the local copy has changed
+         */
+        virtual bool pullNow();
+        /**
+         * Returns false if not pushed, as push
+         */
+        virtual bool pushNow();
+        virtual void openLocal() = 0;
+        virtual void closeLocal() = 0;
+        virtual void flushLocal() = 0;
+        /**
+         * Write the content over the local copy, by its owner only
+         */
+        virtual void writeLocal(const fileBuf_t& buf) = 0;
 
         const SyncDirectory& _sync;
         const std::filesystem::path _abspath;
         const std::filesystem::path _relapath;
+        /* the content of a slot if mergeable */
+        fileBuf_t _emptySlot;
+        std::chrono::steady_clock::time_point _lastCheck;
+        /* in the versions manifest when last synced, 0 if unknown */
+        uint64_t _version;
+
+    private:
+        static uint64_t HashBlock(const unsigned char* data, size_t n);
+
+        /**
+         * Content to push: the compressed buffer, or the ranges of the buffer
+         * (the whole buffer if empty). Returns false if there is nothing to
+         * push
+         */
+        bool prepare(const fileBuf_t& buf,
+                     std::vector<connection::Range>& ranges,
+                     fileBuf_t& compressed) const;
+        /**
+         * Push the content unless changed by someone else meanwhile, the
+         * buffer being left with the pushed one once merged. The conflicts of
+         * the deferred pushes are left to the next push or pull of the owner.
+         * Returns whether the remote file holds the buffer
+         */
+        bool send(fileBuf_t& buf, std::vector<connection::Range> ranges,
+                  fileBuf_t compressed);
+        /**
+         * Whether the remote file has been changed by someone else since
+         * the last pull or push
+         */
+        bool isConflicting(const struct stat& stats) const;
+        /**
+         * Merge the remote content into the buffer and the local file, on
+         * the thread of the owner
+         */
+        void merge(fileBuf_t& buf, const struct stat& stats);
+        /**
+         * Avoid downloading back the content just pushed, if the remote file
+         * was missing or had the last pulled mtime before. Returns whether
+         * the mtime of the pushed content is known
+         */
+        bool recordPush(const struct stat& before);
+        fileBuf_t readAll() const;
+        /**
+         * Changed ranges of the buffer since the remote content was last
+         * known. Returns false if the whole file has to be pushed
+         */
+        bool getDirtyRanges(const fileBuf_t& buf,
+                            std::vector<connection::Range>& ranges) const;
+        void setRemoteContent(const fileBuf_t& buf, bool compressed);
+        /**
+         * Rename a copy of the content over the local copy, which is never
+         * left partially written
+         */
+        void replaceLocal(const fileBuf_t& buf);
+
         bool _syncDisabled;
         struct timespec _lastMtime;
+        /* hashes of the blocks of the remote content, if known */
+        std::vector<uint64_t> _remoteBlocks;
+        size_t _remoteSz;
+        bool _remoteKnown;
+        bool _remoteCompressed;
+        /* the remote content as known, if mergeable */
+        fileBuf_t _base;
+        /* deferred or being pushed by the flusher */
+        std::atomic<bool> _scheduled;
+        /* deferred push to merge by the owner */
+        std::atomic<bool> _conflicting;
+
+        friend SyncDirectory;
+    };
+
+    class FileStream : public std::fstream, public ASyncedFile {
+    public:
+        FileStream(const SyncDirectory& sync,
+                   const std::filesystem::path& filepath, bool ate = false);
+        virtual ~FileStream() override;
+        void take(TempFile& file);
+
+    private:
+        FileStream(const std::filesystem::path& abspath,
+                   const std::filesystem::path& relapath, bool ate,
+                   const SyncDirectory& sync, struct timespec lastMTime);
+
+        void setup(bool ate);
+        virtual void openLocal() override;
+        virtual void closeLocal() override;
+        virtual void flushLocal() override;
+        virtual void writeLocal(const fileBuf_t& buf) override;
 
         friend SyncDirectory;
     };
 
+    /**
+     * Local copy mapped in memory, for the random accesses to the values of
+     * the column files without any stream
+     */
+    class MappedFile : public ASyncedFile {
+    public:
+        MappedFile(const SyncDirectory& sync,
+                   const std::filesystem::path& filepath);
+        virtual ~MappedFile() override;
+        unsigned char* data();
+        const unsigned char* data() const;
+        size_t size() const;
+        /**
+         * Grow the file to at least size bytes, with empty slots if
+         * mergeable and zeros otherwise
+         */
+        void grow(size_t size);
+
+    private:
+        virtual void openLocal() override;
+        virtual void closeLocal() override;
+        virtual void flushLocal() override;
+        virtual void writeLocal(const fileBuf_t& buf) override;
+        /**
+         * Map at least size bytes, the mapping being allowed past the end of
+         * the file
+         */
+        void map(size_t size);
+
+        int _fd;
+        unsigned char* _data;
+        size_t _size;
+        size_t _capacity;
+    };
+
+    /**
+     * Column of slots whose updates are appended to a log next to it instead
+     * of being pushed in place, the other clients replaying the tail of the
+     * log they have not seen yet. The log is compacted into the column once
+     * bigger than it
+     */
+    class LoggedFile : public MappedFile {
+    public:
+        LoggedFile(const SyncDirectory& sync,
+                   const std::filesystem::path& filepath,
+                   const fileBuf_t& emptySlot);
+        virtual ~LoggedFile() override;
+        /**
+         * Write the slot at the position, growing the file if needed, and
+         * log it for the next push
+         */
+        void set(size_t pos, const unsigned char* slot);
+
+    private:
+        virtual bool pullNow() override;
+        virtual bool pushNow() override;
+        /**
+         * Apply the complete records of the buffer read from the log offset.
+         * Returns false if a record belongs to another epoch, the log having
+         * been compacted since
+         */
+        bool replay(const fileBuf_t& buf, bool& changed);
+        void apply(size_t pos, const unsigned char* slot);
+        /**
+         * Merge the log into the remote column and empty it, unless another
+         * client has compacted or appended since they were read
+         */
+        void compact();
+
+        const std::filesystem::path _logRelapath;
+        const size_t _recordSz;
+        /* bytes of the remote log already replayed */
+        size_t _logOffset;
+        /* written by the clients since the last compaction, 0 if unknown */
+        uint64_t _logEpoch;
+        struct timespec _logMtime;
+        /* false if the connection cannot empty the log conditionally */
+        bool _compactable;
+        /* positions and slots not pushed yet */
+        fileBuf_t _records;
+        std::mutex _recordsMtx;
+        /* held by the pulls and the pushes of the log */
+        std::mutex _logMtx;
+    };
+
     SyncDirectory(connection::IConnection* conn, const std::string& path);
+    ~SyncDirectory();
+    /**
+     * Defer the pushes of the FileStreams to a background flusher, which
+     * uploads each changed file at most once per interval (in milliseconds).
+     * 0 pushes synchronously again
+     */
+    void setWriteBehind(unsigned int intervalMs);
+    /**
+     * Trust the local copies for the lease duration (in milliseconds) after
+     * checking the remote ones. 0 checks on each pull
+     */
+    void setLease(unsigned int leaseMs);
+    /**
+     * Compress the remote copies when it reduces the pushed bytes, the local
+     * ones staying raw. Requires zstd
+     */
+    void setCompression(bool enable);
+    /**
+     * Keep a manifest of versions per storing directory, bumped on each push,
+     * so that checking its files for remote changes takes a single request
+     * per lease, the files being checked directly without one. To enable on
+     * all the clients sharing the directory
+     */
+    void setVersioning(bool enable);
+    /**
+     * Push the deferred changes now
+     */
+    void flush() const;
+    /**
+     * Publish the files together: their contents are staged under their own
+     * names, then referenced at once by a single write of the manifest, so
+     * that the clients updating from it see either all of the changes or
+     * none of them. Returns false, publishing nothing, if another client has
+     * committed since the last update, the next update checking the manifest
+     * again whatever the lease
+     */
+    bool commit(const std::filesystem::path& manifest,
+                const std::vector<ASyncedFile*>& files) const;
+    /**
+     * Replace the local copies by the contents the manifest references, only
+     * if it has changed, the files it does not reference being left as is.
+     * updated tells whether a local copy has changed. Returns false if some
+     * contents could not be verified, their local copies being kept
+     */
+    bool update(const std::filesystem::path& manifest,
+                const std::vector<ASyncedFile*>& files, bool& updated) const;
     FileStream open(const std::filesystem::path& filepath, bool ate = false,
                     bool mkdir = true) const;
     bool exists(const std::filesystem::path& filepath) const;
     std::filesystem::path absolute(const std::filesystem::path& filepath)
         const;
-    void remove(const std::filesystem::path& filepath) const;
+    void remove(const std::filesystem::path& filepath, bool remote = false)
+        const;
     void createDirs(const std::filesystem::path& dirpath) const;
+    /**
+     * Remote files of the directory, empty if it does not exist
+     */
+    connection::DirectoryIterator list(const std::filesystem::path& dirpath)
+        const;
+    struct stat getStats(const std::filesystem::path& filepath) const;
+    /**
+     * Content of the remote file, read without a local copy to synchronize
+     */
+    fileBuf_t read(const std::filesystem::path& filepath) const;
+    /**
+     * Download the changed files of the remote directory in parallel, from a
+     * single listing, so that opening them afterward neither downloads nor
+     * checks them again. Only their first opening relies on the listing,
+     * within PREFETCH_EXPIRY_MS
+     */
+    void prefetch(const std::filesystem::path& dirpath, bool recursive = true,
+                  unsigned int nThreads = PREFETCH_THREADS) const;
 
 private:
+    /* staged content of a file in a manifest */
+    struct CommitEntry {
+        std::string relapath;
+        size_t size;
+        uint64_t hash;
+        /* unique to the staging, naming the staged content */
+        uint64_t stamp;
+    };
+    /* last manifest seen by this client */
+    struct CommitState {
+        uint64_t generation;
+        struct timespec mtime;
+        std::vector<CommitEntry> entries;
+        std::chrono::steady_clock::time_point lastCheck;
+    };
+    /* remote file checked by a prefetch */
+    struct PrefetchState {
+        struct timespec mtime;
+        std::chrono::steady_clock::time_point time;
+    };
+    /* file of a versions manifest */
+    struct VersionEntry {
+        uint64_t version;
+        /* of the remote file once pushed, 0 if unknown */
+        struct timespec mtime;
+    };
+    typedef std::unordered_map<std::string, VersionEntry> versions_t;
+    /* last versions manifest seen by this client */
+    struct VersionsState {
+        versions_t entries;
+        struct timespec mtime;
+        std::chrono::steady_clock::time_point lastCheck;
+        bool checked;
+    };
+
+    static fileBuf_t SerializeManifest(uint64_t generation,
+                                       const std::vector<CommitEntry>&
+                                       entries);
+    /**
+     * Returns false if the manifest is being written or corrupted
+     */
+    static bool DeserializeManifest(const fileBuf_t& buf,
+                                    uint64_t& generation,
+                                    std::vector<CommitEntry>& entries);
+    static fileBuf_t SerializeVersions(const versions_t& versions);
+    /**
+     * Returns false if the versions manifest is being written or corrupted
+     */
+    static bool DeserializeVersions(const fileBuf_t& buf,
+                                    versions_t& versions);
+
     std::filesystem::path setupFileStream(
         const std::filesystem::path& filepath, struct timespec& lastMTime,
         bool mkdir = true) const;
     struct timespec pull(const std::filesystem::path& abspath,
                          const std::filesystem::path& relapath,
-                         const struct timespec& lastMTime) const;
-    void push(const std::filesystem::path& relapath, const fileBuf_t& buf)
+                         const struct timespec& lastMTime, bool& compressed)
+        const;
+    /**
+     * Download the remote file and stamp the local copy with its mtime
+     */
+    bool download(const std::filesystem::path& abspath,
+                  const std::filesystem::path& relapath,
+                  const struct timespec& mtime, bool& compressed) const;
+    /**
+     * Set the mtime of the local copy to the one of the remote file it
+     * holds, the copies being the same as long as they match
+     */
+    void stamp(const std::filesystem::path& abspath,
+               const struct timespec& mtime) const;
+    bool isStamped(const std::filesystem::path& abspath,
+                   const struct timespec& mtime) const;
+    /**
+     * Remote mtime found by a prefetch not taken yet, if any
+     */
+    bool takePrefetched(const std::filesystem::path& relapath,
+                        struct timespec& mtime) const;
+    /**
+     * Push the buffer, or only its ranges if any, and only if the remote
+     * file still has the mtime if given. Returns false if it has not
+     */
+    bool push(const std::filesystem::path& relapath, const fileBuf_t& buf,
+              const std::vector<connection::Range>& ranges = {},
+              const struct timespec* mtime = nullptr) const;
+    /**
+     * Push the compressed content after its marker, as push
+     */
+    bool pushCompressed(const std::filesystem::path& relapath,
+                        const fileBuf_t& raw, const fileBuf_t& compressed,
+                        const struct timespec* mtime = nullptr) const;
+    /**
+     * Decompress the downloaded file in place and returns whether it was
+     * compressed
+     */
+    bool decompress(const std::filesystem::path& abspath,
+                    const std::filesystem::path& relapath) const;
+    /**
+     * Whether the remote content is compressed according to its marker, of
+     * which the raw size is then given
+     * @throw std::runtime_error if it is but zstd is disabled
+     */
+    bool isMarked(const std::filesystem::path& relapath,
+                  const fileBuf_t& buf, size_t& rawSz) const;
+    /**
+     * Remote content, decompressed
+     */
+    fileBuf_t fetch(const std::filesystem::path& relapath, bool& compressed)
+        const;
+    /**
+     * Raw remote content from the offset
+     */
+    fileBuf_t fetchTail(const std::filesystem::path& relapath, size_t offset)
+        const;
+    void append(const std::filesystem::path& relapath, const fileBuf_t& buf)
         const;
+    bool hasChanged(const std::filesystem::path& relapath,
+                    const struct timespec& lastMTime) const;
+    void schedule(ASyncedFile* file) const;
+    /**
+     * Whether the file is being pushed by a flush on behalf of its owner
+     */
+    bool isDeferred(const ASyncedFile* file) const;
+    /**
+     * Wait for the file to be out of the flusher and returns whether it had
+     * a deferred push
+     */
+    bool unschedule(ASyncedFile* file) const;
+    void stopFlusher();
+    CommitState getCommitState(const std::filesystem::path& manifest) const;
+    /**
+     * Staged content of the entry, next to the manifest
+     */
+    static std::filesystem::path GetStagedPath(
+        const std::filesystem::path& manifest, const CommitEntry& entry);
+    void stage(const std::filesystem::path& manifest,
+               const CommitEntry& entry, const fileBuf_t& buf) const;
+    /**
+     * Staged content of the entry. Returns false if it does not match the
+     * entry, having been removed by a newer commit meanwhile
+     */
+    bool fetchStaged(const std::filesystem::path& manifest,
+                     const CommitEntry& entry, fileBuf_t& buf) const;
+    /**
+     * Versions manifest of the storing directory of the file
+     */
+    std::filesystem::path getVersionsPath(
+        const std::filesystem::path& relapath) const;
+    /**
+     * Version of the file in the manifest, checked again once the lease is
+     * over. Returns false if the file is not versioned or without a lease
+     */
+    bool getVersion(const std::filesystem::path& relapath, uint64_t& version,
+                    struct timespec& mtime) const;
+    /**
+     * Bump the version of the pushed file on the next publication
+     */
+    void bump(const std::filesystem::path& relapath,
+              const struct timespec& mtime) const;
+    /**
+     * Write the bumped versions, once per manifest, provided that no one
+     * else has written it since it was last seen
+     */
+    void publish() const;
 
     connection::IConnection* _conn;
     const std::filesystem::path _path;
+    std::atomic<unsigned int> _writeBehindMs;
+    std::atomic<unsigned int> _leaseMs;
+    std::atomic<bool> _compress;
+    std::atomic<bool> _versioning;
+    mutable std::unordered_set<ASyncedFile*> _pending;
+    mutable ASyncedFile* _flushing;
+    mutable std::mutex _pendingMtx;
+    mutable std::condition_variable _pendingCv;
+    mutable std::mutex _drainMtx;
+    std::thread _flusher;
+    bool _stopFlusher;
+    /* being destroyed */
+    std::atomic<bool> _closing;
+    mutable std::unordered_map<std::string, CommitState> _commits;
+    mutable std::mutex _commitsMtx;
+    mutable std::unordered_map<std::string, PrefetchState> _prefetched;
+    mutable std::mutex _prefetchedMtx;
+    /* last drop of the expired prefetched files */
+    mutable std::chrono::steady_clock::time_point _prefetchedSweep;
+    mutable std::unordered_map<std::string, VersionsState> _versions;
+    mutable std::mutex _versionsMtx;
+    /* mtimes of the pushed files per manifest, not published yet */
+    mutable std::unordered_map<std::string, std::unordered_map<
+        std::string, struct timespec>> _bumps;
+    mutable std::mutex _bumpsMtx;
 };
 
 }  /* namesapce connection */
@@ -0,0 +1,60 @@
+#ifndef FNIFI_UTILS_TASK_HPP
+#define FNIFI_UTILS_TASK_HPP
+
+#include "fnifi/utils/utils.hpp"
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstddef>
+
+
+namespace fnifi {
+namespace utils {
+
+/**
+ * Job running on its own thread, with progress counters and cooperative
+ * cancellation. The static methods act on the Task of the calling thread, if
+ * any, so that the processing loops do not need to know whether they run
+ * asynchronously.
+ */
+class Task {
+public:
+    static bool IsCancelled();
+    static void AddFiles(size_t n = 1);
+    static void AddBytes(size_t n);
+    /**
+     * Run the calling thread in the background, behind the interactive ones
+     */
+    static void LowerPriority();
+
+    Task(const std::function<void()>& job);
+    ~Task();
+    void cancel();
+    /**
+     * Wait for the end of the job and rethrow the exception it may have
+     * thrown
+     */
+    void wait();
+    bool isDone() const;
+    bool isCancelled() const;
+    size_t getFiles() const;
+    size_t getBytes() const;
+
+private:
+    static thread_local Task* _current;
+
+    std::atomic<bool> _cancelled;
+    std::atomic<bool> _done;
+    std::atomic<size_t> _files;
+    std::atomic<size_t> _bytes;
+    std::exception_ptr _exception;
+    std::mutex _mtx;
+    std::thread _thread;
+};
+
+}  /* namespace utils */
+}  /* namespace fnifi */
+
+#endif  /* FNIFI_UTILS_TASK_HPP */
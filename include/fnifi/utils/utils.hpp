@@ -63,6 +63,7 @@ namespace fnifi {
 
 typedef std::vector<unsigned char> fileBuf_t;
 typedef unsigned int fileId_t;
+typedef unsigned short collId_t;
 typedef long int expr_t;
 
 bool operator>(const timespec& lhs, const timespec& rhs);
@@ -83,6 +84,7 @@ template <typename T>
 std::istream& Deserialize(std::istream& is, std::vector<T>& var);
 
 uint32_t fnv1a(const std::string& s);
+uint32_t fnv1a(const fileBuf_t& buf);
 std::string Hash(const std::string& s);
 
 }  /* namespace utils */
@@ -143,6 +145,17 @@ inline uint32_t fnifi::utils::fnv1a(const std::string& s) {
     return hash;
 }
 
+inline uint32_t fnifi::utils::fnv1a(const fileBuf_t& buf) {
+    const uint32_t FNV_PRIME = 16777619;
+    const uint32_t FNV_OFFSET = 2166136261;
+    uint32_t hash = FNV_OFFSET;
+    for (unsigned char c : buf) {
+        hash ^= c;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
 inline std::string fnifi::utils::Hash(const std::string& s) {
     auto res = s;
     for (char c : "/\\:*?\"<>|") {
@@ -1,12 +1,46 @@
 #include "fnifi/file/AFileHelper.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <limits>
 
 
 using namespace fnifi;
 using namespace fnifi::file;
 
+std::unordered_map<std::string, collId_t> AFileHelper::_interned;
+std::mutex AFileHelper::_internMtx;
+
+collId_t AFileHelper::Intern(const std::string& name) {
+    std::lock_guard<std::mutex> lk(_internMtx);
+
+    const auto pos = _interned.find(name);
+    if (pos != _interned.end()) {
+        return pos->second;
+    }
+
+    if (_interned.size() > std::numeric_limits<collId_t>::max()) {
+        std::ostringstream msg;
+        msg << "Too many Collections to intern \"" << name << "\"";
+        ELOG("AFileHelper", "(static)", msg.str())
+        throw std::runtime_error(msg.str());
+    }
+
+    const auto id = static_cast<collId_t>(_interned.size());
+    _interned.insert({name, id});
+
+    DLOG("AFileHelper", "(static)", "Interned \"" << name << "\" as " << id)
+
+    return id;
+}
+
 AFileHelper::AFileHelper(const utils::SyncDirectory& storing,
-                         const std::filesystem::path& storingPath)
-: _storing(storing), _storingPath(storingPath)
+                         const std::filesystem::path& storingPath,
+                         collId_t id)
+: _storing(storing), _storingPath(storingPath), _id(id)
 {}
 
 AFileHelper::~AFileHelper() {}
+
+collId_t AFileHelper::getId() const {
+    return _id;
+}
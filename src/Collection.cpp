@@ -1,15 +1,25 @@
 #include "fnifi/file/Collection.hpp"
+#include "fnifi/file/Info.hpp"
+#include "fnifi/expression/Expression.hpp"
 #include "fnifi/utils/TempFile.hpp"
+#include "fnifi/utils/Task.hpp"
 #include <csignal>
 #include <sstream>
 #include <sys/stat.h>
 #include <ctime>
 #include <cstdio>
 #include <set>
+#include <algorithm>
 
 #define INFO_FILE "info.fnifi"
 #define MAPPING_FILE "mapping.fnifi"
 #define FILEPATHS_FILE "filepaths.fnifi"
+#define STATS_FILE "stats.fnifi"
+#define COMMIT_FILE "commit.fnifi"
+/* number of indexations run again over the commits of the other clients */
+#define INDEX_MAX_TRY 3
+/* next to the .index files of the Info columns */
+#define PATHINDEX_FILE "filepaths.fnifi.index"
 #define PREVIEW_DIRNAME "previews"
 #define COPY_DIRNAME "copies"
 #define DEFAULT_PREVIEW_CHAR '?'
@@ -21,19 +31,38 @@ using namespace fnifi::file;
 
 Collection::Collection(connection::IConnection* indexingConn,
                        utils::SyncDirectory& storing, size_t maxCopiesSz)
-: AFileHelper(storing, utils::Hash(indexingConn->getName())),
-    _indexingConn(indexingConn),
-    _mapping(std::make_unique<utils::SyncDirectory::FileStream>
-             (_storing, _storingPath / MAPPING_FILE)),
-    _filepaths(std::make_unique<utils::SyncDirectory::FileStream>
-               (_storing, _storingPath / FILEPATHS_FILE)),
-    _info(std::make_unique<utils::SyncDirectory::FileStream>
-          (_storing, _storingPath / INFO_FILE)),
-    _maxCopiesSz(maxCopiesSz), _copiesSz(0)
+: AFileHelper(storing, utils::Hash(indexingConn->getName()),
+                  Intern(indexingConn->getName())),
+    _indexingConn(indexingConn), _maxCopiesSz(maxCopiesSz), _copiesSz(0),
+    _hashContents(false), _reloadPending(false)
 {
     DLOG("Collection", this, "Instanciation for IConnection " << indexingConn
          << " and SyncDirectory " << &storing)
 
+    /* the files of the Collection, then the columns of its Info and
+     * expressions opened when added to a FNIFI instance, are pulled together
+     * before being opened one by one */
+    _storing.prefetch(_storingPath, false);
+    _storing.prefetch(_storingPath / INFO_DIRNAME);
+    _storing.prefetch(_storingPath / EXPRESSIONS_DIRNAME);
+    _mapping = std::make_unique<utils::SyncDirectory::FileStream>(
+        _storing, _storingPath / MAPPING_FILE);
+    _filepaths = std::make_unique<utils::SyncDirectory::FileStream>(
+        _storing, _storingPath / FILEPATHS_FILE);
+    _info = std::make_unique<utils::SyncDirectory::FileStream>(
+        _storing, _storingPath / INFO_FILE);
+    _stats = std::make_unique<utils::SyncDirectory::FileStream>(
+        _storing, _storingPath / STATS_FILE);
+
+    /* the content of the last commit, and not the files pulled one by one */
+    bool updated;
+    if (!_storing.update(_storingPath / COMMIT_FILE, {_mapping.get(),
+                         _filepaths.get(), _info.get(), _stats.get()},
+                         updated))
+    {
+        WLOG("Collection", this, "Starting from the previous local copies")
+    }
+
     MapNode node;
     fileId_t id = 0;
     while (utils::Deserialize(*_mapping, node)) {
@@ -63,7 +92,7 @@ Collection::Collection(connection::IConnection* indexingConn,
 }
 
 Collection::Collection(Collection&& other) noexcept
-: AFileHelper(other._storing, std::move(other._storingPath)),
+: AFileHelper(other._storing, std::move(other._storingPath), other._id),
     _files(std::move(other._files)), _indexingConn(other._indexingConn),
     _mapping(std::make_unique<utils::SyncDirectory::FileStream>
              (_storing, _storingPath / MAPPING_FILE)),
@@ -71,8 +100,14 @@ Collection::Collection(Collection&& other) noexcept
                (_storing, _storingPath / FILEPATHS_FILE)),
     _info(std::make_unique<utils::SyncDirectory::FileStream>
           (_storing, _storingPath / INFO_FILE)),
+    _stats(std::make_unique<utils::SyncDirectory::FileStream>
+           (_storing, _storingPath / STATS_FILE)),
     _availableIds(std::move(other._availableIds)),
-    _maxCopiesSz(other._maxCopiesSz), _copiesSz(other._copiesSz)
+    _pathIndex(std::move(other._pathIndex)),
+    _pathIndexFile(std::move(other._pathIndexFile)),
+    _maxCopiesSz(other._maxCopiesSz), _copiesSz(other._copiesSz),
+    _hashContents(other._hashContents),
+    _reloadPending(other._reloadPending)
 {
     for (auto& file : _files) {
         file.second.setHelper(this);
@@ -89,19 +124,62 @@ Collection::~Collection() {
     if (_info->is_open()) {
         _info->close();
     }
+    if (_stats->is_open()) {
+        _stats->close();
+    }
 }
 
 void Collection::index(
     std::unordered_set<std::pair<const file::File*, fileId_t>>& removed,
-    std::unordered_set<const file::File*>& added,
-    std::unordered_set<file::File*>& modified)
+    std::unordered_set<file::File*>& added,
+    std::unordered_map<file::File*, changes_t>& modified)
 {
     DLOG("Collection", this, "Indexation")
 
-    _mapping->pull();
-    _filepaths->pull();
-    _info->pull();
+    /* run again on the last commit if another client commits meanwhile,
+     * instead of dropping the changes */
+    for (unsigned int i = 0; i < INDEX_MAX_TRY; ++i) {
+        bool updated;
+        if (!_storing.update(_storingPath / COMMIT_FILE, {_mapping.get(),
+                             _filepaths.get(), _info.get(), _stats.get()},
+                             updated))
+        {
+            /* the changes would not be committed over the last commit */
+            WLOG("Collection", this, "Indexation skipped, the last commit "
+                 "not being available")
+            return;
+        }
+        if (updated || _reloadPending) {
+            reload(removed, added, modified);
+            _reloadPending = false;
+        }
+
+        /* kept up to date by the indexation, so that it is never rebuilt on
+         * a search */
+        if (!_pathIndex || updated) {
+            loadPathIndex();
+        }
+
+        if (indexOnce(removed, added, modified)) {
+            if (!added.empty() || !removed.empty()) {
+                savePathIndex();
+            }
+            return;
+        }
+
+        ILOG("Collection", this, "Indexation run again, another client "
+             "having committed meanwhile")
+    }
+
+    WLOG("Collection", this, "Indexation not committed after "
+         << INDEX_MAX_TRY << " tries, left to the next one")
+}
 
+bool Collection::indexOnce(
+    std::unordered_set<std::pair<const file::File*, fileId_t>>& removed,
+    std::unordered_set<file::File*>& added,
+    std::unordered_map<file::File*, changes_t>& modified)
+{
     /* retrieve files */
     /* TODO: update files thanks to _mapping everytime, not if _files is empty
      */
@@ -122,7 +200,15 @@ void Collection::index(
          info.lastIndexing.tv_nsec << "ns")
 
     /* unindex removed files and detect the ones that changed */
+    std::unordered_set<std::string> indexedPaths;
+    bool cancelled = false;
     for (auto it = _files.begin(); it != _files.end();) {
+        if (utils::Task::IsCancelled()) {
+            cancelled = true;
+            break;
+        }
+        utils::Task::AddFiles();
+
         const auto path = it->second.getPath();
         /* optimization: look for stat, if none, deduced the file does
          * not exists (avoid an additional call to IConnection::exists */
@@ -133,38 +219,20 @@ void Collection::index(
             ILOG("Collection", this, "File at \"" << path << "\" has been "
                  "removed")
 
-            /* remove from _mapping */
-            _mapping->seekg(id * sizeof(MapNode));
-            MapNode node;
-            utils::Deserialize(*_mapping, node);
-            std::string placeholderPath(node.lenght, FILEPATH_EMPTY_CHAR);
-            node.lenght = 0;
-            _mapping->seekp(id * sizeof(MapNode));
-            utils::Serialize(*_mapping, node);
-
-            /* remove from _filepaths */
-            _filepaths->seekp(std::streamoff(node.offset));
-            _filepaths->write(placeholderPath.data(),
-                             std::streamsize(placeholderPath.size()));
-
-            removePreviewFile(id);
-            removeCopyFile(id);
-
-            _availableIds.insert(id);
+            unindex(id);
             removed.insert({&it->second, id});
             it = _files.erase(it);
         } else {
-            if (fileStat.st_mtimespec > info.lastIndexing) {
-
+            const auto changes = detectChanges(id, fileStat,
+                                               info.lastIndexing);
+            if (changes != NO_CHANGE) {
                 ILOG("Collection", this, "File at \"" << path << "\" has been "
-                     "modified")
-
-                removePreviewFile(id);
-                removeCopyFile(id);
+                     "modified (changes " << static_cast<int>(changes) << ")")
 
                 /* the file has changed */
-                modified.insert(&it->second);
+                modified.insert({&it->second, changes});
             }
+            indexedPaths.insert(path.c_str());
 
             it++;
         }
@@ -172,11 +240,20 @@ void Collection::index(
 
     /* check for new files */
     struct timespec mostRecentTime = info.lastIndexing;
-    for (const auto& entry : _indexingConn->iterate("")) {
-        if (entry.mtime > info.lastIndexing) {
+    std::vector<fileId_t> newIds;
+    const auto entries = cancelled ? connection::DirectoryIterator()
+        : _indexingConn->iterate("");
+    for (const auto& entry : entries) {
+        if (utils::Task::IsCancelled()) {
+            cancelled = true;
+            break;
+        }
+        if (entry.mtime > info.lastIndexing &&
+            !indexedPaths.contains(entry.path))
+        {
+            utils::Task::AddFiles();
+
             ILOG("Collection", this, "New file " << entry.path)
-            /* TODO: check if the file is not already indexed (happens
-             * when removed and then added) */
 
             /* add the filepath */
             const auto lenght = static_cast<lenght_t>(entry.path.size());
@@ -206,15 +283,40 @@ void Collection::index(
 
             /* add to _files */
             _files.insert({id, File(id, this)});
+            if (_pathIndex) {
+                _pathIndex->insert(id, entry.path);
+            }
 
             added.insert(&_files.find(id)->second);
+            newIds.push_back(id);
+
+            /* the facets to compare with on the next indexation, as given
+             * by the listing */
+            Stats stats;
+            stats.size = entry.size;
+            stats.mtime = entry.mtime;
+            writeStats(id, stats);
 
             if (entry.mtime > mostRecentTime) {
                 mostRecentTime = entry.mtime;
             }
         }
     }
-    info.lastIndexing = mostRecentTime;
+
+    if (cancelled) {
+        /* the new files are not sorted by time: the last indexing time cannot
+         * be updated, hence the files found so far are unindexed to be found
+         * again on the next indexation */
+        ILOG("Collection", this, "Indexation cancelled, unindexing "
+             << newIds.size() << " new files")
+        for (const auto& id : newIds) {
+            unindex(id);
+            _files.erase(id);
+        }
+        added.clear();
+    } else {
+        info.lastIndexing = mostRecentTime;
+    }
 
     /* update info's file */
     _info->seekg(0);
@@ -224,17 +326,229 @@ void Collection::index(
          "created at " << S_TO_NS(info.lastIndexing.tv_sec) +
          info.lastIndexing.tv_nsec << "ns")
 
-    _mapping->push();
-    _filepaths->push();
-    _info->push();
+    /* the files are consistent with each other only as a whole */
+    return _storing.commit(_storingPath / COMMIT_FILE, {_mapping.get(),
+                           _filepaths.get(), _info.get(), _stats.get()});
+}
+
+void Collection::reload(
+    std::unordered_set<std::pair<const file::File*, fileId_t>>& removed,
+    std::unordered_set<file::File*>& added,
+    std::unordered_map<file::File*, changes_t>& modified)
+{
+    DLOG("Collection", this, "Reloading the files of the last commit")
+
+    std::unordered_set<fileId_t> ids;
+    _availableIds.clear();
+    _mapping->seekg(0);
+    MapNode node;
+    fileId_t id = 0;
+    while (utils::Deserialize(*_mapping, node)) {
+        if (node.lenght > 0) {
+            ids.insert(id);
+        } else {
+            _availableIds.insert(id);
+        }
+        id++;
+    }
+    if (!_mapping->eof() && _mapping->fail()) {
+        std::ostringstream msg;
+        msg << "Error while reading " << _mapping->getPath().string();
+        ELOG("Collection", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    _mapping->clear();
+
+    /* the files no longer in the commit, or only added by a run not
+     * committed */
+    for (auto it = _files.begin(); it != _files.end();) {
+        if (ids.contains(it->first)) {
+            it++;
+            continue;
+        }
+        modified.erase(&it->second);
+        if (added.erase(&it->second) == 0) {
+            removed.insert({&it->second, it->first});
+        }
+        it = _files.erase(it);
+    }
+
+    /* the files committed by another client, or only removed by a run not
+     * committed */
+    for (const auto& committed : ids) {
+        if (_files.contains(committed)) {
+            continue;
+        }
+        auto& file = _files.insert({committed, File(committed, this)})
+            .first->second;
+        const auto pos = std::find_if(removed.begin(), removed.end(),
+            [committed](const auto& entry) {
+                return entry.second == committed;
+            });
+        if (pos != removed.end()) {
+            removed.erase(pos);
+        } else {
+            added.insert(&file);
+        }
+    }
+
+    ILOG("Collection", this, "Reloaded " << _files.size() << " files and "
+         << _availableIds.size() << " available ids")
+}
+
+void Collection::unindex(fileId_t id) {
+    /* remove from _mapping */
+    _mapping->seekg(id * sizeof(MapNode));
+    MapNode node;
+    utils::Deserialize(*_mapping, node);
+    std::string placeholderPath(node.lenght, FILEPATH_EMPTY_CHAR);
+    node.lenght = 0;
+    _mapping->seekp(id * sizeof(MapNode));
+    utils::Serialize(*_mapping, node);
+
+    /* remove from _filepaths */
+    _filepaths->seekp(std::streamoff(node.offset));
+    _filepaths->write(placeholderPath.data(),
+                     std::streamsize(placeholderPath.size()));
+
+    removePreviewFile(id);
+    removeCopyFile(id);
+    if (_pathIndex) {
+        _pathIndex->remove(id);
+    }
+    writeStats(id, Stats());
+
+    _availableIds.insert(id);
+}
+
+changes_t Collection::detectChanges(fileId_t id, const struct stat& fileStat,
+                                    const struct timespec& lastIndexing)
+{
+    Stats stats;
+    changes_t changes = NO_CHANGE;
+    bool refreshed = false;
+    if (!readStats(id, stats)) {
+        /* first time seen: the previous facets are unknown */
+        if (fileStat.st_mtimespec > lastIndexing) {
+            changes = ANY_CHANGE;
+        } else if (std::filesystem::exists(_storing.absolute(
+            _storingPath / COPY_DIRNAME / std::to_string(id))))
+        {
+            /* the local copy is up to date and gives the content for free */
+            stats.hash = utils::fnv1a(read(id));
+            stats.hashed = true;
+        }
+    } else {
+        if (stats.size != fileStat.st_size) {
+            changes |= SIZE_CHANGE | CONTENT_CHANGE;
+            stats.hashed = false;
+        }
+        if (stats.mtime.tv_sec != fileStat.st_mtimespec.tv_sec ||
+            stats.mtime.tv_nsec != fileStat.st_mtimespec.tv_nsec)
+        {
+            changes |= MTIME_CHANGE;
+        }
+        if (changes == NO_CHANGE) {
+            return NO_CHANGE;
+        }
+
+        if (changes == MTIME_CHANGE) {
+            /* only the time changed, as with a touch: the local copy may be
+             * outdated anyway */
+            removeCopyFile(id);
+            refreshed = true;
+            if (_hashContents) {
+                /* the content is compared with its previous hash. If
+                 * unknown, it is considered changed and the hash is kept for
+                 * the next time */
+                const auto hash = utils::fnv1a(read(id));
+                if (!stats.hashed || hash != stats.hash) {
+                    changes |= CONTENT_CHANGE;
+                }
+                stats.hash = hash;
+                stats.hashed = true;
+            }
+        }
+    }
+
+    if (changes & CONTENT_CHANGE) {
+        removePreviewFile(id);
+        if (!refreshed) {
+            removeCopyFile(id);
+        }
+    }
+
+    stats.size = fileStat.st_size;
+    stats.mtime = fileStat.st_mtimespec;
+    writeStats(id, stats);
+
+    return changes;
+}
+
+bool Collection::readStats(fileId_t id, Stats& stats) const {
+    _stats->seekg(std::streamoff(id * sizeof(Stats)));
+    if (!utils::Deserialize(*_stats, stats)) {
+        _stats->clear();
+        return false;
+    }
+    return stats.size > 0;
+}
+
+void Collection::writeStats(fileId_t id, const Stats& stats) {
+    _stats->seekp(0, std::ios::end);
+    const auto len = static_cast<size_t>(_stats->tellp());
+    const auto pos = id * sizeof(Stats);
+    if (pos > len) {
+        /* fill the gap with unknown stats */
+        const Stats unknown;
+        for (size_t i = len / sizeof(Stats); i < id; ++i) {
+            utils::Serialize(*_stats, unknown);
+        }
+    }
+    _stats->seekp(std::streamoff(pos));
+    utils::Serialize(*_stats, stats);
 }
 
 void Collection::defragment() {
     DLOG("Collection", this, "Defragmentation")
 
-    _mapping->pull();
-    _filepaths->pull();
+    /* run again on the last commit, as the indexation */
+    for (unsigned int i = 0; i < INDEX_MAX_TRY; ++i) {
+        bool updated;
+        if (!_storing.update(_storingPath / COMMIT_FILE, {_mapping.get(),
+                             _filepaths.get(), _info.get(), _stats.get()},
+                             updated))
+        {
+            WLOG("Collection", this, "Defragmentation skipped, the last "
+                 "commit not being available")
+            return;
+        }
+        if (updated) {
+            /* by the next indexation, which reports the changes */
+            _reloadPending = true;
+            if (_pathIndex) {
+                loadPathIndex();
+            }
+        }
 
+        if (defragmentOnce()) {
+            /* the paths are the same, but the index is stamped with the
+             * mapping */
+            if (_pathIndex) {
+                savePathIndex();
+            }
+            return;
+        }
+
+        ILOG("Collection", this, "Defragmentation run again, another client "
+             "having committed meanwhile")
+    }
+
+    WLOG("Collection", this, "Defragmentation not committed after "
+         << INDEX_MAX_TRY << " tries, left to the next one")
+}
+
+bool Collection::defragmentOnce() {
     /* find and remove unused chunks */
     std::vector<std::pair<offset_t, size_t>> chunks;
     {
@@ -296,8 +610,8 @@ void Collection::defragment() {
         _mapping->clear();
     }
 
-    _mapping->push();
-    _filepaths->push();
+    return _storing.commit(_storingPath / COMMIT_FILE, {_mapping.get(),
+                           _filepaths.get()});
 }
 
 std::string Collection::getFilePath(fileId_t id) {
@@ -528,7 +842,9 @@ std::string Collection::getLocalCopyFilePath(fileId_t id) {
 
     /* download the requested file */
     if (_indexingConn->download(getFilePath(id), abspath)) {
-        _copiesSz += std::filesystem::file_size(abspath);
+        const auto sz = std::filesystem::file_size(abspath);
+        utils::Task::AddBytes(sz);
+        _copiesSz += sz;
         return abspath;
     }
 
@@ -543,7 +859,9 @@ struct stat Collection::getStats(fileId_t id) {
 fileBuf_t Collection::read(fileId_t id, bool nocache) {
     if (nocache) {
         const auto filepath = getFilePath(id);
-        return _indexingConn->read(filepath);
+        auto buf = _indexingConn->read(filepath);
+        utils::Task::AddBytes(buf.size());
+        return buf;
     }
     const auto path = getLocalCopyFilePath(id);
 
@@ -575,10 +893,37 @@ std::unordered_map<fileId_t, File>::iterator Collection::end() {
     return _files.end();
 }
 
+void Collection::setContentHashing(bool enabled) {
+    DLOG("Collection", this, (enabled ? "Enabling" : "Disabling")
+         << " content hashing")
+
+    _hashContents = enabled;
+}
+
 size_t Collection::size() const {
     return _files.size();
 }
 
+struct timespec Collection::getLastIndexing() const {
+    Info info;
+    _info->seekg(0, std::ios::end);
+    if (_info->tellg() > 0) {
+        /* the file is not empty */
+        _info->seekg(0);
+        utils::Deserialize(*_info, info);
+    }
+    return info.lastIndexing;
+}
+
+std::vector<fileId_t> Collection::search(const std::string& pattern,
+                                         bool prefix)
+{
+    if (!_pathIndex) {
+        loadPathIndex();
+    }
+    return _pathIndex->find(pattern, prefix);
+}
+
 std::string Collection::getName() const {
     return _indexingConn->getName();
 }
@@ -614,6 +959,92 @@ void Collection::updateCopiesSz() {
          "cache")
 }
 
+void Collection::buildPathIndex() {
+    DLOG("Collection", this, "Building the path index")
+
+    _pathIndex = std::make_unique<PathIndex>();
+
+    /* read the filepaths at once instead of two seeks per file */
+    _filepaths->seekg(0, std::ios::end);
+    const auto len = _filepaths->tellg();
+    if (len <= 0) {
+        _filepaths->clear();
+        return;
+    }
+    std::string paths(static_cast<size_t>(len), '\0');
+    _filepaths->seekg(0);
+    _filepaths->read(&paths[0], len);
+
+    _mapping->seekg(0);
+    MapNode node;
+    fileId_t id = 0;
+    while (utils::Deserialize(*_mapping, node)) {
+        if (node.lenght > 0 && node.offset + node.lenght <= paths.size()) {
+            _pathIndex->insert(id, paths.substr(node.offset, node.lenght));
+        }
+        id++;
+    }
+    _mapping->clear();
+
+    ILOG("Collection", this, "Indexed " << _pathIndex->size() << " paths")
+}
+
+void Collection::loadPathIndex() {
+    if (!_pathIndexFile) {
+        _pathIndexFile = std::make_unique<utils::SyncDirectory::FileStream>(
+            _storing, _storingPath / PATHINDEX_FILE);
+    }
+    _pathIndex = std::make_unique<PathIndex>();
+
+    /* stamped with the mapping it has been built from */
+    _pathIndexFile->seekg(0);
+    uint32_t hash;
+    if (utils::Deserialize(*_pathIndexFile, hash) && hash == hashMapping() &&
+        _pathIndex->load(*_pathIndexFile))
+    {
+        _pathIndexFile->clear();
+        return;
+    }
+    _pathIndexFile->clear();
+
+    ILOG("Collection", this, "Outdated path index "
+         << _pathIndexFile->getPath())
+    buildPathIndex();
+    savePathIndex();
+}
+
+void Collection::savePathIndex() {
+    DLOG("Collection", this, "Saving the path index")
+
+    utils::TempFile tmp;
+    utils::Serialize(tmp, hashMapping());
+    _pathIndex->save(tmp);
+    tmp.flush();
+
+    _pathIndexFile->take(tmp);
+    if (!_pathIndexFile->push()) {
+        /* saved by another client meanwhile, its index being checked against
+         * the mapping when loaded */
+        DLOG("Collection", this, "Path index saved concurrently")
+        _pathIndexFile->pull();
+    }
+}
+
+uint32_t Collection::hashMapping() const {
+    /* changed by any added, removed or moved path */
+    _mapping->seekg(0, std::ios::end);
+    const auto len = _mapping->tellg();
+    if (len <= 0) {
+        _mapping->clear();
+        return 0;
+    }
+    fileBuf_t buf(static_cast<size_t>(len));
+    _mapping->seekg(0);
+    _mapping->read(reinterpret_cast<char*>(buf.data()), len);
+    _mapping->clear();
+    return utils::fnv1a(buf);
+}
+
 #ifdef ENABLE_OPENCV
 fileBuf_t Collection::makePreview(const cv::Mat& img) {
     fileBuf_t buffer;
@@ -0,0 +1,100 @@
+#include "fnifi/utils/Compression.hpp"
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif  /* ENABLE_ZSTD */
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+
+
+using namespace fnifi;
+using namespace fnifi::utils;
+
+bool Compression::IsAvailable() {
+#ifdef ENABLE_ZSTD
+    return true;
+#else  /* ENABLE_ZSTD */
+    return false;
+#endif  /* ENABLE_ZSTD */
+}
+
+bool Compression::MayBeCompressed(const fileBuf_t& buf) {
+    return buf.size() >= ZSTD_FRAME_MAGIC_SIZE &&
+        std::memcmp(buf.data(), ZSTD_FRAME_MAGIC, ZSTD_FRAME_MAGIC_SIZE) == 0;
+}
+
+Compression::Marker Compression::Mark(const fileBuf_t& raw,
+                                      const fileBuf_t& compressed)
+{
+    return {static_cast<uint64_t>(raw.size()),
+        static_cast<uint64_t>(compressed.size()), fnv1a(compressed)};
+}
+
+bool Compression::IsMarked(const fileBuf_t& buf, const Marker& marker) {
+    return MayBeCompressed(buf) && buf.size() == marker.size &&
+        fnv1a(buf) == marker.hash;
+}
+
+bool Compression::Compress(const fileBuf_t& buf, fileBuf_t& res) {
+#ifdef ENABLE_ZSTD
+    res.resize(ZSTD_compressBound(buf.size()));
+    const auto len = ZSTD_compress(res.data(), res.size(), buf.data(),
+                                   buf.size(), COMPRESSION_LEVEL);
+    if (ZSTD_isError(len)) {
+        WLOG("Compression", "(static)", "Failed to compress " << buf.size()
+             << " bytes: " << ZSTD_getErrorName(len))
+        return false;
+    }
+    if (len >= buf.size()) {
+        /* not worth it */
+        return false;
+    }
+    res.resize(len);
+
+    DLOG("Compression", "(static)", "Compressed " << buf.size() << " bytes "
+         "into " << res.size())
+
+    return true;
+#else  /* ENABLE_ZSTD */
+    UNUSED(buf)
+    UNUSED(res)
+    return false;
+#endif  /* ENABLE_ZSTD */
+}
+
+fileBuf_t Compression::Decompress(const fileBuf_t& buf, size_t rawSz) {
+#ifdef ENABLE_ZSTD
+    /* the size of the marker is only trusted if the frame agrees */
+    const auto frameSz = ZSTD_getFrameContentSize(buf.data(), buf.size());
+    if (frameSz == ZSTD_CONTENTSIZE_UNKNOWN ||
+        frameSz == ZSTD_CONTENTSIZE_ERROR || frameSz != rawSz)
+    {
+        std::ostringstream msg;
+        msg << "Compressed content of " << buf.size() << " bytes does not "
+            "decompress into the " << rawSz << " bytes of its marker";
+        ELOG("Compression", "(static)", msg.str())
+        throw std::runtime_error(msg.str());
+    }
+
+    fileBuf_t res(rawSz, 0);
+    const auto len = ZSTD_decompress(res.data(), res.size(), buf.data(),
+                                     buf.size());
+    if (ZSTD_isError(len) || len != res.size()) {
+        std::ostringstream msg;
+        msg << "Corrupted compressed content of " << buf.size() << " bytes";
+        if (ZSTD_isError(len)) {
+            msg << ": " << ZSTD_getErrorName(len);
+        }
+        ELOG("Compression", "(static)", msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    return res;
+#else  /* ENABLE_ZSTD */
+    UNUSED(buf)
+    UNUSED(rawSz)
+    std::ostringstream msg;
+    msg << "Cannot decompress a content as zstd is disabled";
+    ELOG("Compression", "(static)", msg.str())
+    throw std::runtime_error(msg.str());
+#endif  /* ENABLE_ZSTD */
+}
@@ -57,7 +57,8 @@ DirectoryIterator::DirectoryIterator(void* data, const std::function<
     std::string name;
     auto entry = nextEntry(data, name);
     while (entry != nullptr) {
-        _entries.insert({name, entry->mtime_ts});
+        _entries.insert({name, entry->mtime_ts,
+                         static_cast<off_t>(entry->size)});
         entry = nextEntry(data, name);
     }
 
@@ -77,7 +78,7 @@ DirectoryIterator::DirectoryIterator(void* data, const std::function<
         _entries.insert({name, {
             .tv_sec = static_cast<time_t>(entry->st.smb2_mtime),
             .tv_nsec = static_cast<long>(entry->st.smb2_mtime_nsec),
-        }});
+        }, static_cast<off_t>(entry->st.smb2_size)});
         entry = nextEntry(data, name);
     }
 
@@ -95,7 +96,7 @@ DirectoryIterator::DirectoryIterator(const DirectoryIterator& dirit,
         /* TODO: std::fs::relative is a pretty slow function */
         const auto name = std::filesystem::relative(entry.path, path)
             .string();
-        _entries.insert({name, entry.mtime});
+        _entries.insert({name, entry.mtime, entry.size});
     }
 
     ILOG("DirectoryIterator", this, "Found " << _entries.size() << " elements")
@@ -127,7 +128,8 @@ void DirectoryIterator::addEntry(const std::filesystem::directory_entry& entry,
     ) {
         struct stat fileStat;
         if (lstat(entry.path().c_str(), &fileStat) == 0) {
-            _entries.insert({entry.path(), fileStat.st_mtimespec});
+            _entries.insert({entry.path(), fileStat.st_mtimespec,
+                             fileStat.st_size});
         } else {
             WLOG("DirectoryIterator", this, "Failed to get the metadata of "
                  << entry.path() << ": this file is ignored")
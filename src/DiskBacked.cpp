@@ -1,35 +1,215 @@
 #include "fnifi/expression/DiskBacked.hpp"
+#include "fnifi/utils/Task.hpp"
 #include <csignal>
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <sstream>
 
 
 using namespace fnifi;
 using namespace fnifi::expression;
 
 void DiskBacked::Uncache(const utils::SyncDirectory& storing,
-                         const std::filesystem::path& path, fileId_t id)
+                         const std::filesystem::path& path,
+                         const std::unordered_map<fileId_t, file::changes_t>&
+                         ids, const std::vector<DiskBacked*>& live)
 {
-    DLOG("DiskBacked", "(static)", "Uncaching file id " << id
-         << " for directory " << path)
-
-    if (std::filesystem::exists(path)) {
-        for (const auto& entry : std::filesystem::directory_iterator(path)) {
-            if (entry.is_regular_file()) {
-                /* write an empty results on the id position */
-                auto file = storing.open(path / entry.path().filename());
-                file.seekp(id * sizeof(expr_t));
-                utils::Serialize(file, EMPTY_EXPR_T);
-                file.push();
-                file.close();
+    DLOG("DiskBacked", "(static)", "Uncaching " << ids.size() << " file ids "
+         "for directory " << path)
+
+    if (ids.empty()) {
+        return;
+    }
+
+    /* the files already opened are mapped: a second instance over them would
+     * race with their own pushes */
+    std::unordered_set<std::string> handled;
+    for (const auto& instance : live) {
+        if (instance->uncache(path, ids)) {
+            handled.insert(instance->_keyHash);
+        }
+    }
+
+    /* the remote listing also covers the results never pulled locally */
+    const auto entries = storing.list(path);
+    std::unordered_set<std::string> filenames;
+    for (const auto& entry : entries) {
+        filenames.insert(std::filesystem::path(entry.path).filename().string());
+    }
+    for (const auto& entry : entries) {
+        const auto filename = std::filesystem::path(entry.path).filename();
+        if (filename.extension() == META_EXTENSION ||
+            filename.extension() == UPDATE_LOG_EXTENSION ||
+            handled.contains(filename.string()))
+        {
+            continue;
+        }
+
+        /* the dependencies are read first so that the unaffected results are
+         * never opened */
+        file::changes_t deps = file::ANY_CHANGE;
+        if (filenames.contains(filename.string() + META_EXTENSION)) {
+            deps = LoadDependencies(storing, path, filename.string());
+        }
+        std::vector<fileId_t> affected;
+        for (const auto& id : ids) {
+            if (id.second & deps) {
+                affected.push_back(id.first);
             }
         }
+        if (affected.empty()) {
+            continue;
+        }
+
+        const expr_t empty = EMPTY_EXPR_T;
+        const auto emptyBytes = reinterpret_cast<const unsigned char*>(&empty);
+        utils::SyncDirectory::LoggedFile file(
+            storing, path / filename,
+            fileBuf_t(emptyBytes, emptyBytes + sizeof(expr_t)));
+        bool hasChanged = false;
+        for (const auto& id : affected) {
+            const auto pos = id * sizeof(expr_t);
+            if (pos >= file.size()) {
+                /* not cached */
+                continue;
+            }
+
+            /* log an empty results on the id position */
+            file.set(pos, emptyBytes);
+            hasChanged = true;
+        }
+        if (hasChanged) {
+            file.push();
+        }
     }
 }
 
+file::changes_t DiskBacked::LoadDependencies(
+    const utils::SyncDirectory& storing, const std::filesystem::path& path,
+    const std::string& keyHash)
+{
+    return LoadMeta(storing, path, keyHash).deps;
+}
+
+std::vector<std::string> DiskBacked::Collect(
+    const utils::SyncDirectory& storing, const std::filesystem::path& path,
+    size_t maxSize, time_t maxAge,
+    const std::function<bool(const std::string&)>& evict)
+{
+    DLOG("DiskBacked", "(static)", "Collecting garbage in directory " << path
+         << " up to " << maxSize << " bytes and " << maxAge << " seconds")
+
+    struct Candidate {
+        std::string keyHash;
+        time_t lastAccess;
+        size_t size;
+    };
+
+    /* the sizes of the results and of their logs come with the listing */
+    const auto entries = storing.list(path);
+    std::unordered_map<std::string, off_t> sizes;
+    for (const auto& entry : entries) {
+        sizes.insert({std::filesystem::path(entry.path).filename().string(),
+                      entry.size});
+    }
+
+    std::vector<Candidate> candidates;
+    size_t totalSz = 0;
+    for (const auto& entry : entries) {
+        if (utils::Task::IsCancelled()) {
+            return {};
+        }
+
+        const auto filename = std::filesystem::path(entry.path).filename();
+        if (filename.extension() == META_EXTENSION ||
+            filename.extension() == UPDATE_LOG_EXTENSION)
+        {
+            continue;
+        }
+
+        const auto keyHash = filename.string();
+        time_t lastAccess = 0;
+        if (sizes.contains(keyHash + META_EXTENSION)) {
+            lastAccess = LoadMeta(storing, path, keyHash).lastAccess;
+        }
+        if (lastAccess == 0) {
+            /* never tracked: last written instead */
+            lastAccess = entry.mtime.tv_sec;
+        }
+        const auto log = sizes.find(keyHash + UPDATE_LOG_EXTENSION);
+        const auto size = static_cast<size_t>(
+            entry.size + (log != sizes.end() ? log->second : 0));
+        candidates.push_back({keyHash, lastAccess, size});
+        totalSz += size;
+    }
+
+    /* least recently accessed first */
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate& a, const Candidate& b) {
+                  return a.lastAccess < b.lastAccess;
+              });
+
+    const auto now = std::time(nullptr);
+    std::vector<std::string> evicted;
+    for (const auto& candidate : candidates) {
+        if (utils::Task::IsCancelled() ||
+            (now - candidate.lastAccess <= maxAge && totalSz <= maxSize))
+        {
+            break;
+        }
+
+        if (evict(candidate.keyHash)) {
+            totalSz -= candidate.size;
+            evicted.push_back(candidate.keyHash);
+        }
+    }
+
+    ILOG("DiskBacked", "(static)", "Evicted " << evicted.size() << " out of "
+         << candidates.size() << " results in directory " << path)
+
+    return evicted;
+}
+
+void DiskBacked::Remove(const utils::SyncDirectory& storing,
+                        const std::filesystem::path& path,
+                        const std::string& keyHash)
+{
+    DLOG("DiskBacked", "(static)", "Removing results " << keyHash
+         << " in directory " << path)
+
+    storing.remove(path / keyHash, true);
+    storing.remove(path / (keyHash + UPDATE_LOG_EXTENSION), true);
+    storing.remove(path / (keyHash + META_EXTENSION), true);
+}
+
+DiskBacked::Meta DiskBacked::LoadMeta(const utils::SyncDirectory& storing,
+                                      const std::filesystem::path& path,
+                                      const std::string& keyHash)
+{
+    const auto buf = storing.read(path / (keyHash + META_EXTENSION));
+    std::istringstream is(std::string(buf.begin(), buf.end()));
+    return ReadMeta(is);
+}
+
+DiskBacked::Meta DiskBacked::ReadMeta(std::istream& is) {
+    Meta meta;
+    if (!utils::Deserialize(is, meta.deps)) {
+        /* written before the dependencies were tracked */
+        meta.deps = file::ANY_CHANGE;
+    } else if (!utils::Deserialize(is, meta.lastAccess)) {
+        /* written before the accesses were tracked */
+        meta.lastAccess = 0;
+    }
+    return meta;
+}
+
 DiskBacked::DiskBacked(const std::string& key,
            const utils::SyncDirectory& storing,
            const std::vector<file::Collection*>& colls,
            const std::filesystem::path& parentDirName)
-: _keyHash(utils::Hash(key)), _storing(storing), _parentDirName(parentDirName)
+: _keyHash(utils::Hash(key)), _storing(storing),
+    _parentDirName(parentDirName), _deps(file::ANY_CHANGE), _depsKnown(false)
 {
     DLOG("DiskBacked", this, "Instanciation for key \"" << key << "\"")
 
@@ -38,48 +218,82 @@ DiskBacked::DiskBacked(const std::string& key,
     }
 }
 
-DiskBacked::~DiskBacked() {
-    for (auto& stored : _storedColls) {
-        if (stored.second.file->is_open()) {
-            stored.second.file->close();
-        }
-    }
-}
+DiskBacked::~DiskBacked() {}
 
 void DiskBacked::addCollection(const file::Collection& coll) {
+    const auto id = coll.getId();
+    if (id >= _storedColls.size()) {
+        _storedColls.resize(id + 1);
+    }
+    auto& stored = _storedColls[id];
+    if (stored.file) {
+        /* already added */
+        return;
+    }
+
     /* create or open the file */
-    const auto name = coll.getName();
-    const auto filename = utils::Hash(name) / _parentDirName / _keyHash;
-    bool ate = false;
-    if (_storing.exists(filename)) {
-        ate = true;
+    stored.dirname = utils::Hash(coll.getName()) / _parentDirName;
+    const auto filename = stored.dirname / _keyHash;
+
+    /* the results of the files are independent from each other */
+    const expr_t empty = EMPTY_EXPR_T;
+    const auto emptyBytes = reinterpret_cast<const unsigned char*>(&empty);
+    stored.file = std::make_unique<utils::SyncDirectory::LoggedFile>(
+        _storing, filename, fileBuf_t(emptyBytes,
+                                      emptyBytes + sizeof(expr_t)));
+    stored.NIds = static_cast<fileId_t>(stored.file->size() / sizeof(expr_t));
+
+    if (_depsKnown) {
+        saveMeta(stored.dirname);
     }
+}
+
+const std::string& DiskBacked::getKeyHash() const {
+    return _keyHash;
+}
+
+file::changes_t DiskBacked::getDependencies() const {
+    return _deps;
+}
 
-    /* fill _stored */
-    const auto& storedColl = _storedColls.emplace(
-        std::piecewise_construct,
-        std::forward_as_tuple(name),
-        std::forward_as_tuple(
-            std::make_unique<utils::SyncDirectory::FileStream>(
-                _storing, filename, ate),
-            0
-        )
-    );
+void DiskBacked::setDependencies(file::changes_t deps) {
+    DLOG("DiskBacked", this, "Depends on changes " << static_cast<int>(deps))
 
-    if (ate) {
-        /* the file already existed */
-        storedColl.first->second.NIds = static_cast<fileId_t>(
-            static_cast<size_t>(storedColl.first->second.file->tellg())
-            / sizeof(expr_t));
+    _deps = deps;
+    _depsKnown = true;
+    for (const auto& stored : _storedColls) {
+        if (stored.file) {
+            saveMeta(stored.dirname);
+        }
+    }
+}
+
+void DiskBacked::saveMeta(const std::filesystem::path& dirname) const {
+    /* written only when outdated, to avoid a push on each instanciation */
+    auto file = _storing.open(dirname / (_keyHash + META_EXTENSION));
+    Meta meta = ReadMeta(file);
+    const auto now = std::time(nullptr);
+    if (meta.deps == _deps && now - meta.lastAccess < ACCESS_RESOLUTION) {
+        file.close();
+        return;
     }
+    meta.deps = _deps;
+    meta.lastAccess = now;
+
+    file.clear();
+    file.seekp(0);
+    utils::Serialize(file, meta.deps);
+    utils::Serialize(file, meta.lastAccess);
+    file.push();
+    file.close();
 }
 
 expr_t DiskBacked::get(const file::File* file) {
     DLOG("DiskBacked", this, "Retrieving result for File " << file)
 
     /* get the associated stored file */
-    const auto stored = _storedColls.find(file->getCollectionName());
-    if (stored == _storedColls.end()) {
+    const auto stored = getStoredColl(file->getCollectionId());
+    if (!stored) {
         ELOG("DiskBacked ", this, "Called on a file that belongs to an unknown"
              " Collection (" << file->getCollectionName() << ") Aborting the "
              "call.")
@@ -89,64 +303,96 @@ expr_t DiskBacked::get(const file::File* file) {
     const auto id = file->getId();
     const auto pos = id * sizeof(expr_t);
 
-    if (stored->second.file->pull()) {
+    if (stored->file->pull()) {
         /* update NIds */
-        stored->second.file->seekg(0, std::ios::end);
-        stored->second.NIds = static_cast<fileId_t>(static_cast<size_t>(
-            stored->second.file->tellg()) / sizeof(expr_t));
+        stored->NIds = static_cast<fileId_t>(stored->file->size()
+                                             / sizeof(expr_t));
     }
 
-    if (id < stored->second.NIds) {
+    if (id < stored->NIds) {
         /* the value may be saved */
         expr_t res;
-        stored->second.file->seekg(std::streamoff(pos));
-        utils::Deserialize(*stored->second.file, res);
+        std::memcpy(&res, stored->file->data() + pos, sizeof(expr_t));
 
         if (res != EMPTY_EXPR_T) {
             /* the value was saved */
             return res;
         }
-
-        stored->second.file->seekg(std::streamoff(pos));
     } else {
         /* filling the file up to the position of the value */
-        stored->second.file->seekp(0, std::ios::end);
-        for (auto i = stored->second.NIds; i < id; ++i) {
-            /* TODO avoid multiples std::ofstream::write calls */
-            utils::Serialize(*stored->second.file, EMPTY_EXPR_T);
-        }
-        stored->second.NIds = id + 1;
+        stored->file->grow(pos + sizeof(expr_t));
+        stored->NIds = static_cast<fileId_t>(stored->file->size()
+                                             / sizeof(expr_t));
     }
 
     DLOG("DiskBacked", this, "Results for File " << file << " was not cached")
 
     const auto res = getValue(file);
-    stored->second.file->seekp(std::streamoff(pos));
-    utils::Serialize(*stored->second.file, res);
+    stored->file->set(pos, reinterpret_cast<const unsigned char*>(&res));
 
-    stored->second.file->push();
+    stored->file->push();
 
     return res;
 }
 
-void DiskBacked::disableSync(const std::string& collName, bool pull) {
-    const auto stored = _storedColls.find(collName);
-    if (stored == _storedColls.end()) {
+void DiskBacked::disableSync(collId_t collId, bool pull) {
+    const auto stored = getStoredColl(collId);
+    if (!stored) {
         ELOG("DiskBacked", this, "Lock called on a file that belongs to an "
-             "unknown Collection (" << collName << ") Aborting the call.")
+             "unknown Collection (" << collId << ") Aborting the call.")
         return;
     }
 
-    stored->second.file->disableSync(pull);
+    stored->file->disableSync(pull);
 }
 
-void DiskBacked::enableSync(const std::string& collName, bool push) {
-    const auto stored = _storedColls.find(collName);
-    if (stored == _storedColls.end()) {
+void DiskBacked::enableSync(collId_t collId, bool push) {
+    const auto stored = getStoredColl(collId);
+    if (!stored) {
         ELOG("DiskBacked", this, "Unlock called on a file that belongs to an "
-            "unknown Collection (" << collName << ") Aborting the call.")
+            "unknown Collection (" << collId << ") Aborting the call.")
         return;
     }
 
-    stored->second.file->enableSync(push);
+    stored->file->enableSync(push);
+}
+
+bool DiskBacked::uncache(const std::filesystem::path& path,
+                         const std::unordered_map<fileId_t, file::changes_t>&
+                         ids)
+{
+    const expr_t empty = EMPTY_EXPR_T;
+    const auto emptyBytes = reinterpret_cast<const unsigned char*>(&empty);
+    bool owned = false;
+    for (auto& stored : _storedColls) {
+        if (!stored.file || stored.dirname != path) {
+            continue;
+        }
+        owned = true;
+
+        stored.file->pull();
+        bool hasChanged = false;
+        for (const auto& id : ids) {
+            const auto pos = id.first * sizeof(expr_t);
+            if (!(id.second & _deps) || pos >= stored.file->size()) {
+                /* unaffected or not cached */
+                continue;
+            }
+
+            stored.file->set(pos, emptyBytes);
+            hasChanged = true;
+        }
+        if (hasChanged) {
+            DLOG("DiskBacked", this, "Uncached results in directory " << path)
+            stored.file->push();
+        }
+    }
+    return owned;
+}
+
+DiskBacked::StoredColl* DiskBacked::getStoredColl(collId_t collId) {
+    if (collId >= _storedColls.size() || !_storedColls[collId].file) {
+        return nullptr;
+    }
+    return &_storedColls[collId];
 }
@@ -1,21 +1,60 @@
 #include "fnifi/expression/Expression.hpp"
-
-#define EXPRESSIONS_DIRNAME "expressions"
+#include <algorithm>
 
 
 using namespace fnifi;
 using namespace fnifi::expression;
 
 void Expression::Uncache(const utils::SyncDirectory& sync,
-                         const std::filesystem::path& collPath, fileId_t id)
+                         const std::filesystem::path& collPath,
+                         const std::unordered_map<fileId_t, file::changes_t>&
+                         ids, const std::vector<DiskBacked*>& live)
+{
+    DiskBacked::Uncache(sync, collPath / EXPRESSIONS_DIRNAME, ids, live);
+}
+
+file::changes_t Expression::LoadDependencies(
+    const utils::SyncDirectory& sync, const std::filesystem::path& collPath,
+    const std::string& keyHash)
+{
+    return DiskBacked::LoadDependencies(sync, collPath / EXPRESSIONS_DIRNAME,
+                                        keyHash);
+}
+
+std::vector<std::string> Expression::Collect(
+    const utils::SyncDirectory& sync, const std::filesystem::path& collPath,
+    size_t maxSize, time_t maxAge,
+    const std::function<bool(const std::string&)>& evict)
+{
+    return DiskBacked::Collect(sync, collPath / EXPRESSIONS_DIRNAME, maxSize,
+                               maxAge, evict);
+}
+
+void Expression::Remove(const utils::SyncDirectory& sync,
+                        const std::filesystem::path& collPath,
+                        const std::string& keyHash)
 {
-    DiskBacked::Uncache(sync, collPath / EXPRESSIONS_DIRNAME, id);
+    DiskBacked::Remove(sync, collPath / EXPRESSIONS_DIRNAME, keyHash);
+}
+
+std::string Expression::Canonicalize(const std::string& expr) {
+    Node root;
+    size_t pos = 0;
+    if (!Parse(expr, pos, root) ||
+        expr.find_first_not_of(" \t\n\r", pos) != std::string::npos)
+    {
+        /* malformed: left to sxeval to report it */
+        return expr;
+    }
+
+    Simplify(root);
+    return Print(root);
 }
 
 Expression::Expression(const std::string& expr,
                        const utils::SyncDirectory& storing,
                        const std::vector<file::Collection*>& colls)
-: DiskBacked(expr, storing, colls, EXPRESSIONS_DIRNAME)
+: DiskBacked(Canonicalize(expr), storing, colls, EXPRESSIONS_DIRNAME)
 {
     DLOG("Expression", this, "Instanciation for expr \"" << expr << "\"")
 
@@ -27,6 +66,13 @@ Expression::Expression(const std::string& expr,
             return _vars.back().ref;
         };
     _sxeval.build(expr, _handler);
+
+    /* the results are only invalidated by the changes of what they read */
+    file::changes_t deps = file::NO_CHANGE;
+    for (const auto& var : _vars) {
+        deps |= file::GetDependencies(var.var->getKind());
+    }
+    setDependencies(deps);
 }
 
 expr_t Expression::getValue(const file::File* file) {
@@ -49,18 +95,117 @@ void Expression::addCollection(const file::Collection& coll) {
     }
 }
 
-void Expression::disableSync(const std::string& collName, bool pull) {
-    DiskBacked::disableSync(collName, pull);
+void Expression::disableSync(collId_t collId, bool pull) {
+    DiskBacked::disableSync(collId, pull);
 
     for (auto& var : _vars) {
-        var.var->disableSync(collName, pull);
+        var.var->disableSync(collId, pull);
     }
 }
 
-void Expression::enableSync(const std::string& collName, bool push) {
-    DiskBacked::enableSync(collName, push);
+void Expression::enableSync(collId_t collId, bool push) {
+    DiskBacked::enableSync(collId, push);
 
     for (auto& var : _vars) {
-        var.var->enableSync(collName, push);
+        var.var->enableSync(collId, push);
+    }
+}
+
+bool Expression::Parse(const std::string& expr, size_t& pos, Node& node) {
+    static const std::string blanks = " \t\n\r";
+    static const std::string delimiters = blanks + "()";
+
+    pos = expr.find_first_not_of(blanks, pos);
+    if (pos == std::string::npos || expr[pos] == ')') {
+        return false;
+    }
+
+    if (expr[pos] != '(') {
+        /* atom */
+        const auto end = std::min(expr.find_first_of(delimiters, pos),
+                                  expr.size());
+        node.atom = expr.substr(pos, end - pos);
+        pos = end;
+        return true;
+    }
+
+    /* list */
+    ++pos;
+    while (true) {
+        pos = expr.find_first_not_of(blanks, pos);
+        if (pos == std::string::npos) {
+            /* unbalanced parenthesis */
+            return false;
+        }
+        if (expr[pos] == ')') {
+            ++pos;
+            return !node.children.empty();
+        }
+        Node child;
+        if (!Parse(expr, pos, child)) {
+            return false;
+        }
+        node.children.push_back(std::move(child));
+    }
+}
+
+void Expression::Simplify(Node& node) {
+    for (auto& child : node.children) {
+        Simplify(child);
+    }
+
+    if (node.children.size() < 2 || !node.children.front().children.empty())
+    {
+        return;
+    }
+    const auto& op = node.children.front().atom;
+    std::string identity;
+    if (op == "+") {
+        identity = "0";
+    } else if (op == "*") {
+        identity = "1";
+    } else {
+        /* not commutative */
+        return;
+    }
+
+    /* drop the identity operands and sort the others */
+    std::vector<std::pair<std::string, Node>> operands;
+    for (auto it = node.children.begin() + 1; it != node.children.end(); ++it)
+    {
+        if (it->atom != identity) {
+            auto text = Print(*it);
+            operands.emplace_back(std::move(text), std::move(*it));
+        }
+    }
+    std::sort(operands.begin(), operands.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    if (operands.empty()) {
+        node = {identity, {}};
+    } else if (operands.size() == 1) {
+        auto operand = std::move(operands.front().second);
+        node = std::move(operand);
+    } else {
+        node.children.resize(1);
+        for (auto& operand : operands) {
+            node.children.push_back(std::move(operand.second));
+        }
+    }
+}
+
+std::string Expression::Print(const Node& node) {
+    if (node.children.empty()) {
+        return node.atom;
+    }
+
+    std::string res = "(";
+    for (const auto& child : node.children) {
+        if (res.size() > 1) {
+            res += ' ';
+        }
+        res += Print(child);
     }
+    res += ')';
+    return res;
 }
@@ -1,55 +1,31 @@
 #include "fnifi/FNIFI.hpp"
+#include <algorithm>
 #include <ctime>
 #include <cstdlib>
+#include <thread>
 
 
 using namespace fnifi;
 
-FNIFI::Iterator::Iterator(FNIFI::fileset_t::const_iterator p,
-                          std::unordered_set<const file::File*>& toRemove,
-                          FNIFI::fileset_t& files)
-: _p(p), _toRemove(toRemove), _files(files)
+FNIFI::Iterator::Iterator(size_t i, FNIFI& fnifi)
+: _i(i), _fnifi(fnifi)
 {
-    DLOG("FNIFI::Iterator", this, "Instanciation for File " << *p)
+    DLOG("FNIFI::Iterator", this, "Instanciation at position " << i
+         << " for FNIFI " << &fnifi)
 }
 
 FNIFI::Iterator::reference FNIFI::Iterator::operator*() const {
-    return *_p;
+    return _fnifi._view[_i];
 }
 
 FNIFI::Iterator::pointer FNIFI::Iterator::operator->() const {
-    return *_p;
+    return _fnifi._view[_i];
 }
 
 FNIFI::Iterator& FNIFI::Iterator::operator++() {
-    if (*_p == *_files.end()) {
-        /* no elements remainings */
-        return *this;
+    if (!isEnd()) {
+        ++_i;
     }
-
-    ++_p;
-    if (*_p == *_files.end()) {
-        /* no elements remainings */
-        return *this;
-    }
-
-    auto it = _toRemove.find(*_p);
-    while (it != _toRemove.end()) {
-        /* this iterator should be removed */
-        _p = _files.erase(_p);
-        if (*_p == *_files.end()) {
-            /* no elements remainings */
-            return *this;
-        }
-        _toRemove.erase(it);
-        it = _toRemove.find(*_p);
-    }
-
-    if ((*_p)->isFilteredOut()) {
-        /* this file is filtered out */
-        return ++(*this);
-    }
-
     return *this;
 }
 
@@ -60,29 +36,60 @@ FNIFI::Iterator FNIFI::Iterator::operator++(int) {
 }
 
 bool FNIFI::Iterator::operator==(const Iterator& other) const {
-    return _p == other._p;
+    if (_i == other._i) {
+        return true;
+    }
+    return isEnd() && other.isEnd();
 }
 
 bool FNIFI::Iterator::operator!=(const Iterator& other) const {
     return !(*this == other);
 }
 
-FNIFI::FNIFI(utils::SyncDirectory& storing)
-: _sortExpr(nullptr), _filtExpr(nullptr),
-    _storing(storing)
+bool FNIFI::Iterator::isEnd() const {
+    /* the visible files are materialized as the iterator goes */
+    return !_fnifi.materialize(_i);
+}
+
+FNIFI::FNIFI(utils::SyncDirectory& storing, size_t maxExpressions)
+: _maxExprs(maxExpressions), _sortExpr(nullptr), _filtExpr(nullptr),
+    _lazyFilter(false), _searchPrefix(false), _searching(false),
+    _box({0, 0, 0, 0}), _boxing(false), _warmExprs(false), _warming(false),
+    _lastActivity(0), _storing(storing)
 {
     DLOG("FNIFI", this, "Instanciation with SyncDirectory " << &storing)
 
     std::srand(static_cast<unsigned int>(std::time({})));
+
+    resetView();
+}
+
+FNIFI::~FNIFI() {
+    /* the tasks should not outlive the instance. The main one first, as it
+     * may start a warm-up */
+    const auto stop = [](const std::shared_ptr<utils::Task>& task) {
+        if (task) {
+            task->cancel();
+            try {
+                task->wait();
+            } catch (...) {
+                /* nobody left to handle it */
+            }
+        }
+    };
+    stop(_task);
+    stop(_gcTask);
+    stop(_warmTask);
 }
 
 void FNIFI::addCollection(file::Collection& coll, bool index) {
-    if (index) {
-        indexColl(coll);
+    const auto lk = busy();
+
+    for (auto& expr : _exprs) {
+        expr.second->addCollection(coll);
     }
 
     if (_sortExpr) {
-        _sortExpr->addCollection(coll);
         sortColl(coll); /* note that this also adds files to _files */
     } else {
         for (const auto& file : coll) {
@@ -90,18 +97,26 @@ void FNIFI::addCollection(file::Collection& coll, bool index) {
         }
     }
 
-    if (_filtExpr) {
-        _filtExpr->addCollection(coll);
+    if (_filtExpr || isRestricted()) {
         filterColl(coll);
     }
 
     _colls.push_back(&coll);
+
+    /* once the collection is known by the expressions */
+    if (index) {
+        indexColl(coll);
+    }
+
+    resetView();
 }
 
 
 void FNIFI::defragment() {
     DLOG("FNIFI", this, "Defragmentation")
  
+    const auto lk = busy();
+
     for (auto& coll : _colls) {
          coll->defragment();
     }
@@ -110,60 +125,397 @@ void FNIFI::defragment() {
 void FNIFI::index() {
     DLOG("FNIFI", this, "Indexation")
 
+    const auto lk = busy();
+
     for (auto& coll : _colls) {
         indexColl(*coll);
+        if (utils::Task::IsCancelled()) {
+            ILOG("FNIFI", this, "Indexation cancelled")
+            return;
+        }
     }
+
+    startWarmUp();
 }
 
 void FNIFI::sort(const std::string& expr) {
     DLOG("FNIFI", this, "Sorting with expresion \"" << expr << "\"")
 
+    const auto lk = busy();
+
     _files.clear();
-    _sortExpr = std::make_unique<expression::Expression>(expr, _storing,
-                                                         _colls);
+    _sortExpr = getExpression(expr);
     for (const auto& coll : _colls) {
         sortColl(*coll);
+        if (utils::Task::IsCancelled()) {
+            break;
+        }
     }
+
+    if (utils::Task::IsCancelled()) {
+        /* the files are left unsorted */
+        ILOG("FNIFI", this, "Sorting cancelled")
+        _sortExpr = nullptr;
+        _files.clear();
+        for (const auto& coll : _colls) {
+            for (const auto& file : *coll) {
+                _files.insert(&file.second);
+            }
+        }
+    }
+
+    resetView();
 }
 
-void FNIFI::filter(const std::string& expr) {
-    DLOG("FNIFI", this, "Filtering with expresion \"" << expr << "\"")
+void FNIFI::filter(const std::string& expr, bool lazy) {
+    DLOG("FNIFI", this, "Filtering " << (lazy ? "lazily " : "") << "with "
+         "expresion \"" << expr << "\"")
 
-    _filtExpr = std::make_unique<expression::Expression>(expr, _storing,
-                                                         _colls);
+    const auto lk = busy();
+
+    _filtExpr = getExpression(expr);
+    _lazyFilter = lazy;
+    _lazyResults.clear();
     for (const auto& coll : _colls) {
         filterColl(*coll);
+        if (utils::Task::IsCancelled()) {
+            break;
+        }
+    }
+
+    if (utils::Task::IsCancelled()) {
+        /* the files are left unfiltered */
+        ILOG("FNIFI", this, "Filtering cancelled")
+        _filtExpr = nullptr;
+        for (const auto& coll : _colls) {
+            filterColl(*coll);
+        }
+    }
+
+    resetView();
+}
+
+void FNIFI::search(const std::string& pattern, bool prefix) {
+    DLOG("FNIFI", this, "Searching for paths " << (prefix ? "starting with"
+         : "containing") << " \"" << pattern << "\"")
+
+    const auto lk = busy();
+
+    _search = pattern;
+    _searchPrefix = prefix;
+    _searching = true;
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+void FNIFI::range(expression::Kind kind, expr_t min, expr_t max,
+                  const std::string& key)
+{
+    DLOG("FNIFI", this, "Keeping the values of kind " << kind << " in ["
+         << min << ", " << max << "]")
+
+    const auto lk = busy();
+
+    _ranges.push_back({kind, key, min, max});
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+void FNIFI::within(expr_t minLat, expr_t maxLat, expr_t minLon,
+                   expr_t maxLon)
+{
+    DLOG("FNIFI", this, "Keeping the files in latitudes [" << minLat << ", "
+         << maxLat << "] and longitudes [" << minLon << ", " << maxLon << "]")
+
+    const auto lk = busy();
+
+    _box = {minLat, maxLat, minLon, maxLon};
+    _boxing = true;
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+std::shared_ptr<utils::Task> FNIFI::indexAsync() {
+    return run([this]() { index(); });
+}
+
+std::shared_ptr<utils::Task> FNIFI::sortAsync(const std::string& expr) {
+    return run([this, expr]() { sort(expr); });
+}
+
+std::shared_ptr<utils::Task> FNIFI::filterAsync(const std::string& expr) {
+    return run([this, expr]() { filter(expr); });
+}
+
+void FNIFI::collectGarbage(size_t maxSize, time_t maxAge) {
+    DLOG("FNIFI", this, "Garbage collection")
+
+    for (const auto& coll : _colls) {
+        collectColl(utils::Hash(coll->getName()), maxSize, maxAge);
+        if (utils::Task::IsCancelled()) {
+            ILOG("FNIFI", this, "Garbage collection cancelled")
+            break;
+        }
+    }
+}
+
+std::shared_ptr<utils::Task> FNIFI::collectGarbageAsync(size_t maxSize,
+                                                        time_t maxAge)
+{
+    if (_gcTask) {
+        /* the running collection is superseded */
+        _gcTask->cancel();
+        try {
+            _gcTask->wait();
+        } catch (...) {
+            /* its result is no longer relevant */
+        }
+    }
+
+    /* the collections may be added meanwhile */
+    std::vector<std::filesystem::path> collHashes;
+    for (const auto& coll : _colls) {
+        collHashes.push_back(utils::Hash(coll->getName()));
+    }
+
+    _gcTask = std::make_shared<utils::Task>(
+        [this, collHashes, maxSize, maxAge]() {
+            for (const auto& collHash : collHashes) {
+                collectColl(collHash, maxSize, maxAge);
+                if (utils::Task::IsCancelled()) {
+                    break;
+                }
+            }
+        });
+    return _gcTask;
+}
+
+void FNIFI::setWarmUp(const std::vector<expression::Kind>& kinds,
+                      bool expressions)
+{
+    DLOG("FNIFI", this, "Warming up " << kinds.size() << " kinds"
+         << (expressions ? " and the expressions" : ""))
+
+    const auto lk = busy();
+
+    if (_warmTask) {
+        _warmTask->cancel();
+        try {
+            _warmTask->wait();
+        } catch (...) {
+            /* its result is no longer relevant */
+        }
+        _warmTask = nullptr;
+    }
+    _warming = false;
+
+    _warmKinds = kinds;
+    _warmExprs = expressions;
+    if (_warmKinds.empty() && !_warmExprs) {
+        _warmQueue.clear();
+    } else {
+        startWarmUp();
     }
 }
 
 void FNIFI::clearSort() {
     DLOG("FNIFI", this, "Clearing sorting algorithm")
 
+    const auto lk = busy();
+
     _sortExpr = nullptr;
 }
 
 void FNIFI::clearFilter() {
     DLOG("FNIFI", this, "Filtering sorting algorithm")
 
+    const auto lk = busy();
+
     _filtExpr = nullptr;
+    _lazyFilter = false;
+    _lazyResults.clear();
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+void FNIFI::clearSearch() {
+    DLOG("FNIFI", this, "Clearing path search")
+
+    const auto lk = busy();
+
+    _searching = false;
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+void FNIFI::clearRanges() {
+    DLOG("FNIFI", this, "Clearing ranges")
+
+    const auto lk = busy();
+
+    _ranges.clear();
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+void FNIFI::clearWithin() {
+    DLOG("FNIFI", this, "Clearing box")
+
+    const auto lk = busy();
+
+    _boxing = false;
+    for (const auto& coll : _colls) {
+        filterColl(*coll);
+    }
+
+    resetView();
+}
+
+FNIFI::facets_t FNIFI::aggregate(const std::string& groupBy,
+                                 expr_t bucketSz, const std::string& value)
+{
+    DLOG("FNIFI", this, "Aggregating by expression \"" << groupBy << "\" over"
+         " buckets of " << bucketSz)
+
+    const auto lk = busy();
+
+    if (bucketSz <= 0) {
+        std::ostringstream msg;
+        msg << "Invalid bucket size " << bucketSz;
+        ELOG("FNIFI", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+
+    const auto groupExpr = getExpression(groupBy);
+    std::shared_ptr<expression::Expression> valueExpr;
+    if (!value.empty()) {
+        valueExpr = getExpression(value);
+    }
+
+    facets_t res;
+    for (const auto& coll : _colls) {
+        /* disable synchronization during the process to avoid too many calls
+         */
+        const auto collId = coll->getId();
+        groupExpr->disableSync(collId);
+        if (valueExpr) {
+            valueExpr->disableSync(collId);
+        }
+
+        for (const auto& file : *coll) {
+            if (!isVisible(&file.second)) {
+                continue;
+            }
+
+            const auto group = groupExpr->get(&file.second);
+            const auto val = valueExpr ? valueExpr->get(&file.second) : group;
+
+            auto key = group;
+            if (group != EMPTY_EXPR_T) {
+                /* floor the value to the bucket, negative ones included */
+                key = group / bucketSz;
+                if (group % bucketSz != 0 && group < 0) {
+                    --key;
+                }
+                key *= bucketSz;
+            }
+
+            auto& facet = res.try_emplace(key, Facet{0, 0,
+                std::numeric_limits<expr_t>::max(),
+                std::numeric_limits<expr_t>::min(), 0}).first->second;
+            ++facet.count;
+            if (val == EMPTY_EXPR_T) {
+                ++facet.missing;
+                continue;
+            }
+            facet.min = std::min(facet.min, val);
+            facet.max = std::max(facet.max, val);
+            if (__builtin_add_overflow(facet.sum, val, &facet.sum)) {
+                facet.sum = val > 0 ? std::numeric_limits<expr_t>::max()
+                    : std::numeric_limits<expr_t>::min();
+            }
+        }
+
+        groupExpr->enableSync(collId);
+        if (valueExpr) {
+            valueExpr->enableSync(collId);
+        }
+    }
+
+    for (auto& facet : res) {
+        if (facet.second.missing == facet.second.count) {
+            facet.second.min = EMPTY_EXPR_T;
+            facet.second.max = EMPTY_EXPR_T;
+        }
+    }
+
+    return res;
+}
+
+const file::File* FNIFI::at(size_t i) {
+    if (!materialize(i)) {
+        std::ostringstream msg;
+        msg << "Position " << i << " out of the " << _view.size()
+            << " visible files";
+        ELOG("FNIFI", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    return _view[i];
+}
+
+size_t FNIFI::count() {
+    materialize(std::numeric_limits<size_t>::max());
+    return _view.size();
+}
+
+std::vector<const file::File*> FNIFI::slice(size_t first, size_t n) {
+    if (n == 0) {
+        return {};
+    }
+    materialize(first + n - 1);
+    if (first >= _view.size()) {
+        return {};
+    }
+    const auto last = std::min(first + n, _view.size());
+    return std::vector<const file::File*>(
+        _view.begin() + static_cast<std::ptrdiff_t>(first),
+        _view.begin() + static_cast<std::ptrdiff_t>(last));
 }
 
 FNIFI::Iterator FNIFI::begin() {
-    return Iterator(_files.begin(), _toRemove, _files);
+    return Iterator(0, *this);
 }
 
 FNIFI::Iterator FNIFI::end() {
-    return Iterator(_files.end(), _toRemove, _files);
+    return Iterator(std::numeric_limits<size_t>::max(), *this);
 }
 
 FNIFI::fileset_t FNIFI::getFiles() const {
-    return _files;  /* TODO: need to cope with the _toRemove files */
+    return _files;
 }
 
 void FNIFI::indexColl(file::Collection& coll) {
     std::unordered_set<std::pair<const file::File*, fileId_t>> removed;
-    std::unordered_set<const file::File*> added;
-    std::unordered_set<file::File*> modified;
+    std::unordered_set<file::File*> added;
+    std::unordered_map<file::File*, file::changes_t> modified;
 
     coll.index(removed, added, modified);
 
@@ -171,79 +523,485 @@ void FNIFI::indexColl(file::Collection& coll) {
          << removed.size() << " removed files, " << added.size()
          << " added and " << modified.size() << " modified")
 
+    /* the view is patched only if it is complete, the positions of the
+     * changes being unknown otherwise */
+    const auto patchView = _viewEnd == _files.end();
+
     /* update expressions */
     const auto collHash = utils::Hash(coll.getName());
+    std::unordered_map<fileId_t, file::changes_t> changes;
+    std::unordered_set<const file::File*> removedFiles;
     for (const auto& file : removed) {
-        expression::Expression::Uncache(_storing, collHash, file.second);
-        file::Info<expr_t>::Uncache(file.second);
-        _toRemove.insert(file.first);
+        changes.insert({file.second, file::ANY_CHANGE});
+        _lazyResults.erase(file.first);
+        removedFiles.insert(file.first);
     }
-    for (const auto& file : added) {
+    for (const auto& file : modified) {
+        changes.insert({file.first->getId(), file.second});
+    }
+
+    /* uncache only the results depending on what changed */
+    {
+        std::lock_guard<std::mutex> lk(_cacheMtx);
+        std::vector<expression::DiskBacked*> live;
+        for (const auto& expr : _exprs) {
+            live.push_back(expr.second.get());
+        }
+        expression::Expression::Uncache(_storing, collHash, changes, live);
+    }
+    file::Info<expr_t>::Uncache(&coll, changes);
+
+    if (!removedFiles.empty()) {
+        /* the removed files no longer exist: only their addresses are used */
+        const auto isRemoved = [&removedFiles](const file::File* file) {
+            return removedFiles.contains(file);
+        };
+        std::erase_if(_files, isRemoved);
+        std::erase_if(_view, isRemoved);
+    }
+
+    /* update the secondary indexes, before matching the ranges */
+    std::vector<fileId_t> removedIds;
+    removedIds.reserve(removed.size());
+    for (const auto& file : removed) {
+        removedIds.push_back(file.second);
+    }
+    std::vector<const file::File*> updated(added.begin(), added.end());
+    for (const auto& file : modified) {
+        updated.push_back(file.first);
+    }
+    file::AInfoIndex::UpdateAll(&coll, removedIds, updated);
+    file::GeoIndex::Update(&coll, removedIds, updated);
+
+    const auto matches = matchColl(coll);
+    for (auto& file : added) {
         /* process the file before inserting it */
         if (_sortExpr) {
-            _sortExpr->get(file);
-        }
-        if (_filtExpr) {
-            _filtExpr->get(file);
+            file->setSortingScore(_sortExpr->get(file));
         }
+        file->setIsFilteredOut(isFilteredOut(file, matches));
         _files.insert(file);
+        if (patchView) {
+            insertInView(file);
+        }
     }
-    for (auto& file : modified) {
-        /* uncache for every expressions */
-        const auto id = file->getId();
-        expression::Expression::Uncache(_storing, collHash, id);
-        file::Info<expr_t>::Uncache(id);
+    for (const auto& change : modified) {
+        auto file = change.first;
+        _lazyResults.erase(file);
+
+        /* remove the file while its score is still the one it is sorted
+         * with */
+        eraseFromFiles(file);
+        if (patchView) {
+            eraseFromView(file);
+        }
 
         /* overwrite the cache of the current expressions */
-        bool hasChanged = false;
         if (_sortExpr) {
-            const auto prevScore = file->getSortingScore();
-            const auto score = _sortExpr->get(file);
-            file->setSortingScore(score);
-            hasChanged = hasChanged || (score != prevScore);
-        }
-        if (_filtExpr) {
-            const auto prevCheck = file->isFilteredOut();
-            const auto check = _filtExpr->get(file);
-            file->setIsFilteredOut(check);
-            hasChanged = hasChanged || (check != prevCheck);
-        }
-
-        /* update _files */
-        if (hasChanged) {
-            auto pos = _files.find(file);
-            if (pos != _files.end()) {
-                _files.erase(pos);
+            file->setSortingScore(_sortExpr->get(file));
+        }
+        if (_filtExpr || isRestricted()) {
+            file->setIsFilteredOut(isFilteredOut(file, matches));
+        }
+
+        _files.insert(file);
+        if (patchView) {
+            insertInView(file);
+        }
+    }
+
+    /* the new content is to be precomputed */
+    if (!_warmKinds.empty() || _warmExprs) {
+        for (const auto& file : added) {
+            _warmQueue.emplace_back(&coll, file->getId());
+        }
+        for (const auto& file : modified) {
+            if (file.second & file::CONTENT_CHANGE) {
+                _warmQueue.emplace_back(&coll, file.first->getId());
             }
-            _files.insert(file);
         }
     }
+
+    /* invalidate the persisted orders and filters */
+    for (const auto& file : added) {
+        changes.insert({file->getId(), file::ANY_CHANGE});
+    }
+    {
+        std::lock_guard<std::mutex> lk(_cacheMtx);
+        expression::Persisted::Invalidate(_storing, collHash, changes);
+    }
+
+    if (!patchView) {
+        resetView();
+    }
 }
 
 void FNIFI::sortColl(file::Collection& coll) {
     /* WARNING: need to clear the files before calling it */
     /* disable synchronization during the process to avoid too many calls */
     const auto collName = coll.getName();
-    _sortExpr->disableSync(collName);
-
+    const auto collHash = utils::Hash(collName);
+    const auto& keyHash = _sortExpr->getKeyHash();
+    _sortExpr->disableSync(coll.getId());
+
+    /* insert the persisted order, already sorted */
+    expression::Persisted::order_t order;
+    bool hasChanged = !expression::Persisted::LoadOrder(_storing, collHash,
+                                                        keyHash, order);
+    std::unordered_set<fileId_t> sorted;
+    sorted.reserve(order.size());
+    const auto outdated = std::erase_if(order,
+        [&](const expression::Persisted::Entry& entry) {
+            const auto file = coll._files.find(entry.id);
+            if (file == coll._files.end() || !sorted.insert(entry.id).second) {
+                /* the file has been removed since or is a duplicate */
+                return true;
+            }
+            file->second.setSortingScore(entry.score);
+            _files.insert(_files.end(), &file->second);
+            return false;
+        });
+    hasChanged = hasChanged || outdated > 0;
+    utils::Task::AddFiles(order.size());
+
+    /* evaluate the files that are not in it */
+    expression::Persisted::order_t missing;
     for (auto& file : coll) {
+        if (utils::Task::IsCancelled()) {
+            /* what has been evaluated so far is still persisted */
+            break;
+        }
+        if (sorted.contains(file.first)) {
+            continue;
+        }
         const auto score = _sortExpr->get(&file.second);
         file.second.setSortingScore(score);
         _files.insert(&file.second);
+        missing.push_back({score, file.first});
+        utils::Task::AddFiles();
     }
 
-    _sortExpr->enableSync(collName);
+    _sortExpr->enableSync(coll.getId());
+
+    if (hasChanged || !missing.empty()) {
+        std::sort(missing.begin(), missing.end());
+        const auto mid = static_cast<expression::Persisted::order_t::
+            difference_type>(order.size());
+        order.insert(order.end(), missing.begin(), missing.end());
+        std::inplace_merge(order.begin(), order.begin() + mid, order.end());
+        expression::Persisted::SaveOrder(_storing, collHash, keyHash, order);
+    }
 }
 
 void FNIFI::filterColl(file::Collection& coll) {
-    /* disable synchronization during the process to avoid too many calls */
+    const auto matches = matchColl(coll);
     const auto collName = coll.getName();
-    _filtExpr->disableSync(collName);
+    const auto collHash = utils::Hash(collName);
+
+    if (!_filtExpr || _lazyFilter) {
+        /* the expression of a lazy filter is evaluated while iterating */
+        for (auto& file : coll) {
+            file.second.setIsFilteredOut(isFilteredOut(&file.second, matches));
+        }
+        return;
+    }
 
+    /* disable synchronization during the process to avoid too many calls */
+    const auto& keyHash = _filtExpr->getKeyHash();
+    _filtExpr->disableSync(coll.getId());
+
+    expression::Persisted::membership_t membership;
+    expression::Persisted::LoadMembership(_storing, collHash, keyHash,
+                                          membership);
+    bool hasChanged = false;
     for (auto& file : coll) {
-        const auto check = (_filtExpr->get(&file.second) == 0);
-        file.second.setIsFilteredOut(check);
+        if (utils::Task::IsCancelled()) {
+            /* what has been evaluated so far is still persisted */
+            break;
+        }
+        utils::Task::AddFiles();
+
+        if (isRestricted() && !matches.contains(file.first)) {
+            /* no need to evaluate the expression */
+            file.second.setIsFilteredOut(true);
+            continue;
+        }
+
+        if (file.first >= membership.size()) {
+            membership.resize(file.first + 1, expression::Persisted::UNKNOWN);
+        }
+        auto& state = membership[file.first];
+        if (state == expression::Persisted::UNKNOWN) {
+            state = _filtExpr->get(&file.second) == 0
+                ? expression::Persisted::FILTERED_OUT
+                : expression::Persisted::KEPT;
+            hasChanged = true;
+        }
+        file.second.setIsFilteredOut(state ==
+                                     expression::Persisted::FILTERED_OUT);
+    }
+
+    _filtExpr->enableSync(coll.getId());
+
+    if (hasChanged) {
+        expression::Persisted::SaveMembership(_storing, collHash, keyHash,
+                                              membership);
+    }
+}
+
+bool FNIFI::materialize(size_t n) {
+    const auto lk = busy();
+
+    while (_view.size() <= n && _viewEnd != _files.end()) {
+        if (isVisible(*_viewEnd)) {
+            _view.push_back(*_viewEnd);
+        }
+        ++_viewEnd;
+    }
+    return _view.size() > n;
+}
+
+void FNIFI::resetView() {
+    _view.clear();
+    _viewEnd = _files.begin();
+}
+
+void FNIFI::eraseFromFiles(const file::File* file) {
+    const auto range = _files.equal_range(file);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (*it == file) {
+            _files.erase(it);
+            return;
+        }
+    }
+}
+
+void FNIFI::eraseFromView(const file::File* file) {
+    const auto range = std::equal_range(_view.begin(), _view.end(), file,
+                                        file::File::pCompare());
+    const auto it = std::find(range.first, range.second, file);
+    if (it != range.second) {
+        _view.erase(it);
+    }
+}
+
+void FNIFI::insertInView(const file::File* file) {
+    if (isVisible(file)) {
+        /* same position as in the multiset, after the equal scores */
+        _view.insert(std::upper_bound(_view.begin(), _view.end(), file,
+                                      file::File::pCompare()), file);
+    }
+}
+
+std::shared_ptr<expression::Expression> FNIFI::getExpression(
+    const std::string& expr)
+{
+    std::lock_guard<std::mutex> lk(_cacheMtx);
+
+    /* semantically equal expressions share the same instance */
+    const auto key = expression::Expression::Canonicalize(expr);
+    const auto it = std::find_if(_exprs.begin(), _exprs.end(),
+        [&key](const auto& entry) { return entry.first == key; });
+    if (it != _exprs.end()) {
+        /* the expression is already built: mark it as the most recent */
+        DLOG("FNIFI", this, "Reusing expression \"" << expr << "\"")
+        _exprs.splice(_exprs.begin(), _exprs, it);
+        return it->second;
+    }
+
+    _exprs.emplace_front(key, std::make_shared<expression::Expression>(
+        expr, _storing, _colls));
+    auto size = _exprs.size();
+    for (auto old = std::prev(_exprs.end()); size > _maxExprs &&
+         old != _exprs.begin();)
+    {
+        if (old->second.use_count() > 1) {
+            /* still used by the sort or the filter: kept so that the garbage
+             * collection knows about it */
+            --old;
+            continue;
+        }
+        DLOG("FNIFI", this, "Evicting expression \"" << old->first << "\"")
+        old = std::prev(_exprs.erase(old));
+        --size;
+    }
+    return _exprs.front().second;
+}
+
+std::unique_lock<std::recursive_mutex> FNIFI::busy() {
+    /* delays the warm-up */
+    _lastActivity = std::chrono::steady_clock::now().time_since_epoch()
+        .count();
+    return std::unique_lock<std::recursive_mutex>(_workMtx);
+}
+
+void FNIFI::startWarmUp() {
+    /* WARNING: _workMtx has to be held */
+    if (_warming || _warmQueue.empty()) {
+        return;
+    }
+
+    if (_warmTask) {
+        /* done or about to be */
+        _warmTask->wait();
+    }
+
+    ILOG("FNIFI", this, "Warming up " << _warmQueue.size() << " files")
+
+    _warming = true;
+    _warmTask = std::make_shared<utils::Task>([this]() { warmUp(); });
+}
+
+void FNIFI::warmUp() {
+    utils::Task::LowerPriority();
+
+    const auto idle = std::chrono::milliseconds(WARMUP_IDLE_DELAY_MS);
+    while (!utils::Task::IsCancelled()) {
+        /* only while no call is made */
+        const auto elapsed = std::chrono::steady_clock::now()
+            .time_since_epoch() - std::chrono::steady_clock::duration(
+                _lastActivity.load());
+        if (elapsed < idle) {
+            std::this_thread::sleep_for(idle - elapsed);
+            continue;
+        }
+        std::unique_lock<std::recursive_mutex> lk(_workMtx, std::try_to_lock);
+        if (!lk.owns_lock()) {
+            std::this_thread::sleep_for(idle);
+            continue;
+        }
+
+        if (_warmQueue.empty()) {
+            _warming = false;
+            break;
+        }
+        const auto entry = _warmQueue.front();
+        _warmQueue.pop_front();
+
+        const auto file = entry.first->_files.find(entry.second);
+        if (file == entry.first->_files.end()) {
+            /* removed meanwhile */
+            continue;
+        }
+
+        expr_t value;
+        for (const auto& kind : _warmKinds) {
+            file->second.get(value, kind);
+        }
+        if (_warmExprs) {
+            for (const auto& expr : _exprs) {
+                expr.second->get(&file->second);
+            }
+        }
+        utils::Task::AddFiles();
+    }
+
+    DLOG("FNIFI", this, "Warm-up stopped with " << _warmQueue.size()
+         << " files left")
+}
+
+void FNIFI::collectColl(const std::filesystem::path& collHash,
+                        size_t maxSize, time_t maxAge)
+{
+    const auto evict = [this, &collHash](const std::string& keyHash) {
+        std::lock_guard<std::mutex> lk(_cacheMtx);
+        const auto inUse = std::any_of(_exprs.begin(), _exprs.end(),
+            [&keyHash](const auto& entry) {
+                return entry.second->getKeyHash() == keyHash;
+            });
+        if (inUse) {
+            return false;
+        }
+        expression::Expression::Remove(_storing, collHash, keyHash);
+        expression::Persisted::Remove(_storing, collHash, keyHash);
+        return true;
+    };
+    expression::Expression::Collect(_storing, collHash, maxSize, maxAge,
+                                    evict);
+}
+
+std::shared_ptr<utils::Task> FNIFI::run(const std::function<void()>& job)
+{
+    if (_task) {
+        /* the running task is superseded */
+        _task->cancel();
+        try {
+            _task->wait();
+        } catch (...) {
+            /* its result is no longer relevant */
+        }
+    }
+
+    _task = std::make_shared<utils::Task>(job);
+    return _task;
+}
+
+std::unordered_set<fileId_t> FNIFI::matchColl(file::Collection& coll) const
+{
+    std::unordered_set<fileId_t> matches;
+    bool first = true;
+    const auto intersect = [&matches, &first](
+        const std::vector<fileId_t>& ids)
+    {
+        if (first) {
+            matches.insert(ids.begin(), ids.end());
+            first = false;
+            return;
+        }
+        const std::unordered_set<fileId_t> kept(ids.begin(), ids.end());
+        std::erase_if(matches, [&kept](fileId_t id) {
+            return !kept.contains(id);
+        });
+    };
+
+    if (_searching) {
+        intersect(coll.search(_search, _searchPrefix));
+    }
+    for (const auto& range : _ranges) {
+        const auto index = file::InfoIndex<expr_t>::Build(&coll, range.kind,
+                                                          range.key);
+        intersect(index->find(range.min, range.max));
+    }
+    if (_boxing) {
+        const auto index = file::GeoIndex::Build(&coll);
+        intersect(index->findInBox(_box.minLat, _box.maxLat, _box.minLon,
+                                   _box.maxLon));
+    }
+    return matches;
+}
+
+bool FNIFI::isRestricted() const {
+    return _searching || !_ranges.empty() || _boxing;
+}
+
+bool FNIFI::isFilteredOut(const file::File* file,
+                          const std::unordered_set<fileId_t>& matches)
+{
+    if (isRestricted() && !matches.contains(file->getId())) {
+        /* no need to evaluate the expression */
+        return true;
+    }
+    if (_filtExpr && !_lazyFilter) {
+        return _filtExpr->get(file) == 0;
+    }
+    return false;
+}
+
+bool FNIFI::isVisible(const file::File* file) {
+    if (file->isFilteredOut()) {
+        return false;
+    }
+    if (!_lazyFilter) {
+        return true;
+    }
+
+    const auto res = _lazyResults.find(file);
+    if (res != _lazyResults.end()) {
+        return res->second;
     }
 
-    _filtExpr->enableSync(collName);
+    /* the result is also cached by the expression */
+    const auto visible = _filtExpr->get(file) != 0;
+    _lazyResults.insert({file, visible});
+    return visible;
 }
@@ -73,6 +73,10 @@ std::string File::getCollectionName() const {
     return _helper->getName();
 }
 
+collId_t File::getCollectionId() const {
+    return _helper->getId();
+}
+
 void File::setHelper(AFileHelper* helper) {
     _helper = helper;
 }
@@ -0,0 +1,392 @@
+#include "fnifi/file/GeoIndex.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+#define MAX_LAT 324000000L  /* 90 degrees, in milliarcseconds */
+#define MAX_LON 648000000L  /* 180 degrees, in milliarcseconds */
+#define EARTH_RADIUS 6371000.0  /* in meters */
+#define MAS_TO_RAD (std::numbers::pi / 180.0 / 3600000.0)
+
+
+using namespace fnifi;
+using namespace fnifi::file;
+
+std::unordered_map<std::string, GeoIndex> GeoIndex::_built;
+
+void GeoIndex::Update(const Collection* coll,
+                      const std::vector<fileId_t>& removed,
+                      const std::vector<const File*>& updated)
+{
+    DLOG("GeoIndex", "(static)", "Updating index of Collection " << coll
+         << " with " << removed.size() << " removed and " << updated.size()
+         << " updated files")
+
+    const auto pos = _built.find(coll->getName());
+    if (pos != _built.end()) {
+        pos->second.update(removed, updated);
+    }
+}
+
+void GeoIndex::Free() {
+    DLOG("GeoIndex", "(static)", "Cleaning")
+
+    _built.clear();
+}
+
+GeoIndex* GeoIndex::Build(const Collection* coll, expr_t cellSz) {
+    const auto name = coll->getName();
+
+    const auto pos = _built.find(name);
+    if (pos != _built.end()) {
+        /* the object already exists */
+        return &pos->second;
+    }
+
+    auto index = _built.insert(std::make_pair(name, GeoIndex(coll, cellSz)));
+    return &index.first->second;
+}
+
+std::vector<fileId_t> GeoIndex::findInBox(expr_t minLat, expr_t maxLat,
+                                          expr_t minLon, expr_t maxLon) const
+{
+    DLOG("GeoIndex", this, "Looking for files in latitudes [" << minLat
+         << ", " << maxLat << "] and longitudes [" << minLon << ", " << maxLon
+         << "]")
+
+    std::vector<const Point*> points;
+    collect(minLat, maxLat, minLon, maxLon, points);
+
+    std::vector<fileId_t> res;
+    res.reserve(points.size());
+    for (const auto& point : points) {
+        res.push_back(point->id);
+    }
+    return res;
+}
+
+std::vector<fileId_t> GeoIndex::findInRadius(expr_t lat, expr_t lon,
+                                             double radius) const
+{
+    DLOG("GeoIndex", this, "Looking for files in a radius of " << radius
+         << "m around (" << lat << ", " << lon << ")")
+
+    const auto points = collectInRadius(lat, lon, radius);
+
+    std::vector<fileId_t> res;
+    res.reserve(points.size());
+    for (const auto& point : points) {
+        res.push_back(point->id);
+    }
+    return res;
+}
+
+std::vector<fileId_t> GeoIndex::findNearest(expr_t lat, expr_t lon, size_t k)
+    const
+{
+    DLOG("GeoIndex", this, "Looking for the " << k << " nearest files of ("
+         << lat << ", " << lon << ")")
+
+    if (k == 0 || _positions.empty()) {
+        return {};
+    }
+
+    /* gather at least k candidates, ring by ring around the position */
+    std::vector<const Point*> candidates;
+    const auto gatherAll = [&]() {
+        candidates.clear();
+        for (const auto& cell : _cells) {
+            for (const auto& point : cell.second) {
+                candidates.push_back(&point);
+            }
+        }
+    };
+    if (k >= _positions.size()) {
+        gatherAll();
+    } else {
+        const auto row = static_cast<int64_t>(getRow(lat));
+        const auto col = static_cast<int64_t>(getCol(lon));
+        size_t nVisited = 0;
+        for (int64_t d = 0; candidates.size() < k; ++d) {
+            if (2 * d + 1 >= static_cast<int64_t>(_nCols) ||
+                nVisited > _cells.size())
+            {
+                /* scanning the occupied cells is now cheaper */
+                gatherAll();
+                break;
+            }
+            for (auto r = row - d; r <= row + d; ++r) {
+                if (r < 0 || r >= static_cast<int64_t>(_nRows)) {
+                    continue;
+                }
+                const auto onEdge = (r == row - d || r == row + d);
+                const auto step = onEdge ? 1 : std::max<int64_t>(2 * d, 1);
+                for (auto c = col - d; c <= col + d; c += step) {
+                    /* longitudes wrap around the antimeridian */
+                    const auto wrapped = (c + static_cast<int64_t>(_nCols)) %
+                        static_cast<int64_t>(_nCols);
+                    const auto key = (static_cast<cellKey_t>(r) << 32) |
+                        static_cast<cellKey_t>(wrapped);
+                    const auto cell = _cells.find(key);
+                    if (cell != _cells.end()) {
+                        for (const auto& point : cell->second) {
+                            candidates.push_back(&point);
+                        }
+                    }
+                    ++nVisited;
+                }
+            }
+        }
+    }
+
+    /* the k-th candidate bounds the distance of the k nearest points */
+    using scored_t = std::pair<double, const Point*>;
+    std::vector<scored_t> scored;
+    scored.reserve(candidates.size());
+    for (const auto& point : candidates) {
+        scored.push_back({Distance(lat, lon, point->lat, point->lon), point});
+    }
+    const auto byDistance = [](const scored_t& a, const scored_t& b) {
+        return a.first < b.first;
+    };
+    const auto n = std::min(k, scored.size());
+    const auto nth = scored.begin() +
+        static_cast<std::vector<scored_t>::difference_type>(n - 1);
+    std::nth_element(scored.begin(), nth, scored.end(), byDistance);
+
+    if (candidates.size() < _positions.size()) {
+        /* closer points may lie in cells outside of the visited rings */
+        const auto radius = nth->first;
+        scored.clear();
+        for (const auto& point : collectInRadius(lat, lon, radius)) {
+            scored.push_back({Distance(lat, lon, point->lat, point->lon),
+                              point});
+        }
+    }
+
+    const auto last = scored.begin() +
+        static_cast<std::vector<scored_t>::difference_type>(
+            std::min(n, scored.size()));
+    std::partial_sort(scored.begin(), last, scored.end(), byDistance);
+
+    std::vector<fileId_t> res;
+    res.reserve(n);
+    for (auto it = scored.begin(); it != last; ++it) {
+        res.push_back(it->second->id);
+    }
+    return res;
+}
+
+size_t GeoIndex::size() const {
+    return _positions.size();
+}
+
+double GeoIndex::Distance(expr_t lat1, expr_t lon1, expr_t lat2,
+                          expr_t lon2)
+{
+    /* haversine formula */
+    const auto phi1 = static_cast<double>(lat1) * MAS_TO_RAD;
+    const auto phi2 = static_cast<double>(lat2) * MAS_TO_RAD;
+    const auto dPhi = phi2 - phi1;
+    const auto dLambda = static_cast<double>(lon2 - lon1) * MAS_TO_RAD;
+    const auto a = std::sin(dPhi / 2.0) * std::sin(dPhi / 2.0) +
+        std::cos(phi1) * std::cos(phi2) * std::sin(dLambda / 2.0) *
+        std::sin(dLambda / 2.0);
+    return 2.0 * EARTH_RADIUS * std::asin(std::min(1.0, std::sqrt(a)));
+}
+
+uint32_t GeoIndex::GetCells(expr_t extent, expr_t cellSz) {
+    if (cellSz <= 0) {
+        std::ostringstream msg;
+        msg << "Invalid cell size " << cellSz;
+        ELOG("GeoIndex", "(static)", msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    return static_cast<uint32_t>(2 * extent / cellSz + 1);
+}
+
+GeoIndex::GeoIndex(const Collection* coll, expr_t cellSz)
+: _coll(coll),
+    _lat(Info<expr_t>::Build(coll, expression::Kind::LATITUDE)),
+    _lon(Info<expr_t>::Build(coll, expression::Kind::LONGITUDE)),
+    _cellSz(cellSz), _nRows(GetCells(MAX_LAT, cellSz)),
+    _nCols(GetCells(MAX_LON, cellSz))
+{
+    DLOG("GeoIndex", this, "Instanciation for coll " << coll << " with cells "
+         "of " << cellSz << " milliarcseconds")
+
+    _lat->disableSync();
+    _lon->disableSync();
+    for (const auto& file : *_coll) {
+        insert(&file.second);
+    }
+    _lat->enableSync();
+    _lon->enableSync();
+
+    DLOG("GeoIndex", this, "Indexed " << _positions.size() << " files over "
+         << _cells.size() << " cells")
+}
+
+void GeoIndex::update(const std::vector<fileId_t>& removed,
+                      const std::vector<const File*>& updated)
+{
+    for (const auto& id : removed) {
+        remove(id);
+    }
+
+    _lat->disableSync();
+    _lon->disableSync();
+    for (const auto& file : updated) {
+        remove(file->getId());
+        insert(file);
+    }
+    _lat->enableSync();
+    _lon->enableSync();
+}
+
+void GeoIndex::insert(const File* file) {
+    expr_t lat, lon;
+    if (!_lat->get(file, lat) || !_lon->get(file, lon)) {
+        /* the file is not geotagged */
+        return;
+    }
+
+    const auto key = getKey(lat, lon);
+    _cells[key].push_back({lat, lon, file->getId()});
+    _positions[file->getId()] = key;
+}
+
+void GeoIndex::remove(fileId_t id) {
+    const auto pos = _positions.find(id);
+    if (pos == _positions.end()) {
+        return;
+    }
+
+    const auto cell = _cells.find(pos->second);
+    if (cell != _cells.end()) {
+        auto& points = cell->second;
+        const auto point = std::find_if(points.begin(), points.end(),
+            [id](const Point& p) { return p.id == id; });
+        if (point != points.end()) {
+            /* order within a cell does not matter */
+            *point = points.back();
+            points.pop_back();
+        }
+        if (points.empty()) {
+            _cells.erase(cell);
+        }
+    }
+    _positions.erase(pos);
+}
+
+void GeoIndex::collect(expr_t minLat, expr_t maxLat, expr_t minLon,
+                       expr_t maxLon, std::vector<const Point*>& res) const
+{
+    if (minLon > maxLon) {
+        /* the box crosses the antimeridian */
+        collect(minLat, maxLat, minLon, MAX_LON, res);
+        collect(minLat, maxLat, -MAX_LON, maxLon, res);
+        return;
+    }
+    if (minLat > maxLat) {
+        return;
+    }
+
+    const auto r0 = getRow(minLat);
+    const auto r1 = getRow(maxLat);
+    const auto c0 = getCol(minLon);
+    const auto c1 = getCol(maxLon);
+
+    const auto visit = [&](uint32_t row, uint32_t col,
+                           const std::vector<Point>& points)
+    {
+        /* the points of inner cells are in the box for sure */
+        const auto inner = row > r0 && row < r1 && col > c0 && col < c1;
+        for (const auto& point : points) {
+            if (inner || (point.lat >= minLat && point.lat <= maxLat &&
+                          point.lon >= minLon && point.lon <= maxLon))
+            {
+                res.push_back(&point);
+            }
+        }
+    };
+
+    const auto nCells = (static_cast<size_t>(r1 - r0) + 1) *
+        (static_cast<size_t>(c1 - c0) + 1);
+    if (nCells > _cells.size()) {
+        /* fewer occupied cells than cells in the box */
+        for (const auto& cell : _cells) {
+            const auto row = static_cast<uint32_t>(cell.first >> 32);
+            const auto col = static_cast<uint32_t>(cell.first & 0xFFFFFFFF);
+            if (row >= r0 && row <= r1 && col >= c0 && col <= c1) {
+                visit(row, col, cell.second);
+            }
+        }
+    } else {
+        for (auto row = r0; row <= r1; ++row) {
+            for (auto col = c0; col <= c1; ++col) {
+                const auto cell = _cells.find(
+                    (static_cast<cellKey_t>(row) << 32) | col);
+                if (cell != _cells.end()) {
+                    visit(row, col, cell->second);
+                }
+            }
+        }
+    }
+}
+
+std::vector<const GeoIndex::Point*> GeoIndex::collectInRadius(
+    expr_t lat, expr_t lon, double radius) const
+{
+    /* bounding box of the spherical cap */
+    const auto angle = radius / EARTH_RADIUS;
+    const auto dLat = static_cast<expr_t>(angle / MAS_TO_RAD) + 1;
+    const auto minLat = lat - dLat;
+    const auto maxLat = lat + dLat;
+    auto minLon = -MAX_LON;
+    auto maxLon = MAX_LON;
+    const auto cosLat = std::cos(static_cast<double>(lat) * MAS_TO_RAD);
+    if (minLat > -MAX_LAT && maxLat < MAX_LAT && std::sin(angle) < cosLat &&
+        angle < std::numbers::pi / 2.0)
+    {
+        /* the cap does not contain a pole */
+        const auto dLon = static_cast<expr_t>(
+            std::asin(std::sin(angle) / cosLat) / MAS_TO_RAD) + 1;
+        if (dLon < MAX_LON) {
+            minLon = lon - dLon;
+            maxLon = lon + dLon;
+            if (minLon < -MAX_LON) {
+                minLon += 2 * MAX_LON;
+            }
+            if (maxLon > MAX_LON) {
+                maxLon -= 2 * MAX_LON;
+            }
+        }
+    }
+
+    std::vector<const Point*> candidates;
+    collect(minLat, maxLat, minLon, maxLon, candidates);
+
+    std::vector<const Point*> res;
+    res.reserve(candidates.size());
+    for (const auto& point : candidates) {
+        if (Distance(lat, lon, point->lat, point->lon) <= radius) {
+            res.push_back(point);
+        }
+    }
+    return res;
+}
+
+GeoIndex::cellKey_t GeoIndex::getKey(expr_t lat, expr_t lon) const {
+    return (static_cast<cellKey_t>(getRow(lat)) << 32) | getCol(lon);
+}
+
+uint32_t GeoIndex::getRow(expr_t lat) const {
+    const auto clamped = std::clamp(lat, -MAX_LAT, MAX_LAT);
+    return static_cast<uint32_t>((clamped + MAX_LAT) / _cellSz);
+}
+
+uint32_t GeoIndex::getCol(expr_t lon) const {
+    const auto clamped = std::clamp(lon, -MAX_LON, MAX_LON);
+    return static_cast<uint32_t>((clamped + MAX_LON) / _cellSz);
+}
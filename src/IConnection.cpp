@@ -4,3 +4,43 @@
 using namespace fnifi::connection;
 
 IConnection::~IConnection() {}
+
+bool IConnection::writeRanges(const std::filesystem::path& filepath,
+                              const fileBuf_t& buffer,
+                              const std::vector<Range>& ranges)
+{
+    UNUSED(filepath)
+    UNUSED(buffer)
+    UNUSED(ranges)
+    return false;
+}
+
+bool IConnection::readFrom(const std::filesystem::path& filepath,
+                           size_t offset, fileBuf_t& buffer)
+{
+    UNUSED(filepath)
+    UNUSED(offset)
+    UNUSED(buffer)
+    return false;
+}
+
+bool IConnection::append(const std::filesystem::path& filepath,
+                         const fileBuf_t& buffer)
+{
+    UNUSED(filepath)
+    UNUSED(buffer)
+    return false;
+}
+
+bool IConnection::writeIf(const std::filesystem::path& filepath,
+                          const fileBuf_t& buffer,
+                          const std::vector<Range>& ranges,
+                          struct timespec& mtime, bool& written)
+{
+    UNUSED(filepath)
+    UNUSED(buffer)
+    UNUSED(ranges)
+    UNUSED(mtime)
+    written = false;
+    return false;
+}
@@ -0,0 +1,37 @@
+#include "fnifi/file/InfoIndex.hpp"
+#include <algorithm>
+
+
+using namespace fnifi;
+using namespace fnifi::file;
+
+std::vector<std::pair<AInfoIndex::update_t, AInfoIndex::free_t>>
+AInfoIndex::_specializations;
+
+void AInfoIndex::UpdateAll(const Collection* coll,
+                           const std::vector<fileId_t>& removed,
+                           const std::vector<const File*>& updated)
+{
+    for (const auto& specialization : _specializations) {
+        specialization.first(coll, removed, updated);
+    }
+}
+
+void AInfoIndex::FreeAll() {
+    DLOG("AInfoIndex", "(static)", "Cleaning " << _specializations.size()
+         << " specializations")
+
+    for (const auto& specialization : _specializations) {
+        specialization.second();
+    }
+    _specializations.clear();
+}
+
+void AInfoIndex::Register(update_t update, free_t free) {
+    const auto specialization = std::make_pair(update, free);
+    if (std::find(_specializations.begin(), _specializations.end(),
+                  specialization) == _specializations.end())
+    {
+        _specializations.push_back(specialization);
+    }
+}
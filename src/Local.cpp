@@ -1,5 +1,9 @@
 #include "fnifi/connection/Local.hpp"
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <fstream>
+#include <algorithm>
 #include <sstream>
 #include <filesystem>
 
@@ -77,6 +81,153 @@ void Local::write(const std::filesystem::path& filepath,
                static_cast<std::streamsize>(buffer.size()));
 }
 
+bool Local::writeRanges(const std::filesystem::path& filepath,
+                        const fileBuf_t& buffer,
+                        const std::vector<Range>& ranges)
+{
+    DLOG("Local", this, "Write " << ranges.size() << " ranges to file "
+         << filepath)
+
+    /* without truncating the existing file */
+    std::fstream file(filepath, std::ios::in | std::ios::out |
+                      std::ios::binary);
+    if (!file.is_open()) {
+        WLOG("Local", this, "Failed to open " << filepath)
+        return false;
+    }
+    for (const auto& range : ranges) {
+        file.seekp(std::streamoff(range.offset));
+        file.write(reinterpret_cast<const char*>(&buffer[range.offset]),
+                   static_cast<std::streamsize>(range.size));
+    }
+    file.flush();
+    return file.good();
+}
+
+bool Local::readFrom(const std::filesystem::path& filepath, size_t offset,
+                     fileBuf_t& buffer)
+{
+    DLOG("Local", this, "Read file " << filepath << " from " << offset)
+
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        WLOG("Local", this, "Failed to open " << filepath)
+        return false;
+    }
+    const auto len = static_cast<size_t>(std::max(file.tellg(),
+                                                  std::streampos(0)));
+    buffer.resize(len > offset ? len - offset : 0);
+    file.seekg(std::streamoff(std::min(offset, len)));
+    file.read(reinterpret_cast<char*>(buffer.data()),
+              static_cast<std::streamsize>(buffer.size()));
+    return bool(file);
+}
+
+bool Local::append(const std::filesystem::path& filepath,
+                   const fileBuf_t& buffer)
+{
+    DLOG("Local", this, "Append " << buffer.size() << " bytes to file "
+         << filepath)
+
+    const auto fd = ::open(filepath.c_str(), O_WRONLY | O_APPEND | O_CREAT,
+                           0644);
+    if (fd < 0) {
+        WLOG("Local", this, "Failed to open " << filepath)
+        return false;
+    }
+
+    /* serialized with the conditional writes, which may truncate the file */
+    if (flock(fd, LOCK_EX) != 0) {
+        WLOG("Local", this, "Failed to lock " << filepath)
+        ::close(fd);
+        return false;
+    }
+
+    size_t offset = 0;
+    while (offset < buffer.size()) {
+        const auto len = ::write(fd, &buffer[offset], buffer.size() - offset);
+        if (len <= 0) {
+            break;
+        }
+        offset += static_cast<size_t>(len);
+    }
+
+    flock(fd, LOCK_UN);
+    ::close(fd);
+    if (offset < buffer.size()) {
+        WLOG("Local", this, "Failed to append to " << filepath)
+        return false;
+    }
+    return true;
+}
+
+bool Local::writeIf(const std::filesystem::path& filepath,
+                    const fileBuf_t& buffer, const std::vector<Range>& ranges,
+                    struct timespec& mtime, bool& written)
+{
+    DLOG("Local", this, "Write to file " << filepath << " if unchanged")
+
+    written = false;
+    const auto fd = ::open(filepath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        WLOG("Local", this, "Failed to open " << filepath)
+        return false;
+    }
+
+    /* the lock is only held by the other conditional writes and the
+     * appends */
+    if (flock(fd, LOCK_EX) != 0) {
+        WLOG("Local", this, "Failed to lock " << filepath)
+        ::close(fd);
+        return false;
+    }
+
+    const auto writeAt = [fd, &buffer](size_t offset, size_t size) {
+        while (size > 0) {
+            const auto len = pwrite(fd, &buffer[offset], size,
+                                    static_cast<off_t>(offset));
+            if (len <= 0) {
+                return false;
+            }
+            offset += static_cast<size_t>(len);
+            size -= static_cast<size_t>(len);
+        }
+        return true;
+    };
+
+    struct stat stats;
+    auto res = fstat(fd, &stats) == 0;
+    if (res) {
+        if (mtime.tv_sec == 0 && mtime.tv_nsec == 0) {
+            written = stats.st_size == 0;
+        } else {
+            written = stats.st_size > 0 &&
+                stats.st_mtimespec.tv_sec == mtime.tv_sec &&
+                stats.st_mtimespec.tv_nsec == mtime.tv_nsec;
+        }
+    }
+    if (res && written) {
+        if (ranges.empty()) {
+            res = ftruncate(fd, static_cast<off_t>(buffer.size())) == 0 &&
+                writeAt(0, buffer.size());
+        }
+        for (const auto& range : ranges) {
+            res = res && writeAt(range.offset, range.size);
+        }
+        res = res && fstat(fd, &stats) == 0;
+        if (res) {
+            mtime = stats.st_mtimespec;
+        }
+    }
+
+    flock(fd, LOCK_UN);
+    ::close(fd);
+    if (!res) {
+        WLOG("Local", this, "Failed to write to " << filepath)
+    }
+    return res;
+}
+
 bool Local::download(const std::filesystem::path& from,
                      const std::filesystem::path& to)
 {
@@ -86,9 +237,20 @@ bool Local::download(const std::filesystem::path& from,
         return false;
     }
 
-    std::filesystem::copy(from, to,
-                          std::filesystem::copy_options::overwrite_existing |
-                          std::filesystem::copy_options::recursive);
+    if (std::filesystem::is_directory(from)) {
+        std::filesystem::copy(from, to,
+                              std::filesystem::copy_options::overwrite_existing
+                              | std::filesystem::copy_options::recursive);
+        return true;
+    }
+
+    /* renamed over the destination, which may be mapped and must never be
+     * truncated */
+    auto tmp = to;
+    tmp += ".download";
+    std::filesystem::copy_file(
+        from, tmp, std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::rename(tmp, to);
 
     return true;
 }
@@ -0,0 +1,234 @@
+#include "fnifi/file/PathIndex.hpp"
+#include <algorithm>
+#include <cctype>
+
+/* paths are indexed with a leading marker so that prefixes get trigrams */
+#define START_MARKER std::string(2, '\0')
+
+
+using namespace fnifi;
+using namespace fnifi::file;
+
+PathIndex::PathIndex() {
+    DLOG("PathIndex", this, "Instanciation")
+}
+
+void PathIndex::insert(fileId_t id, const std::string& path) {
+    if (_paths.contains(id)) {
+        remove(id);
+    }
+
+    const auto normalized = Normalize(path);
+    for (const auto& trigram : GetTrigrams(START_MARKER + normalized)) {
+        auto& posting = _postings[trigram];
+        const auto pos = std::lower_bound(posting.begin(), posting.end(), id);
+        if (pos == posting.end() || *pos != id) {
+            posting.insert(pos, id);
+        }
+    }
+    _paths.insert({id, normalized});
+}
+
+void PathIndex::remove(fileId_t id) {
+    const auto path = _paths.find(id);
+    if (path == _paths.end()) {
+        return;
+    }
+
+    for (const auto& trigram : GetTrigrams(START_MARKER + path->second)) {
+        const auto posting = _postings.find(trigram);
+        if (posting == _postings.end()) {
+            continue;
+        }
+        auto& ids = posting->second;
+        const auto pos = std::lower_bound(ids.begin(), ids.end(), id);
+        if (pos != ids.end() && *pos == id) {
+            ids.erase(pos);
+        }
+        if (ids.empty()) {
+            _postings.erase(posting);
+        }
+    }
+    _paths.erase(path);
+}
+
+void PathIndex::clear() {
+    _postings.clear();
+    _paths.clear();
+}
+
+std::vector<fileId_t> PathIndex::find(const std::string& pattern,
+                                      bool prefix) const
+{
+    DLOG("PathIndex", this, "Looking for paths " << (prefix ? "starting with"
+         : "containing") << " \"" << pattern << "\"")
+
+    const auto normalized = Normalize(pattern);
+    const auto query = prefix ? START_MARKER + normalized : normalized;
+
+    std::vector<fileId_t> res;
+    if (query.size() < 3) {
+        /* too short to get a trigram: scan the paths */
+        for (const auto& path : _paths) {
+            if (Match(path.second, normalized, prefix)) {
+                res.push_back(path.first);
+            }
+        }
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+
+    /* intersect the postings, starting with the shortest ones */
+    std::vector<const posting_t*> postings;
+    for (const auto& trigram : GetTrigrams(query)) {
+        const auto posting = _postings.find(trigram);
+        if (posting == _postings.end()) {
+            /* no path contains this trigram */
+            return {};
+        }
+        postings.push_back(&posting->second);
+    }
+    std::sort(postings.begin(), postings.end(),
+              [](const posting_t* a, const posting_t* b) {
+                  return a->size() < b->size();
+              });
+
+    std::vector<fileId_t> candidates = *postings.front();
+    for (auto it = postings.begin() + 1; it != postings.end() &&
+         !candidates.empty(); ++it)
+    {
+        std::vector<fileId_t> intersection;
+        std::set_intersection(candidates.begin(), candidates.end(),
+                              (*it)->begin(), (*it)->end(),
+                              std::back_inserter(intersection));
+        candidates = std::move(intersection);
+    }
+
+    /* trigrams may match in a different order: check the candidates */
+    res.reserve(candidates.size());
+    for (const auto& id : candidates) {
+        if (Match(_paths.at(id), normalized, prefix)) {
+            res.push_back(id);
+        }
+    }
+    return res;
+}
+
+bool PathIndex::matches(fileId_t id, const std::string& pattern,
+                        bool prefix) const
+{
+    const auto path = _paths.find(id);
+    if (path == _paths.end()) {
+        return false;
+    }
+    return Match(path->second, Normalize(pattern), prefix);
+}
+
+size_t PathIndex::size() const {
+    return _paths.size();
+}
+
+void PathIndex::save(std::ostream& os) const {
+    /* the postings too, so that loading does not split the paths again */
+    utils::Serialize(os, _paths.size());
+    for (const auto& [id, path] : _paths) {
+        utils::Serialize(os, id);
+        utils::Serialize(os, path.size());
+        os.write(path.data(), static_cast<std::streamsize>(path.size()));
+    }
+    utils::Serialize(os, _postings.size());
+    for (const auto& [trigram, ids] : _postings) {
+        utils::Serialize(os, trigram);
+        utils::Serialize(os, ids.size());
+        os.write(reinterpret_cast<const char*>(ids.data()),
+                 static_cast<std::streamsize>(ids.size() * sizeof(fileId_t)));
+    }
+}
+
+bool PathIndex::load(std::istream& is) {
+    clear();
+
+    size_t n;
+    if (!utils::Deserialize(is, n)) {
+        return false;
+    }
+    _paths.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        fileId_t id;
+        size_t len;
+        if (!utils::Deserialize(is, id) || !utils::Deserialize(is, len)) {
+            clear();
+            return false;
+        }
+        std::string path(len, '\0');
+        if (!is.read(path.data(), static_cast<std::streamsize>(len))) {
+            clear();
+            return false;
+        }
+        _paths.insert({id, std::move(path)});
+    }
+
+    if (!utils::Deserialize(is, n)) {
+        clear();
+        return false;
+    }
+    _postings.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        trigram_t trigram;
+        size_t len;
+        if (!utils::Deserialize(is, trigram) || !utils::Deserialize(is, len)) {
+            clear();
+            return false;
+        }
+        posting_t ids(len);
+        if (!is.read(reinterpret_cast<char*>(ids.data()),
+                     static_cast<std::streamsize>(len * sizeof(fileId_t))))
+        {
+            clear();
+            return false;
+        }
+        _postings.insert({trigram, std::move(ids)});
+    }
+
+    DLOG("PathIndex", this, "Loaded " << _paths.size() << " paths and "
+         << _postings.size() << " trigrams")
+
+    return true;
+}
+
+std::string PathIndex::Normalize(const std::string& str) {
+    auto res = str;
+    std::transform(res.begin(), res.end(), res.begin(), [](char c) {
+        return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    return res;
+}
+
+std::vector<PathIndex::trigram_t> PathIndex::GetTrigrams(
+    const std::string& str)
+{
+    std::vector<trigram_t> res;
+    if (str.size() < 3) {
+        return res;
+    }
+    res.reserve(str.size() - 2);
+    for (size_t i = 0; i + 2 < str.size(); ++i) {
+        res.push_back(
+            (static_cast<trigram_t>(static_cast<unsigned char>(str[i])) << 16)
+            | (static_cast<trigram_t>(static_cast<unsigned char>(str[i + 1]))
+               << 8)
+            | static_cast<trigram_t>(static_cast<unsigned char>(str[i + 2])));
+    }
+    std::sort(res.begin(), res.end());
+    res.erase(std::unique(res.begin(), res.end()), res.end());
+    return res;
+}
+
+bool PathIndex::Match(const std::string& path, const std::string& pattern,
+                      bool prefix)
+{
+    if (prefix) {
+        return path.starts_with(pattern);
+    }
+    return path.find(pattern) != std::string::npos;
+}
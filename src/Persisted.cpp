@@ -0,0 +1,318 @@
+#include "fnifi/expression/Persisted.hpp"
+#include "fnifi/expression/Expression.hpp"
+#include <algorithm>
+
+/* number of membership states stored in a byte */
+#define STATES_PER_BYTE 4
+/* number of invalidations redone over the concurrent pushes */
+#define INVALIDATION_MAX_TRY 3
+
+
+using namespace fnifi;
+using namespace fnifi::expression;
+
+std::unordered_map<std::string, file::changes_t> Persisted::_deps;
+std::mutex Persisted::_depsMtx;
+
+bool Persisted::Entry::operator<(const Entry& other) const {
+    if (score != other.score) {
+        return score < other.score;
+    }
+    return id < other.id;
+}
+
+bool Persisted::LoadOrder(const utils::SyncDirectory& storing,
+                          const std::filesystem::path& collPath,
+                          const std::string& keyHash, order_t& order)
+{
+    auto file = storing.open(collPath / ORDERS_DIRNAME / keyHash);
+    const auto res = ReadOrder(file, order);
+    file.close();
+
+    DLOG("Persisted", "(static)", (res ? "Loaded" : "No") << " order for "
+         "expression " << keyHash << " of Collection " << collPath)
+
+    return res;
+}
+
+void Persisted::SaveOrder(const utils::SyncDirectory& storing,
+                          const std::filesystem::path& collPath,
+                          const std::string& keyHash, const order_t& order)
+{
+    DLOG("Persisted", "(static)", "Saving order of " << order.size()
+         << " files for expression " << keyHash << " of Collection "
+         << collPath)
+
+    /* the entries are preceded by their number so that the file never needs
+     * to be truncated */
+    auto file = storing.open(collPath / ORDERS_DIRNAME / keyHash);
+    file.seekp(0);
+    utils::Serialize(file, order.size());
+    for (const auto& entry : order) {
+        utils::Serialize(file, entry.score);
+        utils::Serialize(file, entry.id);
+    }
+    if (!file.push()) {
+        /* the same order, evaluated by another client meanwhile */
+        DLOG("Persisted", "(static)", "Order for expression " << keyHash
+             << " of Collection " << collPath << " saved concurrently")
+    }
+    file.close();
+}
+
+bool Persisted::LoadMembership(const utils::SyncDirectory& storing,
+                               const std::filesystem::path& collPath,
+                               const std::string& keyHash,
+                               membership_t& membership)
+{
+    auto file = storing.open(collPath / FILTERS_DIRNAME / keyHash);
+    file.seekg(0, std::ios::end);
+    const auto len = file.tellg();
+    if (len <= 0) {
+        /* empty file */
+        file.close();
+        return false;
+    }
+
+    fileBuf_t buf(static_cast<size_t>(len), 0);
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(&buf[0]), len);
+    file.close();
+
+    membership.resize(buf.size() * STATES_PER_BYTE);
+    for (size_t i = 0; i < membership.size(); ++i) {
+        membership[i] = static_cast<State>(
+            (buf[i / STATES_PER_BYTE] >> ((i % STATES_PER_BYTE) * 2)) & 0x3);
+    }
+
+    DLOG("Persisted", "(static)", "Loaded membership for expression "
+         << keyHash << " of Collection " << collPath)
+
+    return true;
+}
+
+void Persisted::SaveMembership(const utils::SyncDirectory& storing,
+                               const std::filesystem::path& collPath,
+                               const std::string& keyHash,
+                               const membership_t& membership)
+{
+    DLOG("Persisted", "(static)", "Saving membership of "
+         << membership.size() << " ids for expression " << keyHash
+         << " of Collection " << collPath)
+
+    fileBuf_t buf((membership.size() + STATES_PER_BYTE - 1) / STATES_PER_BYTE,
+                  0);
+    for (size_t i = 0; i < membership.size(); ++i) {
+        buf[i / STATES_PER_BYTE] |= static_cast<unsigned char>(
+            membership[i] << ((i % STATES_PER_BYTE) * 2));
+    }
+
+    auto file = storing.open(collPath / FILTERS_DIRNAME / keyHash);
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(buf.data()),
+               static_cast<std::streamsize>(buf.size()));
+    if (!file.push()) {
+        /* the same membership, evaluated by another client meanwhile */
+        DLOG("Persisted", "(static)", "Membership for expression " << keyHash
+             << " of Collection " << collPath << " saved concurrently")
+    }
+    file.close();
+}
+
+void Persisted::Invalidate(const utils::SyncDirectory& storing,
+                           const std::filesystem::path& collPath,
+                           const std::unordered_map<fileId_t,
+                           file::changes_t>& ids)
+{
+    if (ids.empty()) {
+        return;
+    }
+
+    DLOG("Persisted", "(static)", "Invalidating " << ids.size() << " ids for "
+         "Collection " << collPath)
+
+    /* the remote listing also covers the results never pulled locally */
+    for (const auto& entry : storing.list(collPath / ORDERS_DIRNAME)) {
+        const auto keyHash =
+            std::filesystem::path(entry.path).filename().string();
+        const auto affected = Affected(storing, collPath, keyHash, ids);
+        if (!affected.empty()) {
+            InvalidateOrder(storing, collPath / ORDERS_DIRNAME / keyHash,
+                            affected);
+        }
+    }
+
+    for (const auto& entry : storing.list(collPath / FILTERS_DIRNAME)) {
+        const auto keyHash =
+            std::filesystem::path(entry.path).filename().string();
+        const auto affected = Affected(storing, collPath, keyHash, ids);
+        if (!affected.empty()) {
+            InvalidateMembership(storing, collPath / FILTERS_DIRNAME
+                                 / keyHash, affected);
+        }
+    }
+}
+
+void Persisted::Remove(const utils::SyncDirectory& storing,
+                       const std::filesystem::path& collPath,
+                       const std::string& keyHash)
+{
+    DLOG("Persisted", "(static)", "Removing order and membership for "
+         "expression " << keyHash << " of Collection " << collPath)
+
+    {
+        std::lock_guard<std::mutex> lk(_depsMtx);
+        _deps.erase(storing.absolute(collPath / keyHash).string());
+    }
+
+    for (const auto& dirname : {ORDERS_DIRNAME, FILTERS_DIRNAME}) {
+        const auto path = collPath / dirname / keyHash;
+        if (storing.getStats(path).st_size > 0) {
+            storing.remove(path, true);
+        }
+    }
+}
+
+std::unordered_set<fileId_t> Persisted::Affected(
+    const utils::SyncDirectory& storing, const std::filesystem::path& collPath,
+    const std::string& keyHash,
+    const std::unordered_map<fileId_t, file::changes_t>& ids)
+{
+    /* the dependencies of an expression never change, so its meta file is
+     * only opened once */
+    const auto key = storing.absolute(collPath / keyHash).string();
+    file::changes_t deps;
+    {
+        std::lock_guard<std::mutex> lk(_depsMtx);
+        const auto pos = _deps.find(key);
+        if (pos != _deps.end()) {
+            deps = pos->second;
+        } else {
+            deps = Expression::LoadDependencies(storing, collPath, keyHash);
+            _deps.insert({key, deps});
+        }
+    }
+
+    std::unordered_set<fileId_t> affected;
+    for (const auto& id : ids) {
+        if (id.second & deps) {
+            affected.insert(id.first);
+        }
+    }
+    return affected;
+}
+
+void Persisted::InvalidateOrder(const utils::SyncDirectory& storing,
+                                const std::filesystem::path& path,
+                                const std::unordered_set<fileId_t>& ids)
+{
+    /* redone on the order pushed by another client meanwhile, which may
+     * hold the ids too */
+    for (unsigned int i = 0; i < INVALIDATION_MAX_TRY; ++i) {
+        auto file = storing.open(path);
+        order_t order;
+        auto pushed = true;
+        if (ReadOrder(file, order)) {
+            /* the dropped entries will be evaluated again on the next load */
+            const auto removed = std::erase_if(order,
+                [&ids](const Entry& entry) {
+                    return ids.contains(entry.id);
+                });
+            if (removed > 0) {
+                file.seekp(0);
+                utils::Serialize(file, order.size());
+                for (const auto& entry : order) {
+                    utils::Serialize(file, entry.score);
+                    utils::Serialize(file, entry.id);
+                }
+                pushed = file.push();
+            }
+        }
+        file.close();
+        if (pushed) {
+            return;
+        }
+    }
+
+    /* evaluated again as a whole rather than left outdated */
+    WLOG("Persisted", "(static)", "Removing " << path << ", changed "
+         "concurrently during its invalidation")
+    storing.remove(path, true);
+}
+
+void Persisted::InvalidateMembership(const utils::SyncDirectory& storing,
+                                     const std::filesystem::path& path,
+                                     const std::unordered_set<fileId_t>& ids)
+{
+    /* redone on the membership pushed by another client meanwhile, as the
+     * orders */
+    for (unsigned int i = 0; i < INVALIDATION_MAX_TRY; ++i) {
+        auto file = storing.open(path);
+        file.seekg(0, std::ios::end);
+        const auto len = static_cast<size_t>(std::max(file.tellg(),
+                                                      std::streampos(0)));
+
+        bool hasChanged = false;
+        for (const auto& id : ids) {
+            const auto pos = id / STATES_PER_BYTE;
+            if (pos >= len) {
+                /* already unknown */
+                continue;
+            }
+
+            unsigned char byte;
+            file.seekg(std::streamoff(pos));
+            utils::Deserialize(file, byte);
+            byte &= static_cast<unsigned char>(
+                ~(0x3 << ((id % STATES_PER_BYTE) * 2)));
+            file.seekp(std::streamoff(pos));
+            utils::Serialize(file, byte);
+            hasChanged = true;
+        }
+
+        const auto pushed = !hasChanged || file.push();
+        file.close();
+        if (pushed) {
+            return;
+        }
+    }
+
+    WLOG("Persisted", "(static)", "Removing " << path << ", changed "
+         "concurrently during its invalidation")
+    storing.remove(path, true);
+}
+
+bool Persisted::ReadOrder(utils::SyncDirectory::FileStream& file,
+                          order_t& order)
+{
+    file.seekg(0, std::ios::end);
+    if (file.tellg() <= 0) {
+        /* empty file */
+        return false;
+    }
+    file.seekg(0);
+
+    size_t size;
+    if (!utils::Deserialize(file, size)) {
+        file.clear();
+        return false;
+    }
+
+    order.clear();
+    order.reserve(size);
+    Entry entry;
+    for (size_t i = 0; i < size; ++i) {
+        if (!utils::Deserialize(file, entry.score) ||
+            !utils::Deserialize(file, entry.id))
+        {
+            /* the order will be rebuilt */
+            WLOG("Persisted", "(static)", "Truncated order file "
+                 << file.getPath())
+            file.clear();
+            return false;
+        }
+        order.push_back(entry);
+    }
+
+    return true;
+}
@@ -44,6 +44,29 @@ void Relative::write(const std::filesystem::path& filepath,
     return _conn->write(_path / filepath, buffer);
 }
 
+bool Relative::writeRanges(const std::filesystem::path& filepath,
+                           const fileBuf_t& buffer,
+                           const std::vector<Range>& ranges) {
+    return _conn->writeRanges(_path / filepath, buffer, ranges);
+}
+
+bool Relative::readFrom(const std::filesystem::path& filepath, size_t offset,
+                        fileBuf_t& buffer) {
+    return _conn->readFrom(_path / filepath, offset, buffer);
+}
+
+bool Relative::append(const std::filesystem::path& filepath,
+                      const fileBuf_t& buffer) {
+    return _conn->append(_path / filepath, buffer);
+}
+
+bool Relative::writeIf(const std::filesystem::path& filepath,
+                       const fileBuf_t& buffer,
+                       const std::vector<Range>& ranges,
+                       struct timespec& mtime, bool& written) {
+    return _conn->writeIf(_path / filepath, buffer, ranges, mtime, written);
+}
+
 bool Relative::download(const std::filesystem::path& from,
                         const std::filesystem::path& to) {
     return _conn->download(_path / from, to);
@@ -239,6 +239,152 @@ void SMB::write(const std::filesystem::path& filepath, const fileBuf_t& buffer)
     RELEASE
 }
 
+bool SMB::writeRanges(const std::filesystem::path& filepath,
+                      const fileBuf_t& buffer,
+                      const std::vector<Range>& ranges)
+{
+    DLOG("SMB", this, "Write " << ranges.size() << " ranges to file "
+         << filepath)
+
+    const auto path = _path + filepath.string();
+
+    ACQUIRE
+
+    /* without truncating the existing file */
+    auto file = smbc_getFunctionOpen(_ctx)(_ctx, path.c_str(), O_WRONLY, 0);
+    if (!file) {
+        WLOG("SMB", this, "Failed to open " << path << ". From errno: "
+             << strerror(errno))
+
+        RELEASE
+
+        return false;
+    }
+
+    bool res = true;
+    for (const auto& range : ranges) {
+        if (smbc_getFunctionLseek(_ctx)(_ctx, file,
+                                        static_cast<off_t>(range.offset),
+                                        SEEK_SET) < 0)
+        {
+            WLOG("SMB", this, "Failed to seek in " << path << ". From errno: "
+                 << strerror(errno))
+            res = false;
+            break;
+        }
+
+        const auto len = smbc_getFunctionWrite(_ctx)(_ctx, file,
+                                                     &buffer[range.offset],
+                                                     range.size);
+        if (len < 0 || static_cast<size_t>(len) != range.size) {
+            WLOG("SMB", this, "Failed to write to " << path << ". From errno: "
+                 << strerror(errno))
+            res = false;
+            break;
+        }
+    }
+
+    if (smbc_getFunctionClose(_ctx)(_ctx, file) != 0) {
+        WLOG("SMB", this, "Failed to close " << path << ". From errno: "
+             << strerror(errno))
+    }
+
+    RELEASE
+
+    return res;
+}
+
+bool SMB::readFrom(const std::filesystem::path& filepath, size_t offset,
+                   fileBuf_t& buffer)
+{
+    DLOG("SMB", this, "Read file " << filepath << " from " << offset)
+
+    buffer.clear();
+    const auto path = _path + filepath.string();
+
+    ACQUIRE
+
+    auto file = smbc_getFunctionOpen(_ctx)(_ctx, path.c_str(), O_RDONLY, 0);
+    if (!file) {
+        WLOG("SMB", this, "Failed to open " << path << ". From errno: "
+             << strerror(errno))
+
+        RELEASE
+
+        return false;
+    }
+
+    auto res = smbc_getFunctionLseek(_ctx)(_ctx, file,
+                                           static_cast<off_t>(offset),
+                                           SEEK_SET) >= 0;
+    if (res) {
+        char buf[BUFFER_SZ];
+        auto len = smbc_getFunctionRead(_ctx)(_ctx, file, buf, BUFFER_SZ);
+        while (len > 0) {
+            buffer.insert(buffer.end(), buf, buf + len);
+            len = smbc_getFunctionRead(_ctx)(_ctx, file, buf, BUFFER_SZ);
+        }
+        res = len == 0;
+    }
+    if (!res) {
+        WLOG("SMB", this, "Failed to read " << path << ". From errno: "
+             << strerror(errno))
+    }
+
+    if (smbc_getFunctionClose(_ctx)(_ctx, file) != 0) {
+        WLOG("SMB", this, "Failed to close " << path << ". From errno: "
+             << strerror(errno))
+    }
+
+    RELEASE
+
+    return res;
+}
+
+bool SMB::append(const std::filesystem::path& filepath,
+                 const fileBuf_t& buffer)
+{
+    DLOG("SMB", this, "Append " << buffer.size() << " bytes to file "
+         << filepath)
+
+    const auto path = _path + filepath.string();
+
+    ACQUIRE
+
+    auto file = smbc_getFunctionOpen(_ctx)(_ctx, path.c_str(),
+                                           O_WRONLY | O_CREAT, 0);
+    if (!file) {
+        WLOG("SMB", this, "Failed to open " << path << ". From errno: "
+             << strerror(errno))
+
+        RELEASE
+
+        return false;
+    }
+
+    /* the end of the file as seen by the server */
+    auto res = smbc_getFunctionLseek(_ctx)(_ctx, file, 0, SEEK_END) >= 0;
+    if (res) {
+        const auto len = smbc_getFunctionWrite(_ctx)(_ctx, file,
+                                                     buffer.data(),
+                                                     buffer.size());
+        res = len >= 0 && static_cast<size_t>(len) == buffer.size();
+    }
+    if (!res) {
+        WLOG("SMB", this, "Failed to append to " << path << ". From errno: "
+             << strerror(errno))
+    }
+
+    if (smbc_getFunctionClose(_ctx)(_ctx, file) != 0) {
+        WLOG("SMB", this, "Failed to close " << path << ". From errno: "
+             << strerror(errno))
+    }
+
+    RELEASE
+
+    return res;
+}
+
 bool SMB::download(const std::filesystem::path& from,
                    const std::filesystem::path& to)
 {
@@ -264,6 +264,133 @@ void SMB::write(const std::filesystem::path& filepath, const fileBuf_t& buffer)
     RELEASE
 }
 
+bool SMB::writeRanges(const std::filesystem::path& filepath,
+                      const fileBuf_t& buffer,
+                      const std::vector<Range>& ranges)
+{
+    DLOG("SMB", this, "Write " << ranges.size() << " ranges to file "
+         << filepath)
+
+    ACQUIRE
+
+    /* without truncating the existing file */
+    auto file = smb2_open(_ctx, filepath.c_str(), O_WRONLY);
+    if (!file) {
+        WLOG("SMB", this, "Failed to open " << filepath
+             << ". More: " << smb2_get_error(_ctx))
+
+        RELEASE
+
+        return false;
+    }
+
+    bool res = true;
+    for (const auto& range : ranges) {
+        const auto len = smb2_pwrite(_ctx, file, &buffer[range.offset],
+                                     static_cast<uint32_t>(range.size),
+                                     range.offset);
+        if (len < 0 || static_cast<size_t>(len) != range.size) {
+            WLOG("SMB", this, "Failed to write to " << filepath << ". More: "
+                 << smb2_get_error(_ctx))
+            res = false;
+            break;
+        }
+    }
+
+    if (smb2_close(_ctx, file) != 0) {
+        WLOG("SMB", this, "Failed to close " << filepath << ". More: "
+             << smb2_get_error(_ctx))
+    }
+
+    RELEASE
+
+    return res;
+}
+
+bool SMB::readFrom(const std::filesystem::path& filepath, size_t offset,
+                   fileBuf_t& buffer)
+{
+    DLOG("SMB", this, "Read file " << filepath << " from " << offset)
+
+    buffer.clear();
+
+    ACQUIRE
+
+    auto file = smb2_open(_ctx, filepath.c_str(), O_RDONLY);
+    if (!file) {
+        WLOG("SMB", this, "Failed to open " << filepath
+             << ". More: " << smb2_get_error(_ctx))
+
+        RELEASE
+
+        return false;
+    }
+
+    uint8_t buf[BUFFER_SZ];
+    auto len = smb2_pread(_ctx, file, buf, BUFFER_SZ, offset);
+    while (len > 0) {
+        buffer.insert(buffer.end(), buf, buf + len);
+        offset += static_cast<size_t>(len);
+        len = smb2_pread(_ctx, file, buf, BUFFER_SZ, offset);
+    }
+    const auto res = len == 0;
+    if (!res) {
+        WLOG("SMB", this, "Failed to read " << filepath << ". More: "
+             << smb2_get_error(_ctx))
+    }
+
+    if (smb2_close(_ctx, file) != 0) {
+        WLOG("SMB", this, "Failed to close " << filepath << ". More: "
+             << smb2_get_error(_ctx))
+    }
+
+    RELEASE
+
+    return res;
+}
+
+bool SMB::append(const std::filesystem::path& filepath,
+                 const fileBuf_t& buffer)
+{
+    DLOG("SMB", this, "Append " << buffer.size() << " bytes to file "
+         << filepath)
+
+    ACQUIRE
+
+    auto file = smb2_open(_ctx, filepath.c_str(), O_WRONLY | O_CREAT);
+    if (!file) {
+        WLOG("SMB", this, "Failed to open " << filepath
+             << ". More: " << smb2_get_error(_ctx))
+
+        RELEASE
+
+        return false;
+    }
+
+    /* the end of the file as seen by the server */
+    smb2_stat_64 fileStat;
+    auto res = smb2_fstat(_ctx, file, &fileStat) == 0;
+    if (res) {
+        const auto len = smb2_pwrite(_ctx, file, buffer.data(),
+                                     static_cast<uint32_t>(buffer.size()),
+                                     fileStat.smb2_size);
+        res = len >= 0 && static_cast<size_t>(len) == buffer.size();
+    }
+    if (!res) {
+        WLOG("SMB", this, "Failed to append to " << filepath << ". More: "
+             << smb2_get_error(_ctx))
+    }
+
+    if (smb2_close(_ctx, file) != 0) {
+        WLOG("SMB", this, "Failed to close " << filepath << ". More: "
+             << smb2_get_error(_ctx))
+    }
+
+    RELEASE
+
+    return res;
+}
+
 bool SMB::download(const std::filesystem::path& from,
                    const std::filesystem::path& to)
 {
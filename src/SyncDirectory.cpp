@@ -1,77 +1,462 @@
 #include "fnifi/utils/SyncDirectory.hpp"
+#include "fnifi/utils/Task.hpp"
+#include "fnifi/utils/Compression.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <random>
 
 
 using namespace fnifi;
 using namespace fnifi::utils;
 
-SyncDirectory::FileStream::FileStream(const SyncDirectory& sync,
-                                      const std::filesystem::path& filepath,
-                                      bool ate)
+SyncDirectory::ASyncedFile::~ASyncedFile() {}
+
+bool SyncDirectory::ASyncedFile::pull() {
+    if (!_syncDisabled) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - _lastCheck < std::chrono::milliseconds(_sync._leaseMs)) {
+            /* the local copy is trusted */
+            return false;
+        }
+        return pullNow();
+    }
+    return false;
+}
+
+bool SyncDirectory::ASyncedFile::push() {
+    if (!_syncDisabled) {
+        DLOG("ASyncedFile", this, "Push")
+
+        flushLocal();
+        if (_sync._writeBehindMs > 0 && !_conflicting) {
+            _sync.schedule(this);
+        } else {
+            const auto pushed = pushNow();
+            _sync.publish();
+            return pushed;
+        }
+    }
+    return true;
+}
+
+void SyncDirectory::ASyncedFile::disableSync(bool pull) {
+    DLOG("ASyncedFile", this, "Disable synchronization")
+
+    _syncDisabled = true;
+
+    if (pull) {
+        this->pull();
+    }
+}
+
+void SyncDirectory::ASyncedFile::enableSync(bool push) {
+    DLOG("ASyncedFile", this, "Enable synchronization")
+
+    _syncDisabled = false;
+
+    if (push) {
+        this->push();
+    }
+}
+
+void SyncDirectory::ASyncedFile::setMergeable(const fileBuf_t& emptySlot) {
+    DLOG("ASyncedFile", this, "Mergeable with slots of " << emptySlot.size()
+         << " bytes")
+
+    _emptySlot = emptySlot;
+
+    /* the local copy has just been pulled */
+    _base = readAll();
+}
+
+std::filesystem::path SyncDirectory::ASyncedFile::getPath(bool relative) const {
+    if (relative) {
+        return _relapath;
+    }
+    return _abspath;
+}
+
+SyncDirectory::ASyncedFile::ASyncedFile(const SyncDirectory& sync,
+                                        const std::filesystem::path& filepath)
 : _sync(sync), _abspath(sync.setupFileStream(filepath, _lastMtime)),
-    _relapath(filepath), _syncDisabled(false)
-{
-    setup(ate);
+    _relapath(filepath), _lastCheck(std::chrono::steady_clock::now()),
+    _version(0), _syncDisabled(false), _remoteSz(0), _remoteKnown(false),
+    _remoteCompressed(false), _scheduled(false), _conflicting(false)
+{}
+
+SyncDirectory::ASyncedFile::ASyncedFile(
+    const std::filesystem::path& abspath,
+    const std::filesystem::path& relapath, const SyncDirectory& sync,
+    struct timespec lastMTime)
+: _sync(sync), _abspath(abspath), _relapath(relapath),
+    _lastCheck(std::chrono::steady_clock::now()), _version(0),
+    _syncDisabled(false), _lastMtime(lastMTime), _remoteSz(0),
+    _remoteKnown(false), _remoteCompressed(false), _scheduled(false),
+    _conflicting(false)
+{}
+
+void SyncDirectory::ASyncedFile::release() {
+    /* WARNING: the SyncDirectory may already be destroyed if not scheduled
+     * nor conflicting */
+    if ((_scheduled && _sync.unschedule(this)) || _conflicting) {
+        if (!pushNow()) {
+            WLOG("ASyncedFile", this, "Local changes of " << _relapath
+                 << " released without being pushed")
+        }
+        _sync.publish();
+    }
 }
 
-SyncDirectory::FileStream::~FileStream() {
-    if (is_open()) {
-        close();
+uint64_t SyncDirectory::ASyncedFile::HashBlock(const unsigned char* data,
+                                             size_t n)
+{
+    /* 64 bits FNV-1a, to make an unnoticed change unlikely */
+    const uint64_t FNV_PRIME = 1099511628211UL;
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < n; ++i) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
     }
+    return hash;
 }
 
-bool SyncDirectory::FileStream::pull() {
-    if (!_syncDisabled) {
-        DLOG("FileStream", this, "Pull")
+bool SyncDirectory::ASyncedFile::pullNow() {
+    DLOG("ASyncedFile", this, "Pull")
 
-        close();
+    _lastCheck = std::chrono::steady_clock::now();
+    const auto pending = (_scheduled && _sync.unschedule(this)) ||
+        _conflicting;
+
+    /* before the remote file, so that a push meanwhile is seen next time */
+    uint64_t version;
+    struct timespec mtime;
+    auto current = false;
+    if (_sync.getVersion(_relapath, version, mtime)) {
+        /* or pushed by this client, or already pulled */
+        current = version == _version ||
+            ((mtime.tv_sec != 0 || mtime.tv_nsec != 0) &&
+             mtime.tv_sec == _lastMtime.tv_sec &&
+             mtime.tv_nsec == _lastMtime.tv_nsec);
+        _version = version;
+    }
 
-        const auto newLastMTime = _sync.pull(_abspath, _relapath, _lastMtime);
-        const auto hasChanged = (newLastMTime > _lastMtime);
-        _lastMtime = newLastMTime;
+    if (current || !_sync.hasChanged(_relapath, _lastMtime)) {
+        if (pending) {
+            /* left to the flusher */
+            _sync.schedule(this);
+        }
+        return false;
+    }
+    if (pending) {
+        /* pushed first so that the local changes are merged */
+        if (!pushNow()) {
+            WLOG("ASyncedFile", this, "Local changes of " << _relapath
+                 << " replaced by the concurrent ones")
+        }
+        _sync.publish();
+    }
 
-        open(_abspath, std::ios::in | std::ios::out | std::ios::binary);
+    closeLocal();
 
-        return hasChanged;
+    bool compressed = false;
+    const auto newLastMTime = _sync.pull(_abspath, _relapath, _lastMtime,
+                                         compressed);
+    const auto hasChanged = (newLastMTime > _lastMtime);
+    _lastMtime = newLastMTime;
+
+    openLocal();
+
+    if (hasChanged) {
+        /* the local file is now a copy of the remote one */
+        setRemoteContent(readAll(), compressed);
     }
-    return false;
+
+    return hasChanged;
 }
 
-void SyncDirectory::FileStream::push() {
-    if (!_syncDisabled) {
-        DLOG("FileStream", this, "Push")
+bool SyncDirectory::ASyncedFile::pushNow() {
+    /* WARNING: may run on the flusher thread, so the stream itself is not
+     * used */
+    auto buf = readAll();
+    std::vector<connection::Range> ranges;
+    fileBuf_t compressed;
+    if (prepare(buf, ranges, compressed)) {
+        return send(buf, ranges, compressed);
+    }
+    return true;
+}
 
-        flush();
+bool SyncDirectory::ASyncedFile::prepare(const fileBuf_t& buf,
+                                        std::vector<connection::Range>& ranges,
+                                        fileBuf_t& compressed) const
+{
+    if (buf.empty()) {
+        return false;
+    }
 
-        /* fill the buffer */
-        seekg(0, std::ios::end);
-        const auto len = tellg();
-        if (len > 0) {
-            fileBuf_t buf(static_cast<size_t>(len), '\0');
-            seekg(0);
-            read(reinterpret_cast<char*>(&buf[0]), len);
+    auto delta = getDirtyRanges(buf, ranges);
+    if (delta && ranges.empty()) {
+        DLOG("ASyncedFile", this, "Nothing to push")
+        return false;
+    }
 
-            _sync.push(_relapath, buf);
+    /* the cheapest of a compressed content, ranges or the raw content */
+    delta = delta && !_remoteCompressed;
+    size_t deltaSz = buf.size();
+    if (delta) {
+        deltaSz = 0;
+        for (const auto& range : ranges) {
+            deltaSz += range.size;
+        }
+    }
+    if (_sync._compress && Compression::Compress(buf, compressed) &&
+        compressed.size() < deltaSz)
+    {
+        ranges.clear();
+    } else {
+        compressed.clear();
+        if (!delta) {
+            ranges.clear();
         }
     }
+    return true;
 }
 
-void SyncDirectory::FileStream::disableSync(bool pull) {
-    DLOG("FileStream", this, "Disable synchronization")
+bool SyncDirectory::ASyncedFile::send(fileBuf_t& buf,
+                                     std::vector<connection::Range> ranges,
+                                     fileBuf_t compressed)
+{
+    const auto deferred = _sync.isDeferred(this);
+    if (!deferred) {
+        _conflicting = false;
+    }
 
-    _syncDisabled = true;
+    auto before = _sync.getStats(_relapath);
+    for (unsigned int i = 0;; ++i) {
+        if (i == PUSH_MAX_TRY) {
+            /* the local changes stay until the next push */
+            WLOG("ASyncedFile", this, "Too many concurrent changes of "
+                 << _relapath)
+            return false;
+        }
 
-    if (pull) {
-        this->pull();
+        if (isConflicting(before)) {
+            if (deferred) {
+                /* the local copy is only written by its owner */
+                DLOG("ASyncedFile", this, "Conflict of " << _relapath
+                     << " left to its owner")
+                _conflicting = true;
+                return false;
+            }
+            if (_emptySlot.empty()) {
+                /* reported to the owner, which redoes its changes on the
+                 * remote content, pulled next whatever the lease */
+                DLOG("ASyncedFile", this, "Local changes of " << _relapath
+                     << " conflicting with concurrent ones")
+                _lastCheck = {};
+                return false;
+            }
+
+            DLOG("ASyncedFile", this, "Merging the concurrent changes of "
+                 << _relapath)
+
+            merge(buf, before);
+            ranges.clear();
+            compressed.clear();
+            if (!prepare(buf, ranges, compressed)) {
+                /* already pushed by someone else */
+                return true;
+            }
+            before = _sync.getStats(_relapath);
+            continue;
+        }
+
+        /* fails if pushed by someone else since the check */
+        const auto mtime = before.st_size > 0 ? before.st_mtimespec
+            : timespec{0, 0};
+        const auto written = compressed.empty()
+            ? _sync.push(_relapath, buf, ranges, &mtime)
+            : _sync.pushCompressed(_relapath, buf, compressed, &mtime);
+        if (written) {
+            break;
+        }
+        before = _sync.getStats(_relapath);
     }
+
+    setRemoteContent(buf, !compressed.empty());
+    const auto recorded = recordPush(before);
+    _sync.bump(_relapath, recorded ? _lastMtime : timespec{0, 0});
+    return true;
 }
 
-void SyncDirectory::FileStream::enableSync(bool push) {
-    DLOG("FileStream", this, "Enable synchronization")
+bool SyncDirectory::ASyncedFile::isConflicting(const struct stat& stats) const
+{
+    return stats.st_size > 0 &&
+        (stats.st_mtimespec.tv_sec != _lastMtime.tv_sec ||
+         stats.st_mtimespec.tv_nsec != _lastMtime.tv_nsec);
+}
 
-    _syncDisabled = false;
+void SyncDirectory::ASyncedFile::merge(fileBuf_t& buf,
+                                      const struct stat& stats)
+{
+    bool compressed;
+    const auto remote = _sync.fetch(_relapath, compressed);
 
-    if (push) {
-        this->push();
+    /* the local slots changed since the last pull win over the remote ones,
+     * down to a trailing partial slot */
+    const auto slotSz = _emptySlot.size();
+    const auto slot = [this](const fileBuf_t& content, size_t pos,
+                             size_t len) {
+        return pos + len <= content.size() ? &content[pos]
+            : _emptySlot.data();
+    };
+    fileBuf_t merged(std::max(buf.size(), remote.size()));
+    for (size_t pos = 0; pos < merged.size(); pos += slotSz) {
+        const auto len = std::min(slotSz, merged.size() - pos);
+        const auto ours = slot(buf, pos, len);
+        const auto changed = !std::equal(ours, ours + len,
+                                         slot(_base, pos, len));
+        const auto src = changed ? ours : slot(remote, pos, len);
+        std::copy(src, src + len, merged.begin() + std::ptrdiff_t(pos));
+    }
+
+    writeLocal(merged);
+    setRemoteContent(remote, compressed);
+    _lastMtime = stats.st_mtimespec;
+    buf = std::move(merged);
+}
+
+bool SyncDirectory::ASyncedFile::recordPush(const struct stat& before) {
+    if (before.st_size > 0 &&
+        (before.st_mtimespec.tv_sec != _lastMtime.tv_sec ||
+         before.st_mtimespec.tv_nsec != _lastMtime.tv_nsec))
+    {
+        /* changed by someone else since the last pull, so the merged
+         * content will be downloaded */
+        return false;
+    }
+
+    /* TODO: the file may be changed here before the mtime has been
+     * retrieved */
+    _lastMtime = _sync.getStats(_relapath).st_mtimespec;
+    return true;
+}
+
+fileBuf_t SyncDirectory::ASyncedFile::readAll() const {
+    /* through its own stream, to leave the positions untouched */
+    std::ifstream file(_abspath, std::ios::binary | std::ios::ate);
+    const auto len = file.tellg();
+    if (len <= 0) {
+        return {};
+    }
+
+    fileBuf_t buf(static_cast<size_t>(len), '\0');
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(&buf[0]), len);
+    return buf;
+}
+
+bool SyncDirectory::ASyncedFile::getDirtyRanges(
+    const fileBuf_t& buf, std::vector<connection::Range>& ranges) const
+{
+    if (!_remoteKnown || buf.size() < _remoteSz) {
+        /* the remote file would need to be truncated */
+        return false;
+    }
+
+    size_t dirtySz = 0;
+    for (size_t offset = 0; offset < buf.size(); offset += SYNC_BLOCK_SIZE) {
+        const auto block = offset / SYNC_BLOCK_SIZE;
+        const auto size = std::min(static_cast<size_t>(SYNC_BLOCK_SIZE),
+                                   buf.size() - offset);
+        if (offset + size <= _remoteSz && block < _remoteBlocks.size() &&
+            _remoteBlocks[block] == HashBlock(&buf[offset], size))
+        {
+            continue;
+        }
+
+        if (!ranges.empty() &&
+            ranges.back().offset + ranges.back().size == offset)
+        {
+            /* contiguous to the previous one */
+            ranges.back().size += size;
+        } else {
+            ranges.push_back({offset, size});
+        }
+        dirtySz += size;
+    }
+
+    /* pushing the whole file is cheaper than many small writes */
+    return dirtySz <= buf.size() / 2;
+}
+
+void SyncDirectory::ASyncedFile::setRemoteContent(const fileBuf_t& buf,
+                                                 bool compressed)
+{
+    _remoteBlocks.clear();
+    _remoteBlocks.reserve((buf.size() + SYNC_BLOCK_SIZE - 1)
+                          / SYNC_BLOCK_SIZE);
+    for (size_t offset = 0; offset < buf.size(); offset += SYNC_BLOCK_SIZE) {
+        _remoteBlocks.push_back(HashBlock(
+            &buf[offset], std::min(static_cast<size_t>(SYNC_BLOCK_SIZE),
+                                   buf.size() - offset)));
+    }
+    _remoteSz = buf.size();
+    _remoteKnown = true;
+    _remoteCompressed = compressed;
+    if (!_emptySlot.empty()) {
+        _base = buf;
+    }
+}
+
+void SyncDirectory::ASyncedFile::replaceLocal(const fileBuf_t& buf) {
+    DLOG("ASyncedFile", this, "Replace the local copy by " << buf.size()
+         << " bytes")
+
+    std::random_device rd;
+    auto tmppath = _abspath;
+    tmppath += "." + std::to_string(rd()) + DOWNLOAD_EXTENSION;
+    {
+        std::ofstream file(tmppath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(buf.data()),
+                   static_cast<std::streamsize>(buf.size()));
+        if (!file) {
+            std::filesystem::remove(tmppath);
+            std::ostringstream msg;
+            msg << "Failed to write " << tmppath;
+            ELOG("ASyncedFile", this, msg.str())
+            throw std::runtime_error(msg.str());
+        }
+    }
+
+    closeLocal();
+    std::filesystem::rename(tmppath, _abspath);
+    openLocal();
+
+    /* the in-place remote file is no longer the one held */
+    _remoteKnown = false;
+    if (!_emptySlot.empty()) {
+        _base = buf;
+    }
+}
+
+SyncDirectory::FileStream::FileStream(const SyncDirectory& sync,
+                                      const std::filesystem::path& filepath,
+                                      bool ate)
+: ASyncedFile(sync, filepath)
+{
+    setup(ate);
+}
+
+SyncDirectory::FileStream::~FileStream() {
+    release();
+    if (is_open()) {
+        close();
     }
 }
 
@@ -82,19 +467,11 @@ void SyncDirectory::FileStream::take(TempFile& file) {
     open(_abspath, std::ios::in | std::ios::out | std::ios::binary);
 }
 
-std::filesystem::path SyncDirectory::FileStream::getPath(bool relative) const {
-    if (relative) {
-        return _relapath;
-    }
-    return _abspath;
-}
-
 SyncDirectory::FileStream::FileStream(const std::filesystem::path& abspath,
                                       const std::filesystem::path& relapath,
                                       bool ate, const SyncDirectory& sync,
                                       struct timespec lastMTime)
-: _sync(sync), _abspath(abspath), _relapath(relapath), _syncDisabled(false),
-    _lastMtime(lastMTime)
+: ASyncedFile(abspath, relapath, sync, lastMTime)
 {
     setup(ate);
 }
@@ -121,80 +498,1583 @@ void SyncDirectory::FileStream::setup(bool ate) {
     }
 }
 
-SyncDirectory::SyncDirectory(connection::IConnection* conn,
-                             const std::string& path)
-: _conn(conn), _path(path)
-{
-    DLOG("SyncDirectory", this, "Instanciation for IConnection " << conn
-         << " and path " << path)
+void SyncDirectory::FileStream::openLocal() {
+    open(_abspath, std::ios::in | std::ios::out | std::ios::binary);
 }
 
-SyncDirectory::FileStream SyncDirectory::open(
-    const std::filesystem::path& filepath, bool ate, bool mkdir) const
-{
-    struct timespec lastMTime = {0, 0};
-    const auto abspath = setupFileStream(filepath, lastMTime, mkdir);
+void SyncDirectory::FileStream::closeLocal() {
+    close();
+}
 
-    return FileStream(abspath, filepath, ate, *this, lastMTime);
+void SyncDirectory::FileStream::flushLocal() {
+    flush();
 }
 
-std::filesystem::path SyncDirectory::setupFileStream(
-    const std::filesystem::path& filepath, struct timespec& lastMTime,
-    bool mkdir) const
+void SyncDirectory::FileStream::writeLocal(const fileBuf_t& buf) {
+    /* through the stream, its position being restored */
+    clear();
+    const auto pos = tellg();
+    seekp(0);
+    write(reinterpret_cast<const char*>(buf.data()),
+          static_cast<std::streamsize>(buf.size()));
+    flush();
+    if (pos >= 0) {
+        seekg(pos);
+        seekp(pos);
+    }
+}
+
+SyncDirectory::MappedFile::MappedFile(const SyncDirectory& sync,
+                                      const std::filesystem::path& filepath)
+: ASyncedFile(sync, filepath), _fd(-1), _data(nullptr), _size(0),
+    _capacity(0)
 {
-    DLOG("SyncDirectory", this, "Setup directories and file for a FileStream "
-         "instance")
+    DLOG("MappedFile", this, "Instanciation with absolute path " << _abspath
+         << " and SyncDirectory " << &_sync)
 
-    const auto abspath = _path / filepath;
+    openLocal();
+}
 
-    if (mkdir) {
-        /* create the directories if needed */
-        std::filesystem::create_directories(abspath.parent_path());
-        _conn->createDirs(filepath.parent_path());
+SyncDirectory::MappedFile::~MappedFile() {
+    release();
+    closeLocal();
+}
+
+unsigned char* SyncDirectory::MappedFile::data() {
+    return _data;
+}
+
+const unsigned char* SyncDirectory::MappedFile::data() const {
+    return _data;
+}
+
+size_t SyncDirectory::MappedFile::size() const {
+    return _size;
+}
+
+void SyncDirectory::MappedFile::grow(size_t size) {
+    if (size <= _size) {
+        return;
     }
 
-    lastMTime = pull(abspath, filepath, lastMTime);
+    /* the file may have been grown by a merge meanwhile */
+    struct stat stats;
+    if (fstat(_fd, &stats) != 0) {
+        std::ostringstream msg;
+        msg << "Cannot stat file " << _abspath;
+        ELOG("MappedFile", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    const auto fileSz = static_cast<size_t>(stats.st_size);
+    if (size > fileSz && ftruncate(_fd, static_cast<off_t>(size)) != 0) {
+        std::ostringstream msg;
+        msg << "Cannot grow file " << _abspath << " to " << size << " bytes";
+        ELOG("MappedFile", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
 
-    return abspath;
+    const auto newSz = std::max(size, fileSz);
+    if (newSz > _capacity) {
+        map(newSz);
+    }
+    if (!_emptySlot.empty()) {
+        for (auto pos = fileSz; pos + _emptySlot.size() <= newSz;
+             pos += _emptySlot.size())
+        {
+            std::copy(_emptySlot.begin(), _emptySlot.end(), _data + pos);
+        }
+    }
+    _size = newSz;
 }
 
-bool SyncDirectory::exists(const std::filesystem::path& filepath) const {
-    return std::filesystem::exists(_path / filepath);
+void SyncDirectory::MappedFile::openLocal() {
+    _fd = ::open(_abspath.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat stats;
+    if (_fd < 0 || fstat(_fd, &stats) != 0) {
+        std::ostringstream msg;
+        msg << "Cannot open file " << _abspath;
+        ELOG("MappedFile", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+
+    _size = static_cast<size_t>(stats.st_size);
+    map(_size);
 }
 
-std::filesystem::path SyncDirectory::absolute(
-    const std::filesystem::path& filepath) const
-{
-    return _path / filepath;
+void SyncDirectory::MappedFile::closeLocal() {
+    if (_data != nullptr) {
+        munmap(_data, _capacity);
+        _data = nullptr;
+        _capacity = 0;
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
 }
 
-void SyncDirectory::remove(const std::filesystem::path& filepath) const {
-    std::filesystem::remove(_path / filepath);
+void SyncDirectory::MappedFile::flushLocal() {
+    /* the mapping shares the page cache with the reads of the pushes */
 }
 
-void SyncDirectory::createDirs(const std::filesystem::path& dirpath) const {
-    std::filesystem::create_directories(_path / dirpath);
-    _conn->createDirs(dirpath);
+void SyncDirectory::MappedFile::writeLocal(const fileBuf_t& buf) {
+    grow(buf.size());
+    std::copy(buf.begin(), buf.end(), _data);
 }
 
-struct timespec SyncDirectory::pull(const std::filesystem::path& abspath,
-                                    const std::filesystem::path& relapath,
-                                    const struct timespec& lastMTime) const
+void SyncDirectory::MappedFile::map(size_t size) {
+    /* doubled to remap rarely, the pages past the end of the file being never
+     * accessed */
+    auto capacity = std::max(_capacity,
+                             static_cast<size_t>(MAPPED_MIN_CAPACITY));
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    void* data;
+    if (_data == nullptr) {
+        data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    _fd, 0);
+    } else {
+#ifdef __linux__
+        data = mremap(_data, _capacity, capacity, MREMAP_MAYMOVE);
+#else
+        munmap(_data, _capacity);
+        data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    _fd, 0);
+#endif
+    }
+    if (data == MAP_FAILED) {
+        _data = nullptr;
+        _capacity = 0;
+
+        std::ostringstream msg;
+        msg << "Cannot map file " << _abspath;
+        ELOG("MappedFile", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+
+    _data = static_cast<unsigned char*>(data);
+    _capacity = capacity;
+}
+
+SyncDirectory::LoggedFile::LoggedFile(const SyncDirectory& sync,
+                                      const std::filesystem::path& filepath,
+                                      const fileBuf_t& emptySlot)
+: MappedFile(sync, filepath),
+    _logRelapath(filepath.string() + UPDATE_LOG_EXTENSION),
+    _recordSz(2 * sizeof(uint64_t) + emptySlot.size()), _logOffset(0),
+    _logEpoch(0), _logMtime({0, 0}), _compactable(true)
 {
-    const auto stats = _conn->getStats(relapath);
-    if (stats.st_size > 0 && stats.st_mtimespec > lastMTime) {
-        /* the file exists and has changed since the last pull */
-        if (_conn->download(relapath, abspath)) {
-            /* TODO: the file may be changed here before the mtime has been
-             * retrieved */
-            return _conn->getStats(relapath).st_mtimespec;
+    DLOG("LoggedFile", this, "Instanciation with log " << _logRelapath)
+
+    setMergeable(emptySlot);
+
+    /* the updates since the last compaction */
+    const auto stats = _sync.getStats(_logRelapath);
+    if (stats.st_size > 0) {
+        std::lock_guard<std::mutex> lk(_logMtx);
+        bool changed = false;
+        replay(_sync.fetchTail(_logRelapath, 0), changed);
+        _logMtime = stats.st_mtimespec;
+    }
+}
+
+SyncDirectory::LoggedFile::~LoggedFile() {
+    release();
+}
+
+void SyncDirectory::LoggedFile::set(size_t pos, const unsigned char* slot) {
+    apply(pos, slot);
+
+    const auto logPos = static_cast<uint64_t>(pos);
+    const auto posBytes = reinterpret_cast<const unsigned char*>(&logPos);
+    std::lock_guard<std::mutex> lk(_recordsMtx);
+    _records.insert(_records.end(), posBytes, posBytes + sizeof(logPos));
+    _records.insert(_records.end(), slot, slot + _emptySlot.size());
+}
+
+bool SyncDirectory::LoggedFile::pullNow() {
+    uint64_t version;
+    struct timespec mtime;
+    const auto versioned = _sync.getVersion(_relapath, version, mtime);
+    if (versioned && version == _version) {
+        /* neither appended to nor compacted since the last pull */
+        _lastCheck = std::chrono::steady_clock::now();
+        return false;
+    }
+
+    const auto stats = _sync.getStats(_logRelapath);
+    const auto logSz = static_cast<size_t>(std::max(stats.st_size, off_t(0)));
+    {
+        std::lock_guard<std::mutex> lk(_logMtx);
+        if (logSz > 0 && logSz == _logOffset &&
+            stats.st_mtimespec.tv_sec == _logMtime.tv_sec &&
+            stats.st_mtimespec.tv_nsec == _logMtime.tv_nsec)
+        {
+            _lastCheck = std::chrono::steady_clock::now();
+            if (versioned) {
+                _version = version;
+            }
+            return false;
         }
     }
-    return lastMTime;
+
+    /* the column only changes when compacted, which empties the log */
+    auto changed = ASyncedFile::pullNow();
+
+    std::lock_guard<std::mutex> lk(_logMtx);
+    if (changed || logSz < _logOffset) {
+        _logOffset = 0;
+        _logEpoch = 0;
+    }
+    if (logSz > _logOffset &&
+        !replay(_sync.fetchTail(_logRelapath, _logOffset), changed))
+    {
+        DLOG("LoggedFile", this, "Replaying the whole log " << _logRelapath)
+
+        _logOffset = 0;
+        _logEpoch = 0;
+        replay(_sync.fetchTail(_logRelapath, 0), changed);
+    }
+    _logMtime = stats.st_mtimespec;
+
+    if (changed) {
+        /* the updates not pushed yet win over the replayed ones */
+        const auto entrySz = _recordSz - sizeof(uint64_t);
+        std::lock_guard<std::mutex> recordsLk(_recordsMtx);
+        for (size_t i = 0; i + entrySz <= _records.size(); i += entrySz) {
+            uint64_t pos;
+            std::memcpy(&pos, &_records[i], sizeof(pos));
+            apply(static_cast<size_t>(pos), &_records[i + sizeof(pos)]);
+        }
+    }
+
+    return changed;
 }
 
-void SyncDirectory::push(const std::filesystem::path& relapath,
-                         const fileBuf_t& buf) const
-{
+bool SyncDirectory::LoggedFile::pushNow() {
+    /* WARNING: may run on the flusher thread, so the mapping is not used */
+    std::lock_guard<std::mutex> lk(_logMtx);
+    fileBuf_t entries;
+    {
+        std::lock_guard<std::mutex> recordsLk(_recordsMtx);
+        entries.swap(_records);
+    }
+    if (entries.empty()) {
+        DLOG("LoggedFile", this, "Nothing to push")
+        return true;
+    }
+
+    if (_logEpoch == 0) {
+        /* first records since the last compaction */
+        std::random_device rd;
+        while (_logEpoch == 0) {
+            _logEpoch = (static_cast<uint64_t>(rd()) << 32) | rd();
+        }
+    }
+
+    const auto entrySz = _recordSz - sizeof(uint64_t);
+    const auto epochBytes = reinterpret_cast<const unsigned char*>(&_logEpoch);
+    fileBuf_t buf;
+    buf.reserve(entries.size() / entrySz * _recordSz);
+    for (size_t i = 0; i + entrySz <= entries.size(); i += entrySz) {
+        buf.insert(buf.end(), epochBytes, epochBytes + sizeof(_logEpoch));
+        buf.insert(buf.end(), entries.begin() + std::ptrdiff_t(i),
+                   entries.begin() + std::ptrdiff_t(i + entrySz));
+    }
+
+    DLOG("LoggedFile", this, "Appending " << buf.size() / _recordSz
+         << " records to " << _logRelapath)
+
+    _sync.append(_logRelapath, buf);
+    _sync.bump(_relapath, {0, 0});
+
+    const auto stats = _sync.getStats(_logRelapath);
+    const auto logSz = static_cast<size_t>(std::max(stats.st_size, off_t(0)));
+    if (logSz == _logOffset + buf.size()) {
+        /* no one else has appended since the last pull, so the records are
+         * not read back */
+        _logOffset = logSz;
+        _logMtime = stats.st_mtimespec;
+    }
+
+    /* replaying the log costs more than pulling the column once bigger */
+    if (_compactable && logSz > UPDATE_LOG_MIN_COMPACTION &&
+        stats.st_size > _sync.getStats(_relapath).st_size)
+    {
+        compact();
+    }
+    return true;
+}
+
+bool SyncDirectory::LoggedFile::replay(const fileBuf_t& buf, bool& changed) {
+    const auto slotSz = _emptySlot.size();
+    const auto tail = _logOffset > 0;
+    size_t i = 0;
+    for (; i + _recordSz <= buf.size(); i += _recordSz) {
+        uint64_t epoch;
+        uint64_t pos;
+        std::memcpy(&epoch, &buf[i], sizeof(epoch));
+        std::memcpy(&pos, &buf[i + sizeof(epoch)], sizeof(pos));
+        if (epoch != _logEpoch || pos % slotSz != 0) {
+            if (tail) {
+                /* compacted, or misaligned by a torn record */
+                return false;
+            }
+            if (pos % slotSz != 0) {
+                WLOG("LoggedFile", this, "Skipping a corrupted record of "
+                     << _logRelapath)
+                continue;
+            }
+            /* the epoch of the client which has written last */
+            _logEpoch = epoch;
+        }
+
+        apply(static_cast<size_t>(pos), &buf[i + 2 * sizeof(uint64_t)]);
+        changed = true;
+    }
+
+    /* a record still being appended is read again on the next pull */
+    _logOffset += i;
+    return true;
+}
+
+void SyncDirectory::LoggedFile::apply(size_t pos, const unsigned char* slot) {
+    const auto slotSz = _emptySlot.size();
+    if (pos + slotSz > size()) {
+        grow(pos + slotSz);
+    }
+    std::memcpy(data() + pos, slot, slotSz);
+}
+
+void SyncDirectory::LoggedFile::compact() {
+    DLOG("LoggedFile", this, "Compacting " << _logRelapath)
+
+    /* from the remote copies only, the mapping being left to its owner. The
+     * column is read before the log, whose records are newer */
+    const auto columnStats = _sync.getStats(_relapath);
+    bool compressed;
+    auto column = _sync.fetch(_relapath, compressed);
+    const auto log = _sync.fetchTail(_logRelapath, 0);
+    const auto logStats = _sync.getStats(_logRelapath);
+    if (static_cast<size_t>(logStats.st_size) != log.size()) {
+        /* appended meanwhile, so compacted on a next push */
+        return;
+    }
+
+    const auto slotSz = _emptySlot.size();
+    for (size_t i = 0; i + _recordSz <= log.size(); i += _recordSz) {
+        uint64_t pos;
+        std::memcpy(&pos, &log[i + sizeof(uint64_t)], sizeof(pos));
+        if (pos % slotSz != 0) {
+            continue;
+        }
+        while (column.size() < pos + slotSz) {
+            column.insert(column.end(), _emptySlot.begin(), _emptySlot.end());
+        }
+        const auto slot = log.begin() + std::ptrdiff_t(i + 2
+                                                       * sizeof(uint64_t));
+        std::copy(slot, slot + std::ptrdiff_t(slotSz),
+                  column.begin() + std::ptrdiff_t(pos));
+    }
+
+    /* a column compacted by another client meanwhile may hold newer records
+     * than the log read here */
+    const auto columnMtime = columnStats.st_size > 0 ?
+        columnStats.st_mtimespec : timespec{0, 0};
+    fileBuf_t compressedColumn;
+    bool pushed;
+    if (_sync._compress && Compression::Compress(column, compressedColumn)) {
+        pushed = _sync.pushCompressed(_relapath, column, compressedColumn,
+                                      &columnMtime);
+    } else {
+        pushed = _sync.push(_relapath, column, {}, &columnMtime);
+    }
+    if (!pushed) {
+        DLOG("LoggedFile", this, "Compacted by another client")
+        return;
+    }
+
+    /* emptied only if no record was appended since read, under the lock of
+     * the appends. The records are replayed over the column otherwise */
+    auto logMtime = logStats.st_mtimespec;
+    bool truncated;
+    if (!_sync._conn->writeIf(_logRelapath, {}, {}, logMtime, truncated)) {
+        WLOG("LoggedFile", this, "Cannot empty " << _logRelapath << " safely,"
+             " the compaction is disabled")
+        _compactable = false;
+    } else if (!truncated) {
+        DLOG("LoggedFile", this, "Appended meanwhile, " << _logRelapath
+             << " is emptied on a next compaction")
+    }
+}
+
+SyncDirectory::SyncDirectory(connection::IConnection* conn,
+                             const std::string& path)
+: _conn(conn), _path(path), _writeBehindMs(0), _leaseMs(0),
+    _compress(false), _versioning(false), _flushing(nullptr),
+    _stopFlusher(false), _closing(false)
+{
+    DLOG("SyncDirectory", this, "Instanciation for IConnection " << conn
+         << " and path " << path)
+}
+
+SyncDirectory::~SyncDirectory() {
+    _closing = true;
+    stopFlusher();
+}
+
+void SyncDirectory::setWriteBehind(unsigned int intervalMs) {
+    DLOG("SyncDirectory", this, "Write-behind interval set to " << intervalMs
+         << "ms")
+
+    stopFlusher();
+    _writeBehindMs = intervalMs;
+    if (intervalMs == 0) {
+        return;
+    }
+
+    _stopFlusher = false;
+    _flusher = std::thread([this]() {
+        std::unique_lock<std::mutex> lk(_pendingMtx);
+        while (!_stopFlusher) {
+            _pendingCv.wait_for(
+                lk, std::chrono::milliseconds(_writeBehindMs), [this]() {
+                    return _stopFlusher ||
+                        _pending.size() >= WRITE_BEHIND_MAX_PENDING;
+                });
+            lk.unlock();
+            flush();
+            lk.lock();
+        }
+    });
+}
+
+void SyncDirectory::setLease(unsigned int leaseMs) {
+    DLOG("SyncDirectory", this, "Lease set to " << leaseMs << "ms")
+
+    _leaseMs = leaseMs;
+}
+
+void SyncDirectory::setCompression(bool enable) {
+    if (enable && !Compression::IsAvailable()) {
+        WLOG("SyncDirectory", this, "The remote files cannot be compressed as "
+             "zstd is disabled")
+        return;
+    }
+
+    DLOG("SyncDirectory", this, (enable ? "Enable" : "Disable")
+         << " compression")
+
+    _compress = enable;
+}
+
+void SyncDirectory::setVersioning(bool enable) {
+    DLOG("SyncDirectory", this, (enable ? "Enable" : "Disable")
+         << " versioning")
+
+    _versioning = enable;
+}
+
+void SyncDirectory::flush() const {
+    std::lock_guard<std::mutex> drainLk(_drainMtx);
+    std::unique_lock<std::mutex> lk(_pendingMtx);
+    if (!_pending.empty()) {
+        DLOG("SyncDirectory", this, "Flushing " << _pending.size()
+             << " deferred pushes")
+    }
+
+    while (!_pending.empty()) {
+        const auto file = *_pending.begin();
+        _pending.erase(_pending.begin());
+        _flushing = file;
+        lk.unlock();
+
+        try {
+            file->pushNow();
+        } catch (const std::exception& e) {
+            /* the file stays as is until its next push */
+            ELOG("SyncDirectory", this, "Failed to push " << file->_relapath
+                 << ": " << e.what())
+        }
+
+        lk.lock();
+        if (!_pending.contains(file)) {
+            /* not pushed again meanwhile */
+            file->_scheduled = false;
+        }
+        _flushing = nullptr;
+        _pendingCv.notify_all();
+    }
+    lk.unlock();
+
+    /* a single write per manifest for all the pushes of the flush */
+    publish();
+}
+
+bool SyncDirectory::commit(const std::filesystem::path& manifest,
+                           const std::vector<ASyncedFile*>& files) const
+{
+    auto state = getCommitState(manifest);
+
+    /* the changed contents staged first, under names of their own, so that
+     * nothing the published manifest references is overwritten */
+    std::random_device rd;
+    auto entries = state.entries;
+    std::vector<CommitEntry> staged;
+    std::vector<CommitEntry> replaced;
+    for (const auto file : files) {
+        if (file->_syncDisabled) {
+            continue;
+        }
+        file->flushLocal();
+        if (file->_scheduled) {
+            /* published with the others */
+            unschedule(file);
+        }
+
+        const auto buf = file->readAll();
+        CommitEntry entry = {file->_relapath.string(), buf.size(),
+                             ASyncedFile::HashBlock(buf.data(), buf.size()),
+                             0};
+        const auto it = std::find_if(
+            entries.begin(), entries.end(),
+            [&entry](const CommitEntry& e) {
+                return e.relapath == entry.relapath;
+            });
+        if (it != entries.end() && it->size == entry.size &&
+            it->hash == entry.hash)
+        {
+            continue;
+        }
+        if (it == entries.end() && buf.empty()) {
+            continue;
+        }
+
+        if (!buf.empty()) {
+            entry.stamp = (static_cast<uint64_t>(rd()) << 32) | rd();
+            try {
+                stage(manifest, entry, buf);
+            } catch (...) {
+                for (const auto& e : staged) {
+                    remove(GetStagedPath(manifest, e), true);
+                }
+                throw;
+            }
+            staged.push_back(entry);
+        }
+        if (it == entries.end()) {
+            entries.push_back(entry);
+        } else {
+            if (it->size > 0) {
+                replaced.push_back(*it);
+            }
+            *it = entry;
+        }
+    }
+
+    if (staged.empty() && replaced.empty()) {
+        DLOG("SyncDirectory", this, "Nothing to commit for " << manifest)
+        return true;
+    }
+
+    DLOG("SyncDirectory", this, "Commit of generation " << state.generation + 1
+         << " of " << manifest << " with " << staged.size()
+         << " staged files")
+
+    /* published by a single write, only over the manifest last seen */
+    const auto buf = SerializeManifest(state.generation + 1, entries);
+    auto mtime = state.mtime;
+    bool written;
+    if (!_conn->writeIf(manifest, buf, {}, mtime, written)) {
+        /* WARNING: a client which has read the manifest before this write
+         * may still overwrite it after this check */
+        const auto stats = _conn->getStats(manifest);
+        written = state.mtime.tv_sec == 0 && state.mtime.tv_nsec == 0 ?
+            stats.st_size == 0
+            : stats.st_size > 0 &&
+            stats.st_mtimespec.tv_sec == state.mtime.tv_sec &&
+            stats.st_mtimespec.tv_nsec == state.mtime.tv_nsec;
+        if (written) {
+            _conn->write(manifest, buf);
+            mtime = _conn->getStats(manifest).st_mtimespec;
+        }
+    }
+
+    if (!written) {
+        WLOG("SyncDirectory", this, "Commit of " << manifest << " superseded "
+             "by another client")
+
+        for (const auto& entry : staged) {
+            remove(GetStagedPath(manifest, entry), true);
+        }
+        /* checked again by the next update, whatever the lease */
+        std::lock_guard<std::mutex> lk(_commitsMtx);
+        state.lastCheck = {};
+        _commits[manifest.string()] = state;
+        return false;
+    }
+
+    /* no longer referenced, the updates still reading them reading the
+     * manifest again */
+    for (const auto& entry : replaced) {
+        remove(GetStagedPath(manifest, entry), true);
+    }
+
+    state.generation++;
+    state.mtime = mtime;
+    state.entries.swap(entries);
+    state.lastCheck = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lk(_commitsMtx);
+    _commits[manifest.string()] = state;
+    return true;
+}
+
+bool SyncDirectory::update(const std::filesystem::path& manifest,
+                           const std::vector<ASyncedFile*>& files,
+                           bool& updated) const
+{
+    updated = false;
+    auto state = getCommitState(manifest);
+    const auto now = std::chrono::steady_clock::now();
+    if (now - state.lastCheck < std::chrono::milliseconds(_leaseMs)) {
+        /* the local copies are trusted */
+        return true;
+    }
+
+    auto complete = false;
+    for (unsigned int i = 0; i < COMMIT_MAX_TRY && !complete; ++i) {
+        const auto stats = _conn->getStats(manifest);
+        if (stats.st_size == 0) {
+            /* never committed */
+            for (const auto file : files) {
+                updated = file->pull() || updated;
+            }
+            return true;
+        }
+        if (stats.st_mtimespec.tv_sec == state.mtime.tv_sec &&
+            stats.st_mtimespec.tv_nsec == state.mtime.tv_nsec)
+        {
+            /* no commit since the last update */
+            complete = true;
+            break;
+        }
+
+        uint64_t generation;
+        std::vector<CommitEntry> entries;
+        if (!DeserializeManifest(_conn->read(manifest), generation, entries))
+        {
+            WLOG("SyncDirectory", this, "Incomplete manifest " << manifest)
+            continue;
+        }
+
+        DLOG("SyncDirectory", this, "Update to generation " << generation
+             << " of " << manifest)
+
+        /* all the contents verified before replacing any local copy */
+        complete = true;
+        std::vector<std::pair<ASyncedFile*, fileBuf_t>> contents;
+        for (const auto file : files) {
+            if (file->_syncDisabled) {
+                continue;
+            }
+            const auto entry = std::find_if(
+                entries.begin(), entries.end(),
+                [file](const CommitEntry& e) {
+                    return e.relapath == file->_relapath.string();
+                });
+            if (entry == entries.end()) {
+                /* never committed, left as is */
+                continue;
+            }
+            file->flushLocal();
+            const auto local = file->readAll();
+            if (local.size() == entry->size &&
+                ASyncedFile::HashBlock(local.data(), local.size()) ==
+                entry->hash)
+            {
+                continue;
+            }
+            fileBuf_t buf;
+            if (!fetchStaged(manifest, *entry, buf)) {
+                complete = false;
+                break;
+            }
+            contents.emplace_back(file, std::move(buf));
+        }
+
+        if (!complete) {
+            DLOG("SyncDirectory", this, "Commit of " << manifest
+                 << " superseded during the update")
+            continue;
+        }
+        for (auto& [file, buf] : contents) {
+            file->replaceLocal(buf);
+        }
+        updated = !contents.empty();
+        state.generation = generation;
+        state.mtime = stats.st_mtimespec;
+        state.entries.swap(entries);
+    }
+
+    if (!complete) {
+        WLOG("SyncDirectory", this, "Failed to update to the last commit of "
+             << manifest << ": the local copies are kept")
+        return false;
+    }
+
+    state.lastCheck = now;
+    std::lock_guard<std::mutex> lk(_commitsMtx);
+    _commits[manifest.string()] = state;
+    return true;
+}
+
+SyncDirectory::FileStream SyncDirectory::open(
+    const std::filesystem::path& filepath, bool ate, bool mkdir) const
+{
+    struct timespec lastMTime = {0, 0};
+    const auto abspath = setupFileStream(filepath, lastMTime, mkdir);
+
+    return FileStream(abspath, filepath, ate, *this, lastMTime);
+}
+
+std::filesystem::path SyncDirectory::setupFileStream(
+    const std::filesystem::path& filepath, struct timespec& lastMTime,
+    bool mkdir) const
+{
+    DLOG("SyncDirectory", this, "Setup directories and file for a FileStream "
+         "instance")
+
+    const auto abspath = _path / filepath;
+
+    if (mkdir) {
+        /* create the directories if needed */
+        std::filesystem::create_directories(abspath.parent_path());
+        _conn->createDirs(filepath.parent_path());
+    }
+
+    /* WARNING: lastMTime may not be initialized yet */
+    if (takePrefetched(filepath, lastMTime)) {
+        return abspath;
+    }
+
+    lastMTime = {0, 0};
+    const auto stats = _conn->getStats(filepath);
+    if (stats.st_size > 0) {
+        bool compressed;
+        if (isStamped(abspath, stats.st_mtimespec)) {
+            /* the local copy is already the remote one */
+            lastMTime = stats.st_mtimespec;
+        } else if (download(abspath, filepath, stats.st_mtimespec,
+                            compressed))
+        {
+            Task::AddBytes(static_cast<size_t>(stats.st_size));
+            lastMTime = stats.st_mtimespec;
+        }
+    }
+
+    return abspath;
+}
+
+void SyncDirectory::schedule(ASyncedFile* file) const {
+    std::lock_guard<std::mutex> lk(_pendingMtx);
+    _pending.insert(file);
+    file->_scheduled = true;
+    if (_pending.size() >= WRITE_BEHIND_MAX_PENDING) {
+        _pendingCv.notify_all();
+    }
+}
+
+bool SyncDirectory::isDeferred(const ASyncedFile* file) const {
+    if (_closing) {
+        /* the shutdown barrier, the files being no longer used */
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(_pendingMtx);
+    return _flushing == file;
+}
+
+bool SyncDirectory::unschedule(ASyncedFile* file) const {
+    std::unique_lock<std::mutex> lk(_pendingMtx);
+    _pendingCv.wait(lk, [this, file]() { return _flushing != file; });
+    file->_scheduled = false;
+    return _pending.erase(file) > 0;
+}
+
+void SyncDirectory::stopFlusher() {
+    if (_flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(_pendingMtx);
+            _stopFlusher = true;
+        }
+        _pendingCv.notify_all();
+        _flusher.join();
+    }
+
+    /* shutdown barrier */
+    flush();
+}
+
+SyncDirectory::CommitState SyncDirectory::getCommitState(
+    const std::filesystem::path& manifest) const
+{
+    {
+        std::lock_guard<std::mutex> lk(_commitsMtx);
+        const auto it = _commits.find(manifest.string());
+        if (it != _commits.end()) {
+            return it->second;
+        }
+    }
+
+    /* the generation goes on from the remote manifest, if any */
+    CommitState state = {0, {0, 0}, {}, {}};
+    if (_conn->getStats(manifest).st_size > 0) {
+        std::vector<CommitEntry> entries;
+        if (!DeserializeManifest(_conn->read(manifest), state.generation,
+                                 entries))
+        {
+            state.generation = 0;
+        }
+    }
+    return state;
+}
+
+std::filesystem::path SyncDirectory::GetStagedPath(
+    const std::filesystem::path& manifest, const CommitEntry& entry)
+{
+    return manifest.parent_path() / COMMIT_DIRNAME /
+        (std::filesystem::path(entry.relapath).filename().string() + "." +
+         std::to_string(entry.stamp));
+}
+
+void SyncDirectory::stage(const std::filesystem::path& manifest,
+                          const CommitEntry& entry, const fileBuf_t& buf)
+    const
+{
+    const auto relapath = GetStagedPath(manifest, entry);
+    _conn->createDirs(relapath.parent_path());
+    fileBuf_t compressed;
+    if (_compress && Compression::Compress(buf, compressed) &&
+        compressed.size() < buf.size())
+    {
+        pushCompressed(relapath, buf, compressed);
+    } else {
+        push(relapath, buf);
+    }
+}
+
+bool SyncDirectory::fetchStaged(const std::filesystem::path& manifest,
+                                const CommitEntry& entry, fileBuf_t& buf)
+    const
+{
+    buf.clear();
+    if (entry.size > 0) {
+        const auto relapath = GetStagedPath(manifest, entry);
+        if (!_conn->exists(relapath)) {
+            DLOG("SyncDirectory", this, "Staged content of " << entry.relapath
+                 << " removed")
+            return false;
+        }
+        bool compressed;
+        buf = fetch(relapath, compressed);
+    }
+    if (buf.size() != entry.size ||
+        ASyncedFile::HashBlock(buf.data(), buf.size()) != entry.hash)
+    {
+        DLOG("SyncDirectory", this, "Staged content of " << entry.relapath
+             << " not matching the manifest")
+        return false;
+    }
+    return true;
+}
+
+std::filesystem::path SyncDirectory::getVersionsPath(
+    const std::filesystem::path& relapath) const
+{
+    /* the first directory, a Collection storing all its files under it */
+    const auto first = relapath.begin();
+    if (relapath.has_parent_path() && first != relapath.end()) {
+        return *first / VERSIONS_FILENAME;
+    }
+    return VERSIONS_FILENAME;
+}
+
+bool SyncDirectory::getVersion(const std::filesystem::path& relapath,
+                               uint64_t& version, struct timespec& mtime)
+    const
+{
+    if (!_versioning || _leaseMs == 0) {
+        /* checked on each pull, the manifest would cost as much as the file
+         * itself */
+        return false;
+    }
+
+    const auto manifest = getVersionsPath(relapath);
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lk(_versionsMtx);
+    auto& state = _versions[manifest.string()];
+    if (!state.checked ||
+        now - state.lastCheck >= std::chrono::milliseconds(_leaseMs))
+    {
+        const auto stats = _conn->getStats(manifest);
+        if (stats.st_size == 0) {
+            state.entries.clear();
+            state.mtime = {0, 0};
+        } else if (stats.st_mtimespec.tv_sec != state.mtime.tv_sec ||
+                   stats.st_mtimespec.tv_nsec != state.mtime.tv_nsec)
+        {
+            DLOG("SyncDirectory", this, "Reading the versions of "
+                 << manifest)
+
+            state.mtime = stats.st_mtimespec;
+            if (!DeserializeVersions(_conn->read(manifest), state.entries)) {
+                /* the files are checked one by one until the next read */
+                WLOG("SyncDirectory", this, "Incomplete versions manifest "
+                     << manifest)
+                state.entries.clear();
+                state.mtime = {0, 0};
+            }
+        }
+        state.lastCheck = now;
+        state.checked = true;
+    }
+
+    const auto it = state.entries.find(relapath.string());
+    if (it == state.entries.end()) {
+        /* not pushed since the versioning has been enabled */
+        return false;
+    }
+    version = it->second.version;
+    mtime = it->second.mtime;
+    return true;
+}
+
+void SyncDirectory::bump(const std::filesystem::path& relapath,
+                         const struct timespec& mtime) const
+{
+    if (!_versioning) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(_bumpsMtx);
+    _bumps[getVersionsPath(relapath).string()][relapath.string()] = mtime;
+}
+
+void SyncDirectory::publish() const {
+    std::unordered_map<std::string, std::unordered_map<
+        std::string, struct timespec>> bumps;
+    {
+        std::lock_guard<std::mutex> lk(_bumpsMtx);
+        bumps.swap(_bumps);
+    }
+
+    for (const auto& [manifest, files] : bumps) {
+        DLOG("SyncDirectory", this, "Bumping " << files.size()
+             << " versions of " << manifest)
+
+        /* from the last manifest seen, which saves reading it again as long
+         * as no one else has written it since */
+        versions_t versions;
+        struct timespec mtime = {0, 0};
+        auto cached = false;
+        {
+            std::lock_guard<std::mutex> lk(_versionsMtx);
+            const auto it = _versions.find(manifest);
+            if (it != _versions.end() && it->second.checked) {
+                versions = it->second.entries;
+                mtime = it->second.mtime;
+                cached = true;
+            }
+        }
+
+        auto conditional = true;
+        auto published = false;
+        unsigned int nTry = 0;
+        while (!published && (cached || nTry < VERSIONS_MAX_TRY)) {
+            if (!cached) {
+                ++nTry;
+                versions.clear();
+                mtime = {0, 0};
+                const auto stats = _conn->getStats(manifest);
+                if (stats.st_size > 0) {
+                    if (!DeserializeVersions(_conn->read(manifest), versions))
+                    {
+                        /* being written by someone else */
+                        continue;
+                    }
+                    mtime = stats.st_mtimespec;
+                }
+            }
+            const auto fromCache = cached;
+            cached = false;
+
+            /* the new files start from a random version, so that a manifest
+             * written again from scratch does not repeat a known one */
+            std::random_device rd;
+            auto bumped = versions;
+            for (const auto& [relapath, fileMtime] : files) {
+                auto& entry = bumped[relapath];
+                entry.version = entry.version == 0 ?
+                    (static_cast<uint64_t>(rd()) << 32) | rd()
+                    : entry.version + 1;
+                if (entry.version == 0) {
+                    entry.version = 1;
+                }
+                entry.mtime = fileMtime;
+            }
+            const auto buf = SerializeVersions(bumped);
+
+            if (conditional) {
+                bool written;
+                if (_conn->writeIf(manifest, buf, {}, mtime, written)) {
+                    /* read again otherwise */
+                    published = written;
+                    versions.swap(bumped);
+                    continue;
+                }
+                conditional = false;
+                if (fromCache) {
+                    /* the bumps of the others may be missing */
+                    continue;
+                }
+            }
+
+            /* WARNING: a client which has read the manifest before this
+             * write may still overwrite it after this check */
+            _conn->write(manifest, buf);
+            versions_t written;
+            published = DeserializeVersions(_conn->read(manifest), written);
+            for (const auto& [relapath, fileMtime] : files) {
+                const auto it = written.find(relapath);
+                published = published && it != written.end() &&
+                    it->second.version == bumped[relapath].version;
+            }
+        }
+
+        if (!published) {
+            WLOG("SyncDirectory", this, "Versions of " << manifest
+                 << " overwritten by a concurrent push")
+            continue;
+        }
+        if (conditional) {
+            /* the manifest written is the last one seen */
+            std::lock_guard<std::mutex> lk(_versionsMtx);
+            auto& state = _versions[manifest];
+            state.entries.swap(versions);
+            state.mtime = mtime;
+            state.lastCheck = std::chrono::steady_clock::now();
+            state.checked = true;
+        }
+    }
+}
+
+bool SyncDirectory::exists(const std::filesystem::path& filepath) const {
+    return std::filesystem::exists(_path / filepath);
+}
+
+std::filesystem::path SyncDirectory::absolute(
+    const std::filesystem::path& filepath) const
+{
+    return _path / filepath;
+}
+
+void SyncDirectory::remove(const std::filesystem::path& filepath,
+                           bool remote) const
+{
+    std::filesystem::remove(_path / filepath);
+    if (remote) {
+        _conn->remove(filepath);
+        const auto marker =
+            std::filesystem::path(COMPRESSION_DIRNAME) / filepath;
+        if (_conn->exists(marker)) {
+            _conn->remove(marker);
+        }
+    }
+}
+
+void SyncDirectory::createDirs(const std::filesystem::path& dirpath) const {
+    std::filesystem::create_directories(_path / dirpath);
+    _conn->createDirs(dirpath);
+}
+
+connection::DirectoryIterator SyncDirectory::list(
+    const std::filesystem::path& dirpath) const
+{
+    if (!_conn->exists(dirpath)) {
+        return connection::DirectoryIterator();
+    }
+    return _conn->iterate(dirpath, false);
+}
+
+struct stat SyncDirectory::getStats(const std::filesystem::path& filepath)
+    const
+{
+    return _conn->getStats(filepath);
+}
+
+fileBuf_t SyncDirectory::read(const std::filesystem::path& filepath) const {
+    bool compressed;
+    return fetch(filepath, compressed);
+}
+
+void SyncDirectory::prefetch(const std::filesystem::path& dirpath,
+                             bool recursive, unsigned int nThreads) const
+{
+    if (!_conn->exists(dirpath)) {
+        return;
+    }
+
+    /* a single listing instead of a check per file */
+    std::vector<connection::DirectoryIterator::Entry> changed;
+    size_t n = 0;
+    const auto now = std::chrono::steady_clock::now();
+    for (const auto& entry : _conn->iterate(dirpath, recursive)) {
+        if (std::filesystem::path(entry.path).extension() ==
+            UPDATE_LOG_EXTENSION)
+        {
+            /* read remotely from their tail */
+            continue;
+        }
+
+        const auto abspath = _path / entry.path;
+        if (isStamped(abspath, entry.mtime)) {
+            std::lock_guard<std::mutex> lk(_prefetchedMtx);
+            _prefetched[entry.path] = {entry.mtime, now};
+        } else {
+            std::filesystem::create_directories(abspath.parent_path());
+            changed.push_back(entry);
+        }
+        n++;
+    }
+
+    DLOG("SyncDirectory", this, "Prefetching " << changed.size() << " of "
+         << n << " files of " << dirpath)
+
+    std::atomic<size_t> next = 0;
+    std::atomic<size_t> bytes = 0;
+    const auto worker = [this, &changed, &next, &bytes, now]() {
+        for (auto i = next++; i < changed.size(); i = next++) {
+            const auto& entry = changed[i];
+            const auto abspath = _path / entry.path;
+            try {
+                bool compressed;
+                if (download(abspath, entry.path, entry.mtime, compressed)) {
+                    bytes += std::filesystem::file_size(abspath);
+                    std::lock_guard<std::mutex> lk(_prefetchedMtx);
+                    _prefetched[entry.path] = {entry.mtime, now};
+                }
+            } catch (const std::exception& e) {
+                /* the file will be pulled when opened */
+                WLOG("SyncDirectory", this, "Failed to prefetch "
+                     << entry.path << ": " << e.what())
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    const auto nWorkers = std::min(static_cast<size_t>(nThreads),
+                                   changed.size());
+    for (size_t i = 1; i < nWorkers; ++i) {
+        threads.emplace_back(worker);
+    }
+    /* the calling thread takes part */
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Task::AddBytes(bytes);
+}
+
+fileBuf_t SyncDirectory::SerializeManifest(
+    uint64_t generation, const std::vector<CommitEntry>& entries)
+{
+    std::ostringstream os(std::ios::binary);
+    Serialize(os, generation);
+    Serialize(os, entries.size());
+    for (const auto& entry : entries) {
+        Serialize(os, entry.relapath.size());
+        os.write(entry.relapath.data(),
+                 static_cast<std::streamsize>(entry.relapath.size()));
+        Serialize(os, entry.size);
+        Serialize(os, entry.hash);
+        Serialize(os, entry.stamp);
+    }
+
+    /* followed by its checksum, to detect a partial upload */
+    const auto str = os.str();
+    fileBuf_t buf(str.begin(), str.end());
+    const auto checksum = ASyncedFile::HashBlock(buf.data(), buf.size());
+    const auto bytes = reinterpret_cast<const unsigned char*>(&checksum);
+    buf.insert(buf.end(), bytes, bytes + sizeof(checksum));
+    return buf;
+}
+
+bool SyncDirectory::DeserializeManifest(const fileBuf_t& buf,
+                                        uint64_t& generation,
+                                        std::vector<CommitEntry>& entries)
+{
+    if (buf.size() < sizeof(uint64_t)) {
+        return false;
+    }
+    const auto len = buf.size() - sizeof(uint64_t);
+    uint64_t checksum;
+    std::copy(buf.begin() + std::ptrdiff_t(len), buf.end(),
+              reinterpret_cast<unsigned char*>(&checksum));
+    if (checksum != ASyncedFile::HashBlock(buf.data(), len)) {
+        return false;
+    }
+
+    std::istringstream is(std::string(buf.begin(),
+                                      buf.begin() + std::ptrdiff_t(len)),
+                          std::ios::binary);
+    size_t n;
+    if (!Deserialize(is, generation) || !Deserialize(is, n)) {
+        return false;
+    }
+    entries.resize(n);
+    for (auto& entry : entries) {
+        size_t sz;
+        if (!Deserialize(is, sz) || sz > len) {
+            return false;
+        }
+        entry.relapath.resize(sz);
+        is.read(&entry.relapath[0], static_cast<std::streamsize>(sz));
+        if (!Deserialize(is, entry.size) || !Deserialize(is, entry.hash) ||
+            !Deserialize(is, entry.stamp))
+        {
+            return false;
+        }
+    }
+    return bool(is);
+}
+
+fileBuf_t SyncDirectory::SerializeVersions(const versions_t& versions) {
+    std::ostringstream os(std::ios::binary);
+    Serialize(os, versions.size());
+    for (const auto& [relapath, entry] : versions) {
+        Serialize(os, relapath.size());
+        os.write(relapath.data(),
+                 static_cast<std::streamsize>(relapath.size()));
+        Serialize(os, entry.version);
+        Serialize(os, entry.mtime);
+    }
+
+    /* followed by its checksum, to detect a read during a write */
+    const auto str = os.str();
+    fileBuf_t buf(str.begin(), str.end());
+    const auto checksum = ASyncedFile::HashBlock(buf.data(), buf.size());
+    const auto bytes = reinterpret_cast<const unsigned char*>(&checksum);
+    buf.insert(buf.end(), bytes, bytes + sizeof(checksum));
+    return buf;
+}
+
+bool SyncDirectory::DeserializeVersions(const fileBuf_t& buf,
+                                        versions_t& versions)
+{
+    if (buf.size() < sizeof(uint64_t)) {
+        return false;
+    }
+    const auto len = buf.size() - sizeof(uint64_t);
+    uint64_t checksum;
+    std::copy(buf.begin() + std::ptrdiff_t(len), buf.end(),
+              reinterpret_cast<unsigned char*>(&checksum));
+    if (checksum != ASyncedFile::HashBlock(buf.data(), len)) {
+        return false;
+    }
+
+    std::istringstream is(std::string(buf.begin(),
+                                      buf.begin() + std::ptrdiff_t(len)),
+                          std::ios::binary);
+    size_t n;
+    if (!Deserialize(is, n)) {
+        return false;
+    }
+    versions.clear();
+    for (size_t i = 0; i < n; ++i) {
+        size_t sz;
+        if (!Deserialize(is, sz) || sz > len) {
+            return false;
+        }
+        std::string relapath(sz, '\0');
+        is.read(&relapath[0], static_cast<std::streamsize>(sz));
+        VersionEntry entry;
+        if (!Deserialize(is, entry.version) || !Deserialize(is, entry.mtime))
+        {
+            return false;
+        }
+        versions[relapath] = entry;
+    }
+    return bool(is);
+}
+
+struct timespec SyncDirectory::pull(const std::filesystem::path& abspath,
+                                    const std::filesystem::path& relapath,
+                                    const struct timespec& lastMTime,
+                                    bool& compressed) const
+{
+    compressed = false;
+    const auto stats = _conn->getStats(relapath);
+    if (stats.st_size > 0 && stats.st_mtimespec > lastMTime) {
+        /* the file exists and has changed since the last pull */
+        if (download(abspath, relapath, stats.st_mtimespec, compressed)) {
+            Task::AddBytes(static_cast<size_t>(stats.st_size));
+
+            /* the mtime before the download, so that a change during it is
+             * pulled again */
+            return stats.st_mtimespec;
+        }
+    }
+    return lastMTime;
+}
+
+bool SyncDirectory::download(const std::filesystem::path& abspath,
+                             const std::filesystem::path& relapath,
+                             const struct timespec& mtime,
+                             bool& compressed) const
+{
+    /* next to the local copy and renamed over it, as it may be mapped by
+     * its owner and must never be truncated */
+    std::random_device rd;
+    auto tmppath = abspath;
+    tmppath += "." + std::to_string(rd()) + DOWNLOAD_EXTENSION;
+
+    compressed = false;
+    try {
+        if (!_conn->download(relapath, tmppath)) {
+            std::filesystem::remove(tmppath);
+            return false;
+        }
+        compressed = decompress(tmppath, relapath);
+    } catch (...) {
+        std::filesystem::remove(tmppath);
+        throw;
+    }
+    stamp(tmppath, mtime);
+    std::filesystem::rename(tmppath, abspath);
+    return true;
+}
+
+void SyncDirectory::stamp(const std::filesystem::path& abspath,
+                          const struct timespec& mtime) const
+{
+    const struct timespec times[2] = {{0, UTIME_OMIT}, mtime};
+    if (utimensat(AT_FDCWD, abspath.c_str(), times, 0) != 0) {
+        /* the local copy will only be downloaded again */
+        WLOG("SyncDirectory", this, "Failed to stamp " << abspath)
+    }
+}
+
+bool SyncDirectory::isStamped(const std::filesystem::path& abspath,
+                              const struct timespec& mtime) const
+{
+    /* equal and not newer, the clocks of the client and the server being
+     * unrelated */
+    struct stat stats;
+    return stat(abspath.c_str(), &stats) == 0 &&
+        stats.st_mtimespec.tv_sec == mtime.tv_sec &&
+        stats.st_mtimespec.tv_nsec == mtime.tv_nsec;
+}
+
+bool SyncDirectory::takePrefetched(const std::filesystem::path& relapath,
+                                   struct timespec& mtime) const
+{
+    const auto now = std::chrono::steady_clock::now();
+    const auto expiry = std::chrono::milliseconds(PREFETCH_EXPIRY_MS);
+    std::lock_guard<std::mutex> lk(_prefetchedMtx);
+    if (now - _prefetchedSweep >= expiry) {
+        /* the files never opened since their prefetch */
+        std::erase_if(_prefetched, [now, expiry](const auto& prefetched) {
+            return now - prefetched.second.time >= expiry;
+        });
+        _prefetchedSweep = now;
+    }
+
+    const auto it = _prefetched.find(relapath.string());
+    if (it == _prefetched.end()) {
+        return false;
+    }
+    if (now - it->second.time >= expiry) {
+        /* the listing is too old to stand for a check */
+        _prefetched.erase(it);
+        return false;
+    }
+    /* taken once: the listing stands for the check of the first opening
+     * only, whatever the lease, the next pulls checking the file again */
+    mtime = it->second.mtime;
+    _prefetched.erase(it);
+    return true;
+}
+
+bool SyncDirectory::decompress(const std::filesystem::path& abspath,
+                               const std::filesystem::path& relapath) const
+{
+    fileBuf_t buf;
+    {
+        std::ifstream file(abspath, std::ios::binary | std::ios::ate);
+        const auto len = file.tellg();
+        if (len < std::streamoff(ZSTD_FRAME_MAGIC_SIZE)) {
+            return false;
+        }
+        /* the magic first, to avoid reading the raw files */
+        buf.resize(ZSTD_FRAME_MAGIC_SIZE);
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(&buf[0]),
+                  static_cast<std::streamsize>(buf.size()));
+        if (!file || !Compression::MayBeCompressed(buf)) {
+            return false;
+        }
+        buf.resize(static_cast<size_t>(len));
+        file.read(reinterpret_cast<char*>(&buf[ZSTD_FRAME_MAGIC_SIZE]),
+                  len - std::streamoff(ZSTD_FRAME_MAGIC_SIZE));
+    }
+
+    size_t rawSz;
+    if (!isMarked(relapath, buf, rawSz)) {
+        return false;
+    }
+
+    DLOG("SyncDirectory", this, "Decompressing " << abspath)
+
+    const auto raw = Compression::Decompress(buf, rawSz);
+    std::ofstream file(abspath, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(raw.data()),
+               static_cast<std::streamsize>(raw.size()));
+    return true;
+}
+
+bool SyncDirectory::isMarked(const std::filesystem::path& relapath,
+                             const fileBuf_t& buf, size_t& rawSz) const
+{
+    if (!Compression::MayBeCompressed(buf)) {
+        /* a single round trip for the marker of the candidates only */
+        return false;
+    }
+
+    const auto markerPath =
+        std::filesystem::path(COMPRESSION_DIRNAME) / relapath;
+    if (!_conn->exists(markerPath)) {
+        return false;
+    }
+    const auto markerBuf = _conn->read(markerPath);
+    Compression::Marker marker;
+    if (markerBuf.size() != sizeof(marker)) {
+        return false;
+    }
+    std::memcpy(&marker, markerBuf.data(), sizeof(marker));
+    if (!Compression::IsMarked(buf, marker)) {
+        /* stale marker of a previous compressed content */
+        return false;
+    }
+
+    if (!Compression::IsAvailable()) {
+        std::ostringstream msg;
+        msg << "The remote copy of " << relapath << " is compressed but zstd "
+            "is disabled";
+        ELOG("SyncDirectory", this, msg.str())
+        throw std::runtime_error(msg.str());
+    }
+    rawSz = static_cast<size_t>(marker.rawSz);
+    return true;
+}
+
+fileBuf_t SyncDirectory::fetch(const std::filesystem::path& relapath,
+                               bool& compressed) const
+{
+    auto buf = _conn->read(relapath);
+    Task::AddBytes(buf.size());
+    size_t rawSz;
+    compressed = isMarked(relapath, buf, rawSz);
+    if (compressed) {
+        buf = Compression::Decompress(buf, rawSz);
+    }
+    return buf;
+}
+
+fileBuf_t SyncDirectory::fetchTail(const std::filesystem::path& relapath,
+                                   size_t offset) const
+{
+    fileBuf_t buf;
+    if (!_conn->readFrom(relapath, offset, buf)) {
+        DLOG("SyncDirectory", this, "Fallback to a full read of " << relapath)
+
+        buf = _conn->read(relapath);
+        buf.erase(buf.begin(), buf.begin() + std::ptrdiff_t(
+            std::min(offset, buf.size())));
+    }
+    Task::AddBytes(buf.size());
+    return buf;
+}
+
+void SyncDirectory::append(const std::filesystem::path& relapath,
+                           const fileBuf_t& buf) const
+{
+    if (_conn->append(relapath, buf)) {
+        return;
+    }
+
+    DLOG("SyncDirectory", this, "Fallback to a full push of " << relapath)
+
+    auto content = _conn->exists(relapath) ? _conn->read(relapath)
+        : fileBuf_t();
+    content.insert(content.end(), buf.begin(), buf.end());
+    _conn->write(relapath, content);
+}
+
+bool SyncDirectory::hasChanged(const std::filesystem::path& relapath,
+                               const struct timespec& lastMTime) const
+{
+    const auto stats = _conn->getStats(relapath);
+    return stats.st_size > 0 && stats.st_mtimespec > lastMTime;
+}
+
+bool SyncDirectory::pushCompressed(const std::filesystem::path& relapath,
+                                   const fileBuf_t& raw,
+                                   const fileBuf_t& compressed,
+                                   const struct timespec* mtime) const
+{
+    DLOG("SyncDirectory", this, "Pushing " << compressed.size() << " bytes "
+         "compressed from " << raw.size() << " of " << relapath)
+
+    /* the marker first: read with the previous content, it does not match
+     * it and the content is only taken as raw until pulled again */
+    const auto markerPath =
+        std::filesystem::path(COMPRESSION_DIRNAME) / relapath;
+    const auto marker = Compression::Mark(raw, compressed);
+    const auto markerBytes = reinterpret_cast<const unsigned char*>(&marker);
+    _conn->createDirs(markerPath.parent_path());
+    _conn->write(markerPath, fileBuf_t(markerBytes,
+                                       markerBytes + sizeof(marker)));
+    return push(relapath, compressed, {}, mtime);
+}
+
+bool SyncDirectory::push(const std::filesystem::path& relapath,
+                         const fileBuf_t& buf,
+                         const std::vector<connection::Range>& ranges,
+                         const struct timespec* mtime) const
+{
+    if (mtime != nullptr) {
+        auto expected = *mtime;
+        bool written;
+        if (_conn->writeIf(relapath, buf, ranges, expected, written)) {
+            return written;
+        }
+        /* the caller has just checked the mtime, which leaves only a narrow
+         * window to a concurrent push */
+        DLOG("SyncDirectory", this, "Fallback to an unconditional push of "
+             << relapath)
+    }
+
+    if (!ranges.empty()) {
+        DLOG("SyncDirectory", this, "Pushing " << ranges.size() << " ranges "
+             "of " << relapath)
+
+        if (_conn->writeRanges(relapath, buf, ranges)) {
+            return true;
+        }
+        DLOG("SyncDirectory", this, "Fallback to a full push of " << relapath)
+    }
     _conn->write(relapath, buf);
+    return true;
 }
@@ -0,0 +1,108 @@
+#include "fnifi/utils/Task.hpp"
+#ifdef __APPLE__
+#include <pthread.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+using namespace fnifi;
+using namespace fnifi::utils;
+
+thread_local Task* Task::_current = nullptr;
+
+bool Task::IsCancelled() {
+    return _current && _current->_cancelled;
+}
+
+void Task::AddFiles(size_t n) {
+    if (_current) {
+        _current->_files += n;
+    }
+}
+
+void Task::AddBytes(size_t n) {
+    if (_current) {
+        _current->_bytes += n;
+    }
+}
+
+void Task::LowerPriority() {
+    DLOG("Task", "(static)", "Lowering the priority")
+
+#ifdef __APPLE__
+    pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#elif defined(__linux__)
+    /* the nice value of a Linux thread is its own */
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+#endif
+}
+
+Task::Task(const std::function<void()>& job)
+: _cancelled(false), _done(false), _files(0), _bytes(0)
+{
+    DLOG("Task", this, "Instanciation")
+
+    _thread = std::thread([this, job]() {
+        _current = this;
+        try {
+            job();
+        } catch (...) {
+            _exception = std::current_exception();
+        }
+        _current = nullptr;
+        _done = true;
+
+        DLOG("Task", this, "Done after " << _files << " files and " << _bytes
+             << " bytes")
+    });
+}
+
+Task::~Task() {
+    cancel();
+    try {
+        wait();
+    } catch (...) {
+        /* the exception was not retrieved by the owner */
+    }
+}
+
+void Task::cancel() {
+    if (!_done) {
+        DLOG("Task", this, "Cancellation")
+        _cancelled = true;
+    }
+}
+
+void Task::wait() {
+    std::exception_ptr exception;
+    {
+        std::lock_guard<std::mutex> lk(_mtx);
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        exception = _exception;
+        _exception = nullptr;
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+bool Task::isDone() const {
+    return _done;
+}
+
+bool Task::isCancelled() const {
+    return _cancelled;
+}
+
+size_t Task::getFiles() const {
+    return _files;
+}
+
+size_t Task::getBytes() const {
+    return _bytes;
+}
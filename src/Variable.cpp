@@ -43,9 +43,8 @@ Variable::Variable(const std::string& key,
     }
 
     for (const auto& coll : colls) {
-        _infos.insert(std::make_pair(coll->getName(),
-            file::Info<expr_t>::Build(coll, _kind, _name)));
-   }
+        addCollection(*coll);
+    }
 }
 
 expr_t Variable::get(const file::File* file) {
@@ -54,8 +53,8 @@ expr_t Variable::get(const file::File* file) {
     /* WARNING: the actual file wrapped by the variable may not exists here
      * (but file != nullptr) */
 
-    const auto info = _infos.find(file->getCollectionName());
-    if (info == _infos.end()) {
+    const auto info = getInfo(file->getCollectionId());
+    if (!info) {
         ELOG("Info", this, "Lock called on a file that belongs to an "
              "unknown Collection (" << file->getCollectionName()
              << ") Aborting the call.")
@@ -63,36 +62,47 @@ expr_t Variable::get(const file::File* file) {
     }
 
     expr_t res;
-    if (info->second->get(file, res)) {
+    if (info->get(file, res)) {
         return res;
     }
     return EMPTY_EXPR_T;
 }
 
+Kind Variable::getKind() const {
+    return _kind;
+}
+
 void Variable::addCollection(const file::Collection& coll) {
-    _infos.insert(std::make_pair(coll.getName(),
-        file::Info<expr_t>::Build(&coll, _kind, _name)));
+    const auto id = coll.getId();
+    if (id >= _infos.size()) {
+        _infos.resize(id + 1, nullptr);
+    }
+    _infos[id] = file::Info<expr_t>::Build(&coll, _kind, _name);
 }
 
 
-void Variable::disableSync(const std::string& collName, bool pull) {
-    const auto info = _infos.find(collName);
-    if (info == _infos.end()) {
+void Variable::disableSync(collId_t collId, bool pull) {
+    const auto info = getInfo(collId);
+    if (!info) {
         ELOG("Info", this, "Lock called on a file that belongs to an "
-             "unknown Collection (" << collName << ") Aborting the call.")
+             "unknown Collection (" << collId << ") Aborting the call.")
         return;
     }
 
-    info->second->disableSync(pull);
+    info->disableSync(pull);
 }
 
-void Variable::enableSync(const std::string& collName, bool push) {
-    const auto info = _infos.find(collName);
-    if (info == _infos.end()) {
+void Variable::enableSync(collId_t collId, bool push) {
+    const auto info = getInfo(collId);
+    if (!info) {
         ELOG("Info", this, "Unlock called on a file that belongs to an "
-            "unknown Collection (" << collName << ") Aborting the call.")
+            "unknown Collection (" << collId << ") Aborting the call.")
         return;
     }
 
-    info->second->enableSync(push);
+    info->enableSync(push);
+}
+
+file::Info<expr_t>* Variable::getInfo(collId_t collId) const {
+    return collId < _infos.size() ? _infos[collId] : nullptr;
 }
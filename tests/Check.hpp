@@ -0,0 +1,51 @@
+#ifndef FNIFI_TESTS_CHECK_HPP
+#define FNIFI_TESTS_CHECK_HPP
+
+#include <iostream>
+#include <filesystem>
+#include <string>
+#include <cstdlib>
+
+/* report a failed condition without stopping the test */
+#define CHECK(cond) \
+    if (!(cond)) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" << #cond \
+            << ") failed" << std::endl; \
+        ++fnifi::tests::failures; \
+    }
+
+
+namespace fnifi {
+namespace tests {
+
+inline unsigned int failures = 0;
+
+/**
+ * Empty directory of the test, with the given subdirectories
+ */
+inline std::filesystem::path MakeDir(
+    const std::string& name,
+    std::initializer_list<std::string> subdirs = {})
+{
+    const auto path = std::filesystem::temp_directory_path() / "fnifi-tests"
+        / name;
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+    for (const auto& subdir : subdirs) {
+        std::filesystem::create_directories(path / subdir);
+    }
+    return path;
+}
+
+inline int Result() {
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+}  /* namespace tests */
+}  /* namespace fnifi */
+
+#endif  /* FNIFI_TESTS_CHECK_HPP */
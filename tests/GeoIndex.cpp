@@ -0,0 +1,148 @@
+#include "Check.hpp"
+#include <fnifi/FNIFI.hpp>
+#include <fnifi/file/GeoIndex.hpp>
+#include <fnifi/connection/Local.hpp>
+#include <fnifi/connection/Relative.hpp>
+#include <algorithm>
+#include <fstream>
+#include <numbers>
+#include <random>
+#include <cmath>
+#include <vector>
+
+using namespace fnifi;
+
+struct Coords {
+    expr_t lat;
+    expr_t lon;
+};
+
+/* great-circle distance in meters */
+static double Distance(const Coords& a, const Coords& b) {
+    const auto toRad = std::numbers::pi / 180.0 / 3600000.0;
+    const auto lat1 = static_cast<double>(a.lat) * toRad;
+    const auto lat2 = static_cast<double>(b.lat) * toRad;
+    const auto dLat = lat2 - lat1;
+    const auto dLon = static_cast<double>(b.lon - a.lon) * toRad;
+    const auto h = std::sin(dLat / 2) * std::sin(dLat / 2) +
+        std::cos(lat1) * std::cos(lat2) * std::sin(dLon / 2)
+        * std::sin(dLon / 2);
+    return 2.0 * 6371000.0 * std::asin(std::min(1.0, std::sqrt(h)));
+}
+
+/* write the Info column of the kind, by file id */
+static void WriteColumn(utils::SyncDirectory& sync, file::Collection& coll,
+                        expression::Kind kind,
+                        const std::vector<expr_t>& values)
+{
+    const auto path = file::Info<expr_t>::Build(&coll, kind)->getPath(true);
+    const expr_t empty = std::numeric_limits<expr_t>::max();
+    const auto emptyBytes = reinterpret_cast<const unsigned char*>(&empty);
+    utils::SyncDirectory::LoggedFile column(
+        sync, path, fileBuf_t(emptyBytes, emptyBytes + sizeof(empty)));
+    for (size_t id = 0; id < values.size(); ++id) {
+        column.set(id * sizeof(expr_t),
+                   reinterpret_cast<const unsigned char*>(&values[id]));
+    }
+    column.push();
+}
+
+int main() {
+    const auto dir = tests::MakeDir("GeoIndex", {"indexed", "remote",
+                                                 "local"});
+    const size_t n = 2000;
+    for (size_t i = 0; i < n; ++i) {
+        std::ofstream file(dir / "indexed" / ("f" + std::to_string(i)));
+        file << "x";
+    }
+
+    connection::Local local;
+    connection::Relative storing(&local, dir / "remote");
+    connection::Relative indexing(&local, dir / "indexed");
+    utils::SyncDirectory sync(&storing, dir / "local");
+    FNIFI fi(sync);
+    file::Collection coll(&indexing, sync);
+    fi.addCollection(coll);
+    fi.index();
+
+    /* half of the points around a city, some of them across the
+     * antimeridian */
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<expr_t> anyLat(-324000000, 324000000);
+    std::uniform_int_distribution<expr_t> anyLon(-648000000, 648000000);
+    std::uniform_int_distribution<expr_t> near(-5000000, 5000000);
+    std::vector<Coords> points(n);
+    std::vector<expr_t> lats(n);
+    std::vector<expr_t> lons(n);
+    for (size_t i = 0; i < n; ++i) {
+        if (i % 2) {
+            points[i] = {anyLat(rng), anyLon(rng)};
+        } else {
+            points[i] = {170000000 + near(rng), 645000000 + near(rng)};
+            if (points[i].lon > 648000000) {
+                points[i].lon -= 1296000000;
+            }
+        }
+        lats[i] = points[i].lat;
+        lons[i] = points[i].lon;
+    }
+    WriteColumn(sync, coll, expression::LATITUDE, lats);
+    WriteColumn(sync, coll, expression::LONGITUDE, lons);
+    file::Info<expr_t>::Free();
+
+    const auto index = file::GeoIndex::Build(&coll);
+    CHECK(index->size() == n)
+
+    for (size_t q = 0; q < 100; ++q) {
+        const Coords center = q % 3 ? Coords{170000000 + near(rng), 645000000}
+            : Coords{anyLat(rng), anyLon(rng)};
+        std::vector<double> dists(n);
+        for (size_t i = 0; i < n; ++i) {
+            dists[i] = Distance(center, points[i]);
+        }
+
+        const auto radius = static_cast<double>(q % 5 + 1) * 100000.0;
+        auto inRadius = index->findInRadius(center.lat, center.lon, radius);
+        std::sort(inRadius.begin(), inRadius.end());
+        std::vector<fileId_t> expected;
+        for (size_t i = 0; i < n; ++i) {
+            if (dists[i] <= radius) {
+                expected.push_back(static_cast<fileId_t>(i));
+            }
+        }
+        CHECK(inRadius == expected)
+
+        /* compared by distance, the ties being in any order */
+        const auto k = q % 17 + 1;
+        const auto nearest = index->findNearest(center.lat, center.lon, k);
+        auto sorted = dists;
+        std::sort(sorted.begin(), sorted.end());
+        CHECK(nearest.size() == k)
+        for (size_t j = 0; j < nearest.size() && j < k; ++j) {
+            CHECK(std::abs(dists[nearest[j]] - sorted[j]) < 1e-6)
+        }
+
+        const auto minLat = center.lat - 3000000;
+        const auto maxLat = center.lat + 3000000;
+        const auto minLon = center.lon - 10000000;
+        auto maxLon = center.lon + 10000000;
+        if (maxLon > 648000000) {
+            maxLon -= 1296000000;
+        }
+        auto inBox = index->findInBox(minLat, maxLat, minLon, maxLon);
+        std::sort(inBox.begin(), inBox.end());
+        expected.clear();
+        for (size_t i = 0; i < n; ++i) {
+            const auto& p = points[i];
+            const auto inLon = minLon <= maxLon ?
+                minLon <= p.lon && p.lon <= maxLon
+                : minLon <= p.lon || p.lon <= maxLon;
+            if (minLat <= p.lat && p.lat <= maxLat && inLon) {
+                expected.push_back(static_cast<fileId_t>(i));
+            }
+        }
+        CHECK(inBox == expected)
+    }
+
+    return tests::Result();
+}
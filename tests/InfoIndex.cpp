@@ -0,0 +1,95 @@
+#include "Check.hpp"
+#include <fnifi/FNIFI.hpp>
+#include <fnifi/file/InfoIndex.hpp>
+#include <fnifi/connection/Local.hpp>
+#include <fnifi/connection/Relative.hpp>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+using namespace fnifi;
+
+static void WriteFile(const std::filesystem::path& path, size_t size) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << std::string(size, 'x');
+}
+
+/* ids of the files of the Collection with a size in [min, max] */
+static std::vector<fileId_t> Scan(const file::Collection& coll,
+                                  const std::filesystem::path& indexed,
+                                  expr_t min, expr_t max)
+{
+    std::vector<fileId_t> res;
+    for (const auto& [id, file] : coll) {
+        const auto size = static_cast<expr_t>(
+            std::filesystem::file_size(indexed / file.getPath()));
+        if (min <= size && size <= max) {
+            res.push_back(id);
+        }
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+template<file::InfoType T>
+static void CheckRanges(const file::InfoIndex<T>* index,
+                        const file::Collection& coll,
+                        const std::filesystem::path& indexed)
+{
+    const std::vector<std::pair<expr_t, expr_t>> ranges = {
+        {0, 1000}, {50, 100}, {71, 71}, {72, 80}, {300, 10}, {150, 600}};
+    for (const auto& [min, max] : ranges) {
+        const auto expected = Scan(coll, indexed, min, max);
+        auto found = index->find(static_cast<T>(min), static_cast<T>(max));
+        std::sort(found.begin(), found.end());
+        CHECK(found == expected)
+        CHECK(index->count(static_cast<T>(min), static_cast<T>(max)) ==
+              expected.size())
+    }
+}
+
+int main() {
+    const auto dir = tests::MakeDir("InfoIndex", {"indexed", "remote",
+                                                  "local"});
+    const auto indexed = dir / "indexed";
+    for (size_t i = 0; i < 30; ++i) {
+        WriteFile(indexed / ("f" + std::to_string(i)), i * 10 + 1);
+    }
+
+    connection::Local local;
+    connection::Relative storing(&local, dir / "remote");
+    connection::Relative indexing(&local, indexed);
+    utils::SyncDirectory sync(&storing, dir / "local");
+    FNIFI fi(sync);
+    file::Collection coll(&indexing, sync);
+    fi.addCollection(coll);
+    fi.index();
+
+    auto index = file::InfoIndex<expr_t>::Build(&coll, expression::SIZE);
+    CheckRanges(index, coll, indexed);
+    CheckRanges(file::InfoIndex<uint64_t>::Build(&coll, expression::SIZE),
+                coll, indexed);
+
+    /* kept up to date by the indexation */
+    std::filesystem::remove(indexed / "f6");
+    WriteFile(indexed / "new", 77);
+    WriteFile(indexed / "f2", 500);
+    fi.index();
+    CheckRanges(index, coll, indexed);
+
+    fi.range(expression::SIZE, 50, 100);
+    CHECK(fi.count() == Scan(coll, indexed, 50, 100).size())
+    fi.clearRanges();
+    CHECK(fi.count() == coll.size())
+
+    /* loaded back from its journal */
+    for (size_t i = 0; i < 20; ++i) {
+        WriteFile(indexed / ("n" + std::to_string(i)), i + 500);
+        fi.index();
+    }
+    file::AInfoIndex::FreeAll();
+    index = file::InfoIndex<expr_t>::Build(&coll, expression::SIZE);
+    CheckRanges(index, coll, indexed);
+
+    return tests::Result();
+}
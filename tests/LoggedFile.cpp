@@ -0,0 +1,142 @@
+#include "Check.hpp"
+#include <fnifi/utils/SyncDirectory.hpp>
+#include <fnifi/connection/Local.hpp>
+#include <fnifi/connection/Relative.hpp>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+
+using namespace fnifi;
+
+static const int64_t EMPTY = -1;
+
+static fileBuf_t EmptySlot() {
+    const auto bytes = reinterpret_cast<const unsigned char*>(&EMPTY);
+    return fileBuf_t(bytes, bytes + sizeof(EMPTY));
+}
+
+static int64_t Get(const utils::SyncDirectory::LoggedFile& file, size_t id) {
+    int64_t value = EMPTY;
+    if ((id + 1) * sizeof(value) <= file.size()) {
+        std::memcpy(&value, file.data() + id * sizeof(value), sizeof(value));
+    }
+    return value;
+}
+
+static void Set(utils::SyncDirectory::LoggedFile& file, size_t id,
+                int64_t value)
+{
+    file.set(id * sizeof(value),
+             reinterpret_cast<const unsigned char*>(&value));
+    file.push();
+}
+
+/* the records of a client are replayed by the others */
+static void TestReplay(connection::IConnection* storing,
+                       const std::filesystem::path& dir)
+{
+    utils::SyncDirectory syncA(storing, dir / "a");
+    utils::SyncDirectory syncB(storing, dir / "b");
+    utils::SyncDirectory::LoggedFile a(syncA, "replay", EmptySlot());
+    for (int64_t i = 0; i < 200; ++i) {
+        Set(a, static_cast<size_t>(i * 37 % 1000), i);
+    }
+    CHECK(std::filesystem::file_size(dir / "remote" / "replay.log") > 0)
+
+    utils::SyncDirectory::LoggedFile b(syncB, "replay", EmptySlot());
+    CHECK(Get(b, 37) == 1)
+    CHECK(Get(b, 199 * 37 % 1000) == 199)
+    CHECK(Get(b, 1) == EMPTY)
+
+    Set(b, 5, 555);
+    Set(b, 37, 3737);
+    CHECK(a.pull())
+    CHECK(Get(a, 5) == 555)
+    CHECK(Get(a, 37) == 3737)
+    CHECK(!a.pull())
+
+    /* the updates not pushed yet win over the replayed ones */
+    syncA.setWriteBehind(100000);
+    Set(a, 7, 70);
+    Set(b, 7, 71);
+    a.pull();
+    CHECK(Get(a, 7) == 70)
+    syncA.flush();
+    b.pull();
+    CHECK(Get(b, 7) == 70)
+    syncA.setWriteBehind(0);
+}
+
+/* the log is merged into the column once bigger, without losing records */
+static void TestCompaction(connection::IConnection* storing,
+                           const std::filesystem::path& dir)
+{
+    utils::SyncDirectory syncA(storing, dir / "a");
+    utils::SyncDirectory syncB(storing, dir / "b");
+    utils::SyncDirectory::LoggedFile a(syncA, "compaction", EmptySlot());
+    utils::SyncDirectory::LoggedFile b(syncB, "compaction", EmptySlot());
+    Set(a, 999, 27);
+    for (int64_t i = 0; i < 4000; ++i) {
+        Set(b, static_cast<size_t>(i % 50), i);
+    }
+    const auto recordsSz = 4000 * (2 * sizeof(uint64_t) + sizeof(int64_t));
+    CHECK(std::filesystem::file_size(dir / "remote" / "compaction.log") <
+          recordsSz)
+    CHECK(std::filesystem::file_size(dir / "remote" / "compaction") > 0)
+
+    CHECK(a.pull())
+    CHECK(Get(a, 49) == 3999)
+    CHECK(Get(a, 0) == 3950)
+    CHECK(Get(a, 999) == 27)
+
+    utils::SyncDirectory syncC(storing, dir / "c");
+    utils::SyncDirectory::LoggedFile c(syncC, "compaction", EmptySlot());
+    CHECK(Get(c, 49) == 3999)
+    CHECK(Get(c, 999) == 27)
+}
+
+/* compactions racing with the appends of another client */
+static void TestConcurrentCompaction(connection::IConnection* storing,
+                                     const std::filesystem::path& dir)
+{
+    const size_t n = 3000;
+    {
+        utils::SyncDirectory syncA(storing, dir / "a");
+        utils::SyncDirectory syncB(storing, dir / "b");
+        utils::SyncDirectory::LoggedFile a(syncA, "concurrent", EmptySlot());
+        utils::SyncDirectory::LoggedFile b(syncB, "concurrent", EmptySlot());
+        const auto run = [n](utils::SyncDirectory::LoggedFile* file,
+                             size_t first)
+        {
+            for (size_t id = first; id < first + n; ++id) {
+                Set(*file, id, static_cast<int64_t>(id));
+            }
+        };
+        std::thread threadA(run, &a, 0);
+        std::thread threadB(run, &b, n);
+        threadA.join();
+        threadB.join();
+    }
+
+    utils::SyncDirectory syncC(storing, dir / "c");
+    utils::SyncDirectory::LoggedFile c(syncC, "concurrent", EmptySlot());
+    size_t lost = 0;
+    for (size_t id = 0; id < 2 * n; ++id) {
+        if (Get(c, id) != static_cast<int64_t>(id)) {
+            ++lost;
+        }
+    }
+    CHECK(lost == 0)
+}
+
+int main() {
+    const auto dir = tests::MakeDir("LoggedFile", {"remote", "a", "b", "c"});
+    connection::Local local;
+    connection::Relative storing(&local, dir / "remote");
+
+    TestReplay(&storing, dir);
+    TestCompaction(&storing, dir);
+    TestConcurrentCompaction(&storing, dir);
+
+    return tests::Result();
+}
@@ -0,0 +1,141 @@
+#include "Check.hpp"
+#include <fnifi/utils/SyncDirectory.hpp>
+#include <fnifi/connection/Local.hpp>
+#include <fnifi/connection/Relative.hpp>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <limits>
+#include <cstdint>
+
+using namespace fnifi;
+
+static const uint64_t EMPTY = std::numeric_limits<uint64_t>::max();
+
+static std::string Read(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+/* slots of a column file, "_" for the empty ones */
+static std::string Slots(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::string res;
+    uint64_t value;
+    while (utils::Deserialize(file, value)) {
+        res += (value == EMPTY ? "_" : std::to_string(value)) + " ";
+    }
+    return res;
+}
+
+static void Put(utils::SyncDirectory::FileStream& file, size_t id,
+                uint64_t value)
+{
+    file.seekp(static_cast<std::streamoff>(id * sizeof(value)));
+    utils::Serialize(file, value);
+}
+
+/* the non-empty slots pushed concurrently are merged */
+static void TestSlots(utils::SyncDirectory& syncA, utils::SyncDirectory& syncB,
+                      const std::filesystem::path& dir)
+{
+    const auto bytes = reinterpret_cast<const unsigned char*>(&EMPTY);
+    const fileBuf_t emptySlot(bytes, bytes + sizeof(EMPTY));
+    auto a = syncA.open("slots", true);
+    a.setMergeable(emptySlot);
+    auto b = syncB.open("slots", true);
+    b.setMergeable(emptySlot);
+
+    for (size_t id = 0; id < 4; ++id) {
+        Put(a, id, EMPTY);
+    }
+    Put(a, 1, 11);
+    a.push();
+    for (size_t id = 0; id < 6; ++id) {
+        Put(b, id, EMPTY);
+    }
+    Put(b, 3, 33);
+    Put(b, 5, 55);
+    b.push();
+    CHECK(Slots(dir / "remote" / "slots") == "_ 11 _ 33 _ 55 ")
+    CHECK(Slots(dir / "b" / "slots") == "_ 11 _ 33 _ 55 ")
+
+    /* emptied by the client which has pulled it */
+    Put(a, 1, EMPTY);
+    Put(a, 2, 22);
+    a.push();
+    CHECK(Slots(dir / "remote" / "slots") == "_ _ 22 33 _ 55 ")
+    b.pull();
+    CHECK(Slots(dir / "b" / "slots") == "_ _ 22 33 _ 55 ")
+}
+
+/* the trailing partial slot is kept, and a deferred push is merged by its
+ * owner */
+static void TestTail(utils::SyncDirectory& syncA, utils::SyncDirectory& syncB,
+                     const std::filesystem::path& dir)
+{
+    auto a = syncA.open("tail");
+    a.setMergeable(fileBuf_t(4, '.'));
+    auto b = syncB.open("tail");
+    b.setMergeable(fileBuf_t(4, '.'));
+
+    a << "AAAA....xy";
+    a.push();
+    b << "....BBBB";
+    b.push();
+    CHECK(Read(dir / "remote" / "tail") == "AAAABBBBxy")
+    CHECK(Read(dir / "b" / "tail") == "AAAABBBBxy")
+
+    syncB.setWriteBehind(20);
+    a.seekp(0);
+    a << "CCCC";
+    a.push();
+    b.seekp(8);
+    b << "zw";
+    b.push();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(Read(dir / "remote" / "tail") == "CCCCBBBBxy")
+
+    b.pull();
+    CHECK(Read(dir / "remote" / "tail") == "CCCCBBBBzw")
+    CHECK(Read(dir / "b" / "tail") == "CCCCBBBBzw")
+    syncB.setWriteBehind(0);
+}
+
+/* without empty slot, the push of the second client is reported as
+ * conflicting and redone once pulled, whatever the lease */
+static void TestPlain(utils::SyncDirectory& syncA, utils::SyncDirectory& syncB,
+                      const std::filesystem::path& dir)
+{
+    auto a = syncA.open("plain");
+    auto b = syncB.open("plain");
+    a << "aaaa";
+    CHECK(a.push())
+    syncB.setLease(100000);
+    b << "bb";
+    CHECK(!b.push())
+    CHECK(Read(dir / "remote" / "plain") == "aaaa")
+    CHECK(Read(dir / "b" / "plain") == "bb")
+
+    CHECK(b.pull())
+    CHECK(Read(dir / "b" / "plain") == "aaaa")
+    b.seekp(0, std::ios::end);
+    b << "bb";
+    CHECK(b.push())
+    CHECK(Read(dir / "remote" / "plain") == "aaaabb")
+    syncB.setLease(0);
+}
+
+int main() {
+    const auto dir = tests::MakeDir("MergeConflict", {"remote", "a", "b"});
+    connection::Local local;
+    connection::Relative storing(&local, dir / "remote");
+    utils::SyncDirectory syncA(&storing, dir / "a");
+    utils::SyncDirectory syncB(&storing, dir / "b");
+
+    TestSlots(syncA, syncB, dir);
+    TestTail(syncA, syncB, dir);
+    TestPlain(syncA, syncB, dir);
+
+    return tests::Result();
+}
@@ -0,0 +1,106 @@
+#include "Check.hpp"
+#include <fnifi/file/PathIndex.hpp>
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <sstream>
+#include <vector>
+
+using namespace fnifi;
+
+static std::string Lower(std::string str) {
+    std::transform(str.begin(), str.end(), str.begin(), [](char c) {
+        return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    return str;
+}
+
+/* ids of the paths matching the pattern, by scanning them */
+static std::vector<fileId_t> Scan(const std::vector<std::string>& paths,
+                                  const std::vector<bool>& removed,
+                                  const std::string& pattern, bool prefix)
+{
+    const auto lower = Lower(pattern);
+    std::vector<fileId_t> res;
+    for (size_t id = 0; id < paths.size(); ++id) {
+        const auto path = Lower(paths[id]);
+        if (!removed[id] && (prefix ? path.starts_with(lower)
+                             : path.find(lower) != std::string::npos))
+        {
+            res.push_back(static_cast<fileId_t>(id));
+        }
+    }
+    return res;
+}
+
+int main() {
+    const std::vector<std::string> dirs = {"Photos", "photos/2023", "Docs",
+                                           "music/Live", "tmp"};
+    const std::vector<std::string> names = {"IMG_", "scan", "Holiday",
+                                            "report", "a"};
+    std::mt19937 rng(1);
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < 2000; ++i) {
+        paths.push_back(dirs[rng() % dirs.size()] + "/" +
+                        names[rng() % names.size()] +
+                        std::to_string(rng() % 500) + ".jpg");
+    }
+
+    file::PathIndex index;
+    std::vector<bool> removed(paths.size(), false);
+    for (size_t id = 0; id < paths.size(); ++id) {
+        index.insert(static_cast<fileId_t>(id), paths[id]);
+    }
+    CHECK(index.size() == paths.size())
+
+    const std::vector<std::string> patterns = {"img_1", "HOLIDAY", "2023/",
+                                               "photos", "e", "jp", ".jpg",
+                                               "docs/report4", "missing"};
+    const auto checkAll = [&]() {
+        for (const auto& pattern : patterns) {
+            for (const auto prefix : {false, true}) {
+                CHECK(index.find(pattern, prefix) ==
+                      Scan(paths, removed, pattern, prefix))
+            }
+        }
+    };
+    checkAll();
+
+    /* removed, then moved */
+    for (size_t id = 0; id < paths.size(); id += 3) {
+        index.remove(static_cast<fileId_t>(id));
+        removed[id] = true;
+    }
+    for (size_t id = 1; id < paths.size(); id += 7) {
+        paths[id] = "Moved/" + paths[id];
+        index.insert(static_cast<fileId_t>(id), paths[id]);
+        removed[id] = false;
+    }
+    checkAll();
+    CHECK(index.find("moved/", true) ==
+          Scan(paths, removed, "moved/", true))
+    CHECK(index.matches(1, "MOVED", true))
+    CHECK(!index.matches(0, "photos"))
+
+    /* saved and loaded back, a truncated content being rejected */
+    std::stringstream saved;
+    index.save(saved);
+    file::PathIndex loaded;
+    CHECK(loaded.load(saved))
+    CHECK(loaded.size() == index.size())
+    for (const auto& pattern : patterns) {
+        CHECK(loaded.find(pattern) == index.find(pattern))
+        CHECK(loaded.find(pattern, true) == index.find(pattern, true))
+    }
+    auto content = saved.str();
+    content.resize(content.size() / 2);
+    std::stringstream truncated(content);
+    CHECK(!loaded.load(truncated))
+    CHECK(loaded.size() == 0)
+
+    index.clear();
+    CHECK(index.size() == 0)
+    CHECK(index.find("jpg").empty())
+
+    return tests::Result();
+}